@@ -0,0 +1,327 @@
+#!/usr/bin/env bash
+
+# Benchmarks denv on a table of its own bind path, each part on its own:
+#   codecs      times save and load with every codec denv was built with,
+#               in MB/s of live variables, the size of an uncompressed save
+#   gets        gets per second of the CLI attaching the table and through a
+#               daemon, of denv_get on an attached table and of a client
+#               pipelining them over the daemon socket
+#   contention  a writer and 1 to nproc readers, processes built against
+#               denv.h sharing one table, writes/s and reads/s of each count
+#   lookup      ns per lookup that finds a name and per one that doesn't, in
+#               tables of 1k, 10k and 100k names built in private memory
+#
+#   ./bench.sh [variables] [part...]
+#
+# DENV can point at a denv of an older version to compare with. The
+# programs of the gets, contention and lookup parts are built from the denv.h
+# in the directory DENV_H for the same.
+
+set -e
+
+denv=${DENV:-./denv}
+count=${1:-100000}
+parts=${*:2}
+parts=${parts:-codecs gets contention lookup}
+dir=$(mktemp -d)
+
+daemon=""
+
+trap '[ -n "$daemon" ] && kill $daemon; $denv drop -fb "$dir" >/dev/null 2>&1; rm -rf "$dir"' EXIT
+
+now() {
+    date +%s%N
+}
+
+# build <program>, $dir/<program>.c against denv.h
+build() {
+    local version=($(tr '.' ' ' < "$(dirname "$0")/version"))
+    cc -O2 -I"${DENV_H:-$(dirname "$0")}" "$dir/$1.c" -o "$dir/$1" \
+        -lz -pthread -DDENV_VERSION_A=${version[0]} \
+        -DDENV_VERSION_B=${version[1]} -DDENV_VERSION_C=${version[2]}
+}
+
+# paths, numbers, short words and base64 blobs like a real environment
+fill() {
+    awk -v count="$count" 'BEGIN {
+        srand(1)
+        for (i = 0; i < count; i++) {
+            kind = i % 4
+            if (kind == 0)
+                value = "/usr/local/lib/app" i "/bin:/usr/bin:/bin"
+            else if (kind == 1)
+                value = int(rand() * 1000000)
+            else if (kind == 2)
+                value = "enabled=" (i % 2 ? "true" : "false") ";retries=" i % 7
+            else {
+                value = ""
+                for (j = 0; j < 48; j++)
+                    value = value substr("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/", int(rand() * 64) + 1, 1)
+            }
+            printf "set BENCH_%d %s\n", i, value
+        }
+    }' > "$dir/fill"
+
+    $denv batch -b "$dir" "$dir/fill" > /dev/null
+}
+
+bench_codecs() {
+    $denv save -b "$dir" --codec none "$dir/raw.save"
+    local raw=$(stat -c %s "$dir/raw.save")
+
+    printf "%d variables, %d bytes live\n" "$count" "$raw"
+    printf "%-6s %12s %8s %12s %12s\n" codec bytes ratio "save MB/s" "load MB/s"
+
+    for codec in none zlib lz4 zstd; do
+        local start=$(now)
+        if ! $denv save -b "$dir" --codec $codec "$dir/$codec.save" 2>/dev/null
+        then
+            printf "%-6s %12s\n" $codec "not built"
+            continue
+        fi
+        local saved=$(now)
+        $denv load -fb "$dir" "$dir/$codec.save"
+        local loaded=$(now)
+
+        local size=$(stat -c %s "$dir/$codec.save")
+        awk -v c=$codec -v s=$size -v r=$raw -v save=$((saved - start)) \
+            -v load=$((loaded - saved)) 'BEGIN {
+            printf "%-6s %12d %8.2f %12.1f %12.1f\n", c, s, r / s,
+                   r / save * 1000, r / load * 1000
+        }'
+    done
+}
+
+# gets of existing names per second, a process each like in a shell script
+gets=1000
+get_rate() {
+    local start=$(now)
+    for i in $(seq $gets); do
+        $denv get -b "$dir" BENCH_$((i * 7919 % count)) > /dev/null
+    done
+    awk -v n=$gets -v t=$(($(now) - start)) 'BEGIN { printf "%.0f", n / t * 1e9 }'
+}
+
+bench_gets() {
+    cat > "$dir/gets.c" <<'EOF'
+#define DENV_IMPLEMENTATION
+#include "denv.h"
+#include <time.h>
+
+/* gets <bind> <variables> <gets> <depth>, prints gets per second of
+   denv_get when depth is 0, of depth requests at a time over the daemon
+   socket otherwise
+*/
+int main(int argc, char **argv) {
+    long count = atol(argv[2]), gets = atol(argv[3]), depth = atol(argv[4]);
+    char (*names)[24] = malloc(gets * 24);
+    for (long i = 0; i < gets; i++)
+        snprintf(names[i], 24, "BENCH_%ld", i * 7919 % count);
+
+    DenvTable *table = NULL;
+    DenvClient client;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/denv.sock", argv[1]);
+    if (depth == 0 ? (table = denv_attach(argv[1])) == NULL
+                   : denv_client_connect(&client, path) != 0)
+        return 1;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (long i = 0; i < gets && depth == 0; i++) {
+        char value[256];
+        if (denv_get(table, names[i], value, sizeof(value)) < 0)
+            return 1;
+    }
+
+    // the whole window goes in one flush, then its responses are read
+    for (long i = 0; i < gets && depth > 0; i += depth) {
+        long n = gets - i < depth ? gets - i : depth;
+        DenvResponse resp;
+        char *value;
+
+        for (long j = 0; j < n; j++) {
+            if (denv_client_request(&client, (DenvRequest){.op = DENV_OP_GET},
+                                    names[i + j], NULL, NULL) != 0)
+                return 1;
+        }
+        for (long j = 0; j < n; j++) {
+            if (denv_client_response(&client, &resp, &value) != 0 ||
+                resp.status != 0)
+                return 1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%.0f\n", gets / ((end.tv_sec - start.tv_sec) +
+                             (end.tv_nsec - start.tv_nsec) / 1e9));
+
+    return 0;
+}
+EOF
+    build gets
+
+    printf "%-16s %12s\n" get "per second"
+    printf "%-16s %12s\n" "cli attach" "$(get_rate)"
+    printf "%-16s %12s\n" denv_get "$("$dir/gets" "$dir" $count 1000000 0)"
+
+    $denv daemon -b "$dir" - > /dev/null 2>&1 &
+    daemon=$!
+    until $denv get -b "$dir" BENCH_0 > /dev/null 2>&1 &&
+        [ -S "$dir/denv.sock" ]
+    do
+        sleep 0.1
+    done
+    printf "%-16s %12s\n" "cli socket" "$(get_rate)"
+    for depth in 1 16 256; do
+        printf "%-16s %12s\n" "socket depth $depth" \
+            "$("$dir/gets" "$dir" $count 200000 $depth)"
+    done
+    kill $daemon
+    wait $daemon || true
+    daemon=""
+}
+
+bench_contention() {
+    cat > "$dir/contend.c" <<'EOF'
+#define DENV_IMPLEMENTATION
+#include "denv.h"
+#include <sys/wait.h>
+
+/* contend <bind> <readers> <seconds>, a writer setting 4 names and readers
+   getting them, each a process attaching the table. Prints writes/s, reads/s
+   and reads/s per reader.
+*/
+int main(int argc, char **argv) {
+    int readers = atoi(argv[2]), seconds = atoi(argv[3]);
+    char *names[] = {"CONTEND_1", "CONTEND_2", "CONTEND_3", "CONTEND_4"};
+
+    // the ops of every process, the writer's first
+    struct {
+        _Atomic int attached;
+        _Atomic bool stop;
+        long ops[];
+    } *shared = mmap(NULL, 4096, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    for (int p = 0; p <= readers; p++) {
+        if (fork() != 0)
+            continue;
+
+        DenvTable *table = denv_attach(argv[1]);
+        atomic_fetch_add(&shared->attached, 1);
+        if (table == NULL)
+            _exit(1);
+
+        long n = 0;
+        char value[64];
+        while (!atomic_load_explicit(&shared->stop, memory_order_relaxed)) {
+            if (p == 0) {
+                int len = snprintf(value, sizeof(value), "written %ld times", n);
+                denv_set(table, names[n % 4], value, len, false);
+            } else {
+                denv_get(table, names[n % 4], value, sizeof(value));
+            }
+            n++;
+        }
+
+        shared->ops[p] = n;
+        _exit(0);
+    }
+
+    while (atomic_load(&shared->attached) <= readers)
+        usleep(1000);
+    sleep(seconds);
+    atomic_store(&shared->stop, true);
+
+    int status, failed = 0;
+    while (wait(&status) != -1)
+        failed |= status != 0;
+
+    long reads = 0;
+    for (int p = 1; p <= readers; p++)
+        reads += shared->ops[p];
+    printf(" %12.0f %12.0f %14.0f\n", (double)shared->ops[0] / seconds,
+           (double)reads / seconds, (double)reads / seconds / readers);
+
+    return failed;
+}
+EOF
+    build contend
+
+    for w in $(seq 4); do
+        $denv set -b "$dir" CONTEND_$w "written 0 times"
+    done
+
+    printf "%-8s %12s %12s %14s\n" readers "writes/s" "reads/s" "reads/s each"
+    for readers in $(seq $(nproc)); do
+        printf "%-8d" $readers
+        "$dir/contend" "$dir" $readers 2
+    done
+}
+
+bench_lookup() {
+    cat > "$dir/lookup.c" <<'EOF'
+#define DENV_IMPLEMENTATION
+#include "denv.h"
+#include <time.h>
+
+// lookup <variables>, prints the ns per hit and per miss
+int main(int argc, char **argv) {
+    long count = atol(argv[1]), lookups = 4000000, found = 0;
+    Word elements = 1;
+    while (elements < (Word)count * 2)
+        elements <<= 1;
+    Word block = (1 << 20) + count * 8;
+
+    // never grows, so it doesn't need a segment
+    size_t size = denv_table_size(elements, block);
+    Table *table = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    sem_init(&table->denv_sem, 1, 1);
+    denv_table_init(table, elements, block);
+
+    char (*hits)[24] = malloc(count * 24), (*misses)[24] = malloc(count * 24);
+    for (long i = 0; i < count; i++) {
+        snprintf(hits[i], 24, "LOOKUP_%ld", i);
+        snprintf(misses[i], 24, "MISSING_%ld", i);
+        denv_table_set_value(table, hits[i], "value", 0);
+    }
+
+    for (int miss = 0; miss < 2; miss++) {
+        char (*names)[24] = miss ? misses : hits;
+        struct timespec start, end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long i = 0; i < lookups; i++)
+            found += denv_table_get_element(table,
+                                            names[i * 7919 % count]) != NULL;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        printf(" %12.1f", ((end.tv_sec - start.tv_sec) * 1e9 +
+                           (end.tv_nsec - start.tv_nsec)) / lookups);
+    }
+    printf("\n");
+
+    return found == lookups ? 0 : 1;
+}
+EOF
+    build lookup
+
+    printf "%-10s %12s %12s\n" variables "hit ns" "miss ns"
+    for variables in 1000 10000 100000; do
+        printf "%-10d" $variables
+        "$dir/lookup" $variables
+    done
+}
+
+for part in $parts; do
+    case $part in
+    codecs | gets)
+        [ -e "$dir/fill" ] || fill
+        ;;
+    esac
+    [ "$part" == "${parts%% *}" ] || echo
+    bench_$part
+done
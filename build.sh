@@ -5,14 +5,26 @@ set -ex
 version=($(cat version | tr '.' ' '))
 OS=$(uname -s)
 
+# save codecs besides zlib, built in when their headers are installed
+codec_flags=""
+codec_libs=""
+if echo "#include <lz4frame.h>" | cc -E - >/dev/null 2>&1; then
+    codec_flags="$codec_flags -DDENV_WITH_LZ4"
+    codec_libs="$codec_libs -llz4"
+fi
+if echo "#include <zstd.h>" | cc -E - >/dev/null 2>&1; then
+    codec_flags="$codec_flags -DDENV_WITH_ZSTD"
+    codec_libs="$codec_libs -lzstd"
+fi
+
 if [ "$1" = "debug" ]
 then
     case $OS in
         Linux)
-        	cc main.c -o denv -lz -g -Og -fsanitize=address,undefined -Wall -DDENV_VERSION_A=${version[0]} -DDENV_VERSION_B=${version[1]} -DDENV_VERSION_C=${version[2]} -DDEBUG_ON
+        	cc main.c -o denv -lz $codec_libs -pthread -g -Og -fsanitize=address,undefined -Wall -DDENV_VERSION_A=${version[0]} -DDENV_VERSION_B=${version[1]} -DDENV_VERSION_C=${version[2]} $codec_flags -DDEBUG_ON
         ;;
         NetBSD)
-            cc main.c -o denv -lz -lrt -g -Og -Wall -DDENV_VERSION_A=${version[0]} -DDENV_VERSION_B=${version[1]} -DDENV_VERSION_C=${version[2]} -DDEBUG_ON
+            cc main.c -o denv -lz $codec_libs -pthread -lrt -g -Og -Wall -DDENV_VERSION_A=${version[0]} -DDENV_VERSION_B=${version[1]} -DDENV_VERSION_C=${version[2]} $codec_flags -DDEBUG_ON
         ;;
         # FreeBSD)
         # ;;
@@ -24,13 +36,35 @@ then
         ;;
     esac
 	echo "debug mode"
+elif [ "$1" = "lib" ]
+then
+    # only the stable API in denv.h is exported from the shared library
+    flags="-O2 -Wall -fPIC -pthread -fvisibility=hidden -DDENV_VERSION_A=${version[0]} -DDENV_VERSION_B=${version[1]} -DDENV_VERSION_C=${version[2]}"
+    case $OS in
+        Linux)
+            cc -c libdenv.c -o libdenv.o $flags $codec_flags
+            cc -shared libdenv.o -o libdenv.so -lz $codec_libs -pthread
+        ;;
+        NetBSD)
+            cc -c libdenv.c -o libdenv.o $flags $codec_flags
+            cc -shared libdenv.o -o libdenv.so -lz $codec_libs -pthread -lrt
+        ;;
+        *)
+            echo "OS unsupported!"
+            exit -1
+        ;;
+    esac
+    # hidden symbols are local in the archive too, only the API is linked to
+    objcopy --localize-hidden libdenv.o
+    ar rcs libdenv.a libdenv.o
+    rm libdenv.o
 else
     case $OS in
         Linux)
-        	cc main.c -o denv -lz -O2 -Wall -DDENV_VERSION_A=${version[0]} -DDENV_VERSION_B=${version[1]} -DDENV_VERSION_C=${version[2]}
+        	cc main.c -o denv -lz $codec_libs -pthread -O2 -Wall -DDENV_VERSION_A=${version[0]} -DDENV_VERSION_B=${version[1]} -DDENV_VERSION_C=${version[2]} $codec_flags
         ;;
         NetBSD)
-            cc main.c -o denv -lz -lrt -O2 -Wall -DDENV_VERSION_A=${version[0]} -DDENV_VERSION_B=${version[1]} -DDENV_VERSION_C=${version[2]}
+            cc main.c -o denv -lz $codec_libs -pthread -lrt -O2 -Wall -DDENV_VERSION_A=${version[0]} -DDENV_VERSION_B=${version[1]} -DDENV_VERSION_C=${version[2]} $codec_flags
         ;;
         # FreeBSD)
         # ;;
@@ -1,27 +1,296 @@
 #ifndef _DENV_H
 #define _DENV_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Stable API, the part of denv that libdenv exports. Define
+   DENV_IMPLEMENTATION before including this header in one file to build denv
+   into it instead of linking libdenv, the internals are only visible there.
+   A process attaches one table at a time, denv_attach fails with EBUSY until
+   the attached one is detached.
+*/
+#define DENV_API __attribute__((visibility("default")))
+
+typedef struct DenvTable DenvTable;
+
+// Points into the table, valid while denv_view_is_valid says so
+typedef struct {
+    const char *value;
+    size_t len;
+    uint64_t version; // of the table when the view was taken
+    int pin;          // slot holding the value in place, -1 if not pinned
+    int segment;      // the pin belongs to, set by denv_view_pin
+} DenvView;
+
+typedef struct {
+    size_t total_size; // in bytes
+    size_t data_offset; // words used at the end of the block
+    size_t used;
+    size_t removed;
+    size_t max_elements;
+    size_t block_size; // in words
+    size_t free_words;
+    size_t free_slices;
+    double fragmentation;
+    long saved_bytes;
+} DenvStats;
+
+// Returning non-zero stops denv_iterate
+typedef int (*DenvIterator)(const char *name, const char *value,
+                            size_t value_len, bool is_env, void *arg);
+
+typedef enum {
+    DENV_SHM_SYSV = 0, // shmget segment keyed by ftok, grows by moving
+    DENV_SHM_POSIX,    // shm_open object, its block grows with ftruncate
+    DENV_SHM_FILE,     // file under the bind path, it outlives a reboot
+} DenvShmBackend;
+
+typedef enum {
+    DENV_SHM_POPULATE = (1 << 0),   // fault the whole table in when mapped
+    DENV_SHM_HUGE_PAGES = (1 << 1), // ask for transparent huge pages
+} DenvShmFlags;
+
+typedef struct {
+    DenvShmBackend backend; // only used by the process creating the table
+    int flags;              // DenvShmFlags, for this process' mapping
+} DenvShmOptions;
+
+typedef enum {
+    DENV_DURABILITY_NONE = 0, // writes are only in memory until a save
+    DENV_DURABILITY_LOG,      // logged, on disk by the next daemon interval
+    DENV_DURABILITY_SYNC,     // on disk before the write returns
+} DenvDurability;
+
+/* Attaches the table bound to an existing path, creating it the first time.
+   Returns NULL with errno EBUSY if this process already has one attached.
+*/
+DENV_API DenvTable *denv_attach(const char *path);
+DENV_API DenvTable *denv_attach_with(const char *path,
+                                     const DenvShmOptions *options);
+DENV_API void denv_detach(DenvTable *table);
+
+/* Writes a table file to disk as it is between two writes, does nothing for
+   tables in shared memory. Returns -1 if msync failed.
+*/
+DENV_API int denv_sync(DenvTable *table);
+
+/* Copies the value into buf, up to size bytes and a '\0' if it fits. Returns
+   the length of the whole value, -1 if the name isn't set.
+*/
+DENV_API ssize_t denv_get(DenvTable *table, const char *name, void *buf,
+                          size_t size);
+
+/* Points view at the value without copying it, returns -1 if the name isn't
+   set. A write can change the bytes under it, they can only be trusted if
+   denv_view_is_valid returns true after they were used.
+*/
+DENV_API int denv_view(DenvTable *table, const char *name, DenvView *view);
+DENV_API bool denv_view_is_valid(DenvTable *table, const DenvView *view);
+
+/* Points view at the value and keeps the bytes in place until the view is
+   released, writers put new values somewhere else meanwhile. Returns -1 if
+   the name isn't set, 1 if every pin is taken and the value has to be
+   copied. Other denv calls of this process can follow a grown table and
+   unmap the bytes, don't make any before releasing the view.
+*/
+DENV_API int denv_view_pin(DenvTable *table, const char *name,
+                           DenvView *view);
+DENV_API void denv_view_release(DenvTable *table, DenvView *view);
+
+// Returns -1 if the table can't grow to fit it
+DENV_API int denv_set(DenvTable *table, const char *name, const void *value,
+                      size_t len, bool is_env);
+DENV_API int denv_append(DenvTable *table, const char *name,
+                         const char *separator, const void *data, size_t len);
+DENV_API void denv_delete(DenvTable *table, const char *name);
+
+/* Calls fn for every variable of one consistent copy of the table in name
+   order, returns what fn returned when it stopped early, -1 if the copy
+   couldn't be made.
+*/
+DENV_API int denv_iterate(DenvTable *table, DenvIterator fn, void *arg);
+
+/* Like denv_iterate for the variables whose name starts with pattern. With
+   *, ? or [ the pattern is a glob matched against the whole name instead,
+   names not starting with its part before the first wildcard aren't read.
+   A backslash is an ordinary character, wildcards can't be escaped.
+*/
+DENV_API int denv_iterate_match(DenvTable *table, const char *pattern,
+                                DenvIterator fn, void *arg);
+
+// Generation of the last write on a name, 0 if it was never written
+DENV_API uint64_t denv_generation(DenvTable *table, const char *name);
+
+/* Waits for a write on name with a generation newer than since, forever if
+   timeout_ms is negative. Returns 0 and stores the generation, 1 on timeout.
+*/
+DENV_API int denv_await(DenvTable *table, const char *name, uint64_t since,
+                        int timeout_ms, uint64_t *generation);
+
+DENV_API void denv_stats(DenvTable *table, DenvStats *stats);
+
+/* Logs every write to wal.denv under the bind path, the daemon replays the
+   log on top of its saves when it starts. The level is kept in the table
+   and the log, it applies to every process. Returns -1 if the log can't be
+   written.
+*/
+DENV_API int denv_set_durability(DenvTable *table, DenvDurability level);
+DENV_API DenvDurability denv_durability(DenvTable *table);
+
+/* Waits until the writes of this process are on disk, a durable write per
+   call on a table logging with DENV_DURABILITY_LOG. Processes committing at
+   the same time share one fsync. Returns -1 if a write couldn't be logged.
+*/
+DENV_API int denv_commit(DenvTable *table);
+
+/* Daemon socket protocol. Clients send requests and read the responses in
+   the same order, many requests may be sent before reading any response.
+   Integers are in host byte order, the socket is local.
+*/
+typedef enum {
+    DENV_OP_GET = 1,
+    DENV_OP_SET,
+    DENV_OP_APPEND,
+    DENV_OP_REMOVE,
+    DENV_OP_LIST,
+    DENV_OP_AWAIT
+} DenvOp;
+
+typedef enum {
+    DENV_REQUEST_ENV = (1 << 0),        // set an environment variable
+    DENV_REQUEST_LIST_ENV = (1 << 1),   // mark environment variables on ls
+    DENV_REQUEST_SINCE = (1 << 2),      // await a generation newer than since
+    DENV_REQUEST_LIST_VALUES = (1 << 3) // ls prints name=value lines
+} DenvRequestFlags;
+
+/* Followed by the name, the separator and the value, names end with a '\0'.
+   The name of an ls is the pattern of what it lists, "" for everything.
+*/
+typedef struct {
+    uint8_t op;
+    uint8_t flags;
+    uint16_t separator_len;
+    uint32_t name_len;
+    uint64_t value_len;
+    uint64_t since;
+} DenvRequest;
+
+// Followed by len bytes, the value of a get or the list of an ls
+typedef struct {
+    int32_t status; // -1 when the name isn't set or a write failed
+    uint32_t reserved;
+    uint64_t generation; // of the write an await returned on
+    uint64_t len;
+} DenvResponse;
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} DenvBytes;
+
+typedef struct {
+    int fd;
+    DenvBytes out; // requests not sent yet
+    DenvBytes in;
+    size_t in_pos; // start of the next response in in
+} DenvClient;
+
+DENV_API int denv_client_connect(DenvClient *c, char *socket_path);
+DENV_API void denv_client_close(DenvClient *c);
+DENV_API int denv_client_request(DenvClient *c, DenvRequest req, char *name,
+                                 char *separator, char *value);
+DENV_API int denv_client_flush(DenvClient *c);
+DENV_API int denv_client_response(DenvClient *c, DenvResponse *resp,
+                                  char **data);
+
+#endif /* _DENV_H */
+
+#if defined(DENV_IMPLEMENTATION) && !defined(_DENV_IMPLEMENTATION)
+#define _DENV_IMPLEMENTATION
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/ipc.h>
+#include <sys/mman.h>
 #include <sys/shm.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 #include <zlib.h>
 
+#ifdef DENV_WITH_LZ4
+#include <lz4frame.h>
+#endif
+
+#ifdef DENV_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 #define DENV_IPC_RESULT_ERROR (-1)
 
-#define DENV_MAX_ELEMENTS (1 << 11) // 2048 Bytes
-#define DENV_BLOCK_SIZE (1 << 20)   // 1048576 Bytes
+#define DENV_INITIAL_ELEMENTS (1 << 11)   // 2048 Elements
+#define DENV_INITIAL_BLOCK_SIZE (1 << 20) // 1048576 Words
+
+// Address space reserved per attach, the table can grow up to this size
+#if UINTPTR_MAX == UINT64_MAX
+#define DENV_MAX_TABLE_SIZE ((size_t)1 << 34) // 16GiB
+#else
+#define DENV_MAX_TABLE_SIZE ((size_t)1 << 28) // 256MiB
+#endif
+
+// Free slices of [2^n, 2^(n + 1)) words share the free list of class n
+#define DENV_SIZE_CLASSES 48
+#define DENV_MIN_SLICE_WORDS 2 // a free slice stores its size and next slice
+#define DENV_FREE_LIST_SCAN 8  // slices checked in the first fit class
+#define DENV_NO_SLICE ((Word)-1)
+
+// Element index, tags of a group are probed together in a 64-bit word
+#define DENV_GROUP_SIZE 8
+#define DENV_GROUP_LOW_BITS 0x0101010101010101ULL
+#define DENV_GROUP_HIGH_BITS 0x8080808080808080ULL
+#define DENV_TAG_FULL 0x80
+#define DENV_MAX_LOAD(max_elements) ((max_elements) / 8 * 7)
+#define DENV_ORDER_NONE UINT32_MAX // no element, ends a link of the name order
+#define DENV_GROWTH_HEADROOM 4 // values that grow get 1/4 more room for `ap`
+
+#define DENV_COMPACT_STEP_SLICES 64   // slices moved per write lock hold
+#define DENV_COMPACT_THRESHOLD 0.25   // fragmentation the daemon compacts at
+#define DENV_COMPACT_MIN_WORDS 4096   // free words worth compacting for
+
+#define DENV_PIN_SLOTS 32 // values pinned at once by all processes
+#define DENV_LOCK_WAIT (100 * 1000000) // 100ms, then a dead holder is found
+#define DENV_READ_SPINS 1024 // yields on a write before looking for its writer
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0 // DENV_SHM_POPULATE only advises where it's missing
+#endif
 
 #define DENV_MAJOR_VERSION 1
 #define DENV_MINOR_VERSION 0
@@ -32,6 +301,9 @@
 #else
 #define DENV_MAGIC 0x44454e56
 #endif
+// first word of a shared table, bumped with every change of its layout
+#define DENV_TABLE_LAYOUT 2
+#define DENV_TABLE_MAGIC (DENV_MAGIC + DENV_TABLE_LAYOUT)
 
 #define DENV_CHUNK (1 << 19) // 512KiB
 
@@ -39,6 +311,33 @@
 
 #define DENV_COMPRESSION_LEVEL Z_DEFAULT_COMPRESSION
 
+// Logical save files, see denv_table_write_save
+#define DENV_SAVE_MAGIC "DENVSAVE"
+#define DENV_SAVE_VERSION 1
+#define DENV_SAVE_HEADER 32 // magic, version, flags, generation and base
+#define DENV_SAVE_RECORD 24 // name length, flags, value length and generation
+#define DENV_SAVE_END 0xffffffffU // name length of the trailer
+#define DENV_SAVE_DELTA 1         // header flag, the writes after base
+#define DENV_SAVE_ENV 1           // record flags
+#define DENV_SAVE_REMOVED 2
+#define DENV_SAVE_MORE 4  // in a log, the next record is of the same write
+#define DENV_SAVE_CLEAR 8 // in a log, every variable was removed
+
+#define DENV_WAL_FILE "wal.denv" // next to the table file, see DenvMapping
+#define DENV_WAL_MAGIC "DENVWAL" // with its '\0'
+#define DENV_WAL_VERSION 1
+#define DENV_WAL_HEADER 16 // magic, version and durability level
+#define DENV_WAL_ROTATED_LENGTH (DENV_SHM_NAME_LENGTH + 8)
+#define DENV_WAL_SPILL_SIZE (4 << 20) // records a load keeps in memory
+#define DENV_WAL_COMMIT_WAIT (10 * 1000000) // 10ms, then a dead syncer is found
+
+#define DENV_ZSTD_LEVEL 3
+#define DENV_CHECK_THREADS 16      // most threads checking the crcs of a save
+#define DENV_CHECK_CHUNK (1 << 22) // 4MiB, least bytes a check thread gets
+#define DENV_SNAPSHOT_TRIES 4      // lock free copies before taking the lock
+
+#define DENV_POLLING_INTERVAL (100 * 1000000) // 100ms, used without futexes
+
 #if !defined(DENV_VERSION_A) || !defined(DENV_VERSION_B) ||                    \
     !defined(DENV_VERSION_C)
 #error "Missing version defines."
@@ -48,38 +347,92 @@ typedef uintptr_t Word;
 
 typedef enum {
     ELEMENT_IS_USED = (1 << 0),
-    ELEMENT_HAS_COLLISION = (1 << 1),
     ELEMENT_IS_FREED = (1 << 2),
     ELEMENT_IS_ENV = (1 << 3),
-    ELEMENT_IS_BEING_READ = (1 << 4),
-    ELEMENT_IS_UPDATED = (1 << 5)
+    ELEMENT_IS_BEING_READ = (1 << 4)
 } DenvElementFlags;
 
 typedef struct {
     Word flags;
     Word data_index;     // block index
     Word data_word_size; // size in words
-    Word collision_next; // get collision member
+    Word name_len;       // name and value lengths without their '\0'
+    Word value_len;
+    uint64_t hash;       // of the name, compared before the name itself
+    uint64_t generation; // bumped on every write, see denv_await_element
 } Element;
 
+// Links of the name order, kept apart from the elements, see denv_order_insert
+typedef struct {
+    uint32_t left;
+    uint32_t right;
+    uint32_t parent;
+} DenvOrderLinks;
+
 typedef enum {
     TABLE_IS_INITIALIZED = (1 << 0),
-    TABLE_IS_BUSY = (1 << 1)
+    TABLE_IS_BUSY = (1 << 1),
+    TABLE_IS_MOVED = (1 << 2) // grown into the segment at moved_shmid
 } DenvTableFlags;
 
-typedef struct {
+/* The tag array, the element array, their order links and the data block
+   follow the header in data[], their sizes never change after the segment
+   is created. Growing the table moves it to a bigger segment, the segment at
+   the ftok key stays as the root and forwards new attachers to the current
+   one.
+*/
+typedef struct DenvTable {
     Word magic;
     Word flags;
     sem_t denv_sem;
+    _Atomic Word seq; // odd while a writer is modifying the table
+    _Atomic pid_t locker; // process holding denv_sem, 0 when it's free
+    _Atomic uint32_t wake;    // bumped after every write, awaiters sleep on it
+    _Atomic uint32_t waiters; // number of processes sleeping on wake
+    uint64_t last_generation; // last generation given to an element
+    uint64_t dropped_generation; // newest removal whose name left the index
+    int moved_shmid; // valid when TABLE_IS_MOVED, object number with POSIX
+    int next_shmid;  // last object number given to a new segment with POSIX
+    struct {
+        int shmid;  // segment a load is building, see denv_table_stage
+        pid_t pid;  // of the loading process, 0 when no load is under way
+    } staged;
+    Word max_elements;        // power of two, size of the element array
+    Word block_size;          // in words
     struct {
         Word used;
-        Word collision_used;
-        Element array[DENV_MAX_ELEMENTS];
-        Element collision_array[DENV_MAX_ELEMENTS];
+        Word removed; // slots kept by removed variables until a rehash
+        Word root;    // of the name order, DENV_ORDER_NONE when empty
+        Word last;    // greatest name of the order, appends start from it
     } element;
+    struct {
+        Word head[DENV_SIZE_CLASSES]; // first free slice of each class
+        Word words;                   // words sitting in the free lists
+        Word slices;
+    } free_list;
+    Word compact_offset; // block below it is packed, DENV_NO_SLICE when idle
+    Word compact_epoch;  // bumped by every compaction step and new block
+    struct {
+        struct {
+            _Atomic pid_t pid;   // holder of the pin, 0 when released
+            Word index;          // first word of the pinned slice
+            Word deferred_words; // slice replaced while pinned, freed later
+        } slot[DENV_PIN_SLOTS];
+        _Atomic Word held; // slots with a pid set
+        Word deferred;     // slots with deferred_words set
+    } pins;
+    struct {
+        _Atomic uint32_t level;   // DenvDurability
+        _Atomic uint32_t epoch;   // bumped when a new log is started
+        _Atomic uint32_t commits; // bumped after every fsync, committers wait
+        _Atomic pid_t syncer;     // process running fsync, 0 when nobody is
+        _Atomic uint64_t appended; // generation of the last logged write
+        _Atomic uint64_t synced;   // of the last one known to be on disk
+        uint64_t rotated_generation; // last one in the old log, 0 if none
+    } wal;
     Word total_size;
     Word current_word_block_offset;
-    Word block[DENV_BLOCK_SIZE];
+    Word data[];
 } Table;
 
 typedef struct {
@@ -87,831 +440,4823 @@ typedef struct {
     Word size;
 } Buffer;
 
-Word denv_hash(char *name) {
-    uint32_t hash = 2166136261u;
-    for (size_t i = 0; i < strlen(name); i++) {
-        hash ^= (uint8_t)name[i];
-        hash *= 16777619;
-    }
-    return (hash & (DENV_MAX_ELEMENTS - 1));
-}
+#define DENV_SHM_NAME_LENGTH 4096
+#define DENV_TABLE_FILE "table.denv" // in the bind path with DENV_SHM_FILE
 
-Word denv_round_to_word(size_t size) {
-    Word new_size = size;
+// Where this process keeps the table mapped, the address never changes
+typedef struct {
+    Table *table;
+    key_t key;
+    int shmid; // object number with POSIX, 0 is the root object
+    size_t size;
+    DenvShmBackend backend;
+    int flags;                       // DenvShmFlags
+    int fd;                          // table file, shared flock held on it
+    int moves; // times the table was followed to a new segment, for pins
+    char name[DENV_SHM_NAME_LENGTH]; // of the POSIX root object or file
+    char wal_name[DENV_SHM_NAME_LENGTH]; // write-ahead log, on every backend
+} DenvMapping;
+
+DenvMapping g_denv_mapping = {0};
+
+/* This process' end of the write-ahead log. Writes add their records to
+   pending while they hold the lock, denv_table_write_end appends them to
+   the log at once.
+*/
+typedef struct {
+    int fd;            // log of epoch, opened by the first logged write
+    uint32_t epoch;
+    DenvBytes pending;
+    uint64_t logged;   // generation of the last records this process wrote
+    int paused;        // writes aren't logged while it's set, it nests
+    bool is_deferred;  // the caller commits durable writes, not write_end
+    bool failed;       // a write couldn't be logged since the last commit
+    struct {
+        bool is_enabled; // a load is logging, see denv_wal_spill
+        bool is_dropped; // the spill failed, the load isn't logged
+        int fd;          // unlinked file next to the log, -1 until needed
+        size_t size;
+    } spill;
+} DenvWal;
 
-    new_size--;
-    new_size |= (new_size >> 1);
-    new_size |= (new_size >> 2);
-    new_size |= (new_size >> 4);
-    new_size |= (new_size >> 8);
-    new_size |= (new_size >> 16);
-#if UINTPTR_WIDTH == 8
-    new_size |= (new_size >> 32);
-#endif
-    new_size++;
+DenvWal g_denv_wal = {.fd = -1, .spill.fd = -1};
 
-    return new_size;
-}
+// A staged write, a NULL value removes the name
+typedef struct {
+    char *name;
+    char *value;
+    size_t value_len;
+    Word flags;
+} DenvTxOp;
 
-Table *denv_table_init(void *init_ptr) {
-    assert(init_ptr != NULL);
+/* Writes staged in process memory until denv_tx_commit publishes them all
+   at once. Names and values aren't copied, they must outlive the commit.
+*/
+typedef struct {
+    DenvTxOp *ops;
+    size_t len;
+    size_t capacity;
+} DenvTx;
 
-    Table *table = init_ptr;
+// What a logical save holds, see denv_table_write_save
+typedef struct {
+    uint64_t generation; // last generation written to the table
+    uint64_t base;       // a delta has the writes after it
+    uint64_t records;
+    size_t size;         // uncompressed
+    Word words;          // block words its variables take
+    bool is_delta;
+} DenvSaveInfo;
+
+// 64-bit FNV-1a, gets the length of the name in the same pass if asked
+uint64_t denv_hash(char *name, size_t *name_len) {
+    uint64_t hash = 14695981039346656037ULL;
+    uint8_t *c = (uint8_t *)name;
+
+    for (; *c; c++) {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
 
-    table->flags |= TABLE_IS_INITIALIZED;
+    if (name_len != NULL)
+        *name_len = c - (uint8_t *)name;
 
-    table->magic = DENV_MAGIC;
+    return hash;
+}
 
-    table->element.used = 0;
-    table->element.collision_used = 0;
+/* One tag byte per element slot, 0 when empty, otherwise the top 7 bits of
+   the name hash with DENV_TAG_FULL set. Lookups match DENV_GROUP_SIZE tags
+   at once and only look at elements whose tag matches.
+*/
+uint8_t *denv_table_tags(Table *table) { return (uint8_t *)table->data; }
+
+Element *denv_table_elements(Table *table) {
+    return (Element *)(denv_table_tags(table) + table->max_elements);
+}
 
-    table->total_size = sizeof(Table);
+DenvOrderLinks *denv_table_links(Table *table) {
+    return (DenvOrderLinks *)(denv_table_elements(table) +
+                              table->max_elements);
+}
 
-    table->current_word_block_offset = 0;
+Word *denv_table_block(Table *table) {
+    return (Word *)(denv_table_links(table) + table->max_elements);
+}
 
-    return table;
+size_t denv_table_size(Word max_elements, Word block_size) {
+    return sizeof(Table) +
+           max_elements * (1 + sizeof(Element) + sizeof(DenvOrderLinks)) +
+           block_size * sizeof(Word);
 }
 
-void *denv_table_slice_block(Table *table, size_t size) {
-    assert(table != NULL);
-    size = denv_round_to_word(size);
+uint8_t denv_hash_tag(uint64_t hash) { return DENV_TAG_FULL | (hash >> 57); }
 
-    assert(size <= DENV_BLOCK_SIZE -
-                       table->current_word_block_offset * sizeof(Word) &&
-           "Table block is out of memory.");
+// High bit set on every byte of group equal to tag
+uint64_t denv_group_match(uint64_t group, uint8_t tag) {
+    uint64_t x = group ^ (DENV_GROUP_LOW_BITS * tag);
 
-    void *new_slice = (void *)&table->block[table->current_word_block_offset];
+    return ~(((x & ~DENV_GROUP_HIGH_BITS) + ~DENV_GROUP_HIGH_BITS) | x |
+             ~DENV_GROUP_HIGH_BITS);
+}
 
-    table->current_word_block_offset += size / sizeof(Word);
+uint64_t denv_group_empty(uint64_t group) {
+    return ~group & DENV_GROUP_HIGH_BITS;
+}
 
-    return new_slice;
+// Slot in the group of the lowest match of a mask from denv_group_match
+Word denv_group_slot(uint64_t mask) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return DENV_GROUP_SIZE - 1 - (__builtin_ctzll(mask) >> 3);
+#else
+    return __builtin_ctzll(mask) >> 3;
+#endif
 }
 
-void denv_table_write_slice(void *slice_ptr, char *name, char *value) {
-    assert(slice_ptr != NULL && name != NULL);
+bool denv_table_remap(Table *table);
+void denv_table_wake(Table *table);
 
-    strcpy(slice_ptr, name);
-    if (value != NULL) {
-        size_t name_size = strlen(name) + 1;
-        strcpy(slice_ptr + name_size, value);
-    }
+/* Releases denv_sem for a process that died holding it, readers waiting on
+   its write go on with the table as far as the write got, like a table
+   file after denv_table_recover. Returns true if it was released.
+*/
+bool denv_table_reap_locker(Table *table) {
+    pid_t pid = atomic_load(&table->locker);
+
+    if (pid == 0 || pid == getpid() || kill(pid, 0) == 0 || errno != ESRCH ||
+        !atomic_compare_exchange_strong(&table->locker, &pid, 0))
+        return false;
+
+    Word seq = atomic_load(&table->seq);
+    if (seq & 1)
+        atomic_store_explicit(&table->seq, seq + 1, memory_order_release);
+
+    fprintf(stderr, "%s: Process %d died holding the table lock.\n",
+            __FUNCTION__, (int)pid);
+    sem_post(&table->denv_sem);
+    denv_table_wake(table);
+
+    return true;
 }
 
-char *denv_get_element_name(Table *table, Word element_index) {
+void denv_table_sem_wait(Table *table) {
+    if (sem_trywait(&table->denv_sem) == 0)
+        return;
 
-    char *name;
+    for (;;) {
+        struct timespec ts;
 
-    if (element_index >= DENV_MAX_ELEMENTS) {
-        name =
-            (char *)&table->block[table->element
-                                      .collision_array[element_index &
-                                                       (DENV_MAX_ELEMENTS - 1)]
-                                      .data_index];
-    } else {
-        name = (char *)&table
-                   ->block[table->element
-                               .array[element_index & (DENV_MAX_ELEMENTS - 1)]
-                               .data_index];
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += DENV_LOCK_WAIT;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+
+        if (sem_timedwait(&table->denv_sem, &ts) == 0)
+            return;
+        if (errno == ETIMEDOUT)
+            denv_table_reap_locker(table);
     }
-    return name;
 }
 
-/*
-TODO:
-Functions to implement to simplify denv_table_set_value
-denv_write_element_data
-denv_realloc_element_data
-denv_handle_collisions
-denv_element_has_collision
-*/
-/* Function that receives table, variable name and value and allocates the
-   element, it also edits the element if the name match it also do collision
-   handling
-*/
-void _denv_table_set_value(Table *table, char *name, char *value, Word flags) {
-    assert(table != NULL && name != NULL);
+// Takes denv_sem on the current table, without telling readers
+void denv_table_lock(Table *table) {
+    denv_table_sem_wait(table);
 
-    Word hash = denv_hash(name);
-    Element *e = &table->element.array[hash];
+    // the table grew while we waited, follow it
+    while (table->flags & TABLE_IS_MOVED) {
+        sem_post(&table->denv_sem);
+        if (!denv_table_remap(table))
+            abort(); // writing to the old table would lose data
+        denv_table_sem_wait(table);
+    }
 
-    Word storage_size = strlen(name) + strlen(value) + 2;
-    Word storage_size_in_words = denv_round_to_word(storage_size);
+    atomic_store(&table->locker, getpid());
+}
 
-    // Do not let external flags mess up with crucial flags
-    flags &= ~(ELEMENT_IS_USED | ELEMENT_IS_BEING_READ | ELEMENT_HAS_COLLISION |
-               ELEMENT_IS_FREED | ELEMENT_IS_UPDATED);
+void denv_table_unlock(Table *table) {
+    atomic_store(&table->locker, 0);
+    sem_post(&table->denv_sem);
+}
 
-    if (e->flags & ELEMENT_IS_USED) {
+void denv_table_collect_pins(Table *table);
 
-        char *element_name = denv_get_element_name(table, hash);
+/* Writers serialize on denv_sem and keep table->seq odd while they modify the
+   table, readers don't lock, they retry if seq changed under them.
+*/
+void denv_table_write_begin(Table *table) {
+    denv_table_lock(table);
 
-        if (strcmp(name, element_name) == 0) {
-            if (e->data_word_size < (storage_size_in_words / sizeof(Word))) {
-                // size has grown, allocate new block
-                e->data_word_size = storage_size_in_words / sizeof(Word);
-                e->data_index = table->current_word_block_offset;
-                void *new_data = denv_table_slice_block(table, storage_size);
-                denv_table_write_slice(new_data, name, value);
+    atomic_fetch_add_explicit(&table->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
 
-                e->flags |= flags | ELEMENT_IS_UPDATED;
-                e->flags &= ~(ELEMENT_IS_FREED);
+    if (table->pins.deferred > 0)
+        denv_table_collect_pins(table);
+}
 
-                return;
-            } else {
-                // rewrite over old data
-                void *old_data = (void *)&table->block[e->data_index];
-                denv_table_write_slice(old_data, name, value);
+bool denv_wal_flush(Table *table);
+int denv_wal_commit(Table *table, uint64_t generation);
+void denv_wal_spill_end(void);
 
-                e->flags |= flags | ELEMENT_IS_UPDATED;
-                e->flags &= ~(ELEMENT_IS_FREED);
+/* The records the write logged go to the log before the lock is released,
+   so the log has the writes in the order they were made
+*/
+void denv_table_write_end(Table *table) {
+    bool is_logged = g_denv_wal.pending.len > 0 && denv_wal_flush(table);
 
-                return;
-            }
+    atomic_fetch_add_explicit(&table->seq, 1, memory_order_release);
+    denv_table_unlock(table);
 
-        } else {
+    denv_table_wake(table);
 
-            if (e->flags & ELEMENT_HAS_COLLISION) {
-                // check all palces with ->collision_next
-                Element *col_e =
-                    &table->element.collision_array[e->collision_next &
-                                                    (DENV_MAX_ELEMENTS - 1)];
-                char *col_element_name =
-                    (char *)&table->block[col_e->data_index];
-
-                // loop here
-                while (strcmp(name, col_element_name)) {
-                    if (col_e->flags & ELEMENT_HAS_COLLISION) {
-                        col_e = &table->element
-                                     .collision_array[col_e->collision_next];
-                        col_element_name =
-                            (char *)&table->block[col_e->data_index];
-                    } else {
-                        // element has collision now
-                        col_e->flags |= ELEMENT_HAS_COLLISION;
-                        col_e->collision_next = table->element.collision_used;
-                        col_e = &table->element.collision_array
-                                     [table->element.collision_used];
-                        table->element.collision_used++;
-
-                        col_e->flags |= ELEMENT_IS_USED;
-                        col_e->data_word_size =
-                            storage_size_in_words / sizeof(Word);
-                        col_e->data_index = table->current_word_block_offset;
-                        void *new_data =
-                            denv_table_slice_block(table, storage_size);
-                        denv_table_write_slice(new_data, name, value);
-
-                        col_e->flags |= flags | ELEMENT_IS_UPDATED;
-                        col_e->flags &= ~(ELEMENT_IS_FREED);
-
-                        return;
-                    }
-                }
+    if (is_logged && !g_denv_wal.is_deferred &&
+        atomic_load(&table->wal.level) == DENV_DURABILITY_SYNC)
+        denv_wal_commit(table, g_denv_wal.logged);
+}
 
-                if (col_e->data_word_size <
-                    (storage_size_in_words / sizeof(Word))) {
-                    col_e->data_word_size =
-                        storage_size_in_words / sizeof(Word);
-                    col_e->data_index = table->current_word_block_offset;
-                    void *new_data =
-                        denv_table_slice_block(table, storage_size);
-                    denv_table_write_slice(new_data, name, value);
+Word denv_table_read_begin(Table *table) {
+    for (int spins = 0;; spins++) {
+        Word seq = atomic_load_explicit(&table->seq, memory_order_acquire);
 
-                    col_e->flags |= flags | ELEMENT_IS_UPDATED;
-                    col_e->flags &= ~(ELEMENT_IS_FREED);
+        // if it can't be followed the old table is still consistent
+        if ((table->flags & TABLE_IS_MOVED) && denv_table_remap(table))
+            continue;
 
-                    return;
-                } else {
-                    void *old_data = (void *)&table->block[col_e->data_index];
-                    denv_table_write_slice(old_data, name, value);
+        if ((seq & 1) == 0)
+            return seq;
 
-                    col_e->flags |= flags | ELEMENT_IS_UPDATED;
-                    col_e->flags &= ~(ELEMENT_IS_FREED);
+        // a writer killed mid-write leaves seq odd
+        if (spins % DENV_READ_SPINS == DENV_READ_SPINS - 1)
+            denv_table_reap_locker(table);
 
-                    return;
-                }
+        sched_yield();
+    }
+}
 
-            } else {
-                // element has collision now
-                e->flags |= ELEMENT_HAS_COLLISION;
-                e->collision_next = table->element.collision_used;
-                Element *col_e =
-                    &table->element
-                         .collision_array[table->element.collision_used];
+bool denv_table_read_retry(Table *table, Word seq) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&table->seq, memory_order_relaxed) != seq;
+}
 
-                assert(table->element.collision_used < DENV_MAX_ELEMENTS);
+// Bounded name compare, lengths first, safe against torn element reads
+bool denv_table_name_equals(Table *table, Element *e, char *name,
+                            size_t name_len) {
+    Word data_index = e->data_index;
 
-                table->element.collision_used++;
+    if (e->name_len != name_len || data_index >= table->block_size)
+        return false;
 
-                col_e->flags |= ELEMENT_IS_USED;
-                col_e->data_word_size = storage_size_in_words / sizeof(Word);
-                col_e->data_index = table->current_word_block_offset;
-                void *new_data = denv_table_slice_block(table, storage_size);
-                denv_table_write_slice(new_data, name, value);
+    if (name_len >= (table->block_size - data_index) * sizeof(Word))
+        return false;
 
-                col_e->flags |= flags | ELEMENT_IS_UPDATED;
-                col_e->flags &= ~(ELEMENT_IS_FREED);
+    return memcmp(name, &denv_table_block(table)[data_index], name_len) == 0;
+}
 
-                return;
-            }
-        }
+/* Gets the name and value of an element from their stored lengths, returns
+   false if they don't fit the block which can happen on torn reads
+*/
+bool denv_table_read_element(Table *table, Element *e, char **name,
+                             size_t *name_len, char **value,
+                             size_t *value_len) {
+    Word data_index = e->data_index;
 
-    } else {
+    if (data_index >= table->block_size)
+        return false;
 
-        e->flags |= ELEMENT_IS_USED;
-        e->data_word_size = storage_size_in_words / sizeof(Word);
-        e->data_index = table->current_word_block_offset;
+    size_t remaining = (table->block_size - data_index) * sizeof(Word);
+    char *data = (char *)&denv_table_block(table)[data_index];
 
-        table->element.used++;
+    *name_len = e->name_len;
+    *value_len = e->value_len;
 
-        size_t size = storage_size;
+    if (*name_len >= remaining || *value_len >= remaining - *name_len - 1)
+        return false;
 
-        void *new_data = denv_table_slice_block(table, size);
-        denv_table_write_slice(new_data, name, value);
+    *name = data;
+    *value = data + *name_len + 1;
 
-        e->flags |= flags | ELEMENT_IS_UPDATED;
-        e->flags &= ~(ELEMENT_IS_FREED);
-    }
+    return true;
 }
 
-void denv_table_set_value(Table *table, char *name, char *value, Word flags) {
-    assert(table != NULL && name != NULL);
+Word denv_round_to_word(size_t size) {
+    return (size + sizeof(Word) - 1) & ~(Word)(sizeof(Word) - 1);
+}
 
-    sem_wait(&table->denv_sem);
+// Slices used to be sized like this, stats reports the difference
+Word denv_round_to_power_of_two(size_t size) {
+    Word new_size = size;
 
-        _denv_table_set_value(table, name, value, flags);
+    new_size--;
+    new_size |= (new_size >> 1);
+    new_size |= (new_size >> 2);
+    new_size |= (new_size >> 4);
+    new_size |= (new_size >> 8);
+    new_size |= (new_size >> 16);
+#if UINTPTR_MAX == UINT64_MAX
+    new_size |= (new_size >> 32);
+#endif
+    new_size++;
 
-    sem_post(&table->denv_sem);
+    return new_size;
 }
 
-char *_denv_table_get_value(Table *table, char *name) {
-    assert(table != NULL && name != NULL);
-
-    Word hash = denv_hash(name);
-    Element *e = &table->element.array[hash];
+// Size of a slice in words, always big enough to be put in a free list
+Word denv_slice_words(size_t size) {
+    Word words = denv_round_to_word(size) / sizeof(Word);
 
-    char *element_name = denv_get_element_name(table, hash);
-
-    char *value = NULL;
+    return words < DENV_MIN_SLICE_WORDS ? DENV_MIN_SLICE_WORDS : words;
+}
 
-    if (e->flags & ELEMENT_IS_USED) {
-        if (strcmp(name, element_name) == 0) {
+Word denv_size_class(Word words) {
+    Word class = 0;
 
-            if (e->flags & ELEMENT_IS_FREED)
-                return NULL;
+    while (words >>= 1)
+        class++;
 
-            char *data = (char *)&table->block[e->data_index];
-            value = data + strlen(data) + 1;
-        } else {
-            if (e->flags & ELEMENT_HAS_COLLISION) {
-                Element *col_e =
-                    &table->element.collision_array[e->collision_next];
-                char *col_element_name =
-                    (char *)&table->block[col_e->data_index];
-
-                while (strcmp(name, col_element_name)) {
-                    if (col_e->flags & ELEMENT_HAS_COLLISION) {
-                        col_e = &table->element
-                                     .collision_array[col_e->collision_next];
-                        col_element_name =
-                            (char *)&table->block[col_e->data_index];
-                    } else {
-                        // debug if
-                        if (col_e->flags != 0) {
-                            fprintf(stderr, "%s: error in get loop.\n",
-                                    __FUNCTION__);
-                        }
-                        return NULL;
-                    }
-                }
+    return class;
+}
 
-                if (col_e->flags & ELEMENT_IS_FREED)
-                    return NULL;
+// Forgets every slice of the block, the elements must be cleared too
+void denv_table_reset_block(Table *table) {
+    for (int i = 0; i < DENV_SIZE_CLASSES; i++)
+        table->free_list.head[i] = DENV_NO_SLICE;
 
-                if (col_e->flags & ELEMENT_IS_USED) {
-                    char *data = (char *)&table->block[col_e->data_index];
-                    value = data + strlen(data) + 1;
-                }
-            }
-        }
-    }
+    table->free_list.words = 0;
+    table->free_list.slices = 0;
+    table->compact_offset = DENV_NO_SLICE;
+    table->compact_epoch++;
+    table->current_word_block_offset = 0;
 
-    return value;
+    // pinned slices are gone with the block
+    memset(&table->pins, 0, sizeof(table->pins));
 }
 
-char *denv_table_get_value(Table *table, char *name) {
-    assert((table != NULL) && (name != NULL));
-
-    sem_wait(&table->denv_sem);
+Table *denv_table_init(void *init_ptr, Word max_elements, Word block_size) {
+    assert(init_ptr != NULL);
+    assert((max_elements & (max_elements - 1)) == 0 &&
+           max_elements >= DENV_GROUP_SIZE);
 
-    char *aux = _denv_table_get_value(table, name);
+    Table *table = init_ptr;
 
-    sem_post(&table->denv_sem);
+    table->flags |= TABLE_IS_INITIALIZED;
 
-    return aux;
-}
+    table->magic = DENV_TABLE_MAGIC;
 
-Element *denv_table_get_element(Table *table, char *name) {
-    assert(table != NULL && name != NULL);
+    table->max_elements = max_elements;
+    table->block_size = block_size;
 
-    Word hash = denv_hash(name);
-    Element *e = &table->element.array[hash];
+    table->element.used = 0;
+    table->element.removed = 0;
+    table->element.root = DENV_ORDER_NONE;
+    table->element.last = DENV_ORDER_NONE;
 
-    char *element_name = denv_get_element_name(table, hash);
+    table->total_size = denv_table_size(max_elements, block_size);
 
-    if (e->flags & ELEMENT_IS_USED) {
-        if (strcmp(name, element_name) == 0) {
+    denv_table_reset_block(table);
 
-            if (e->flags & ELEMENT_IS_FREED)
-                return NULL;
+    return table;
+}
 
-            return e;
+/* Returns the link to a free slice of at least words, NULL if there's none.
+   The class of words is searched first fit for a few slices, any slice of a
+   bigger class fits.
+*/
+Word *denv_table_find_free_slice(Table *table, Word words) {
+    Word *block = denv_table_block(table);
+    Word class = denv_size_class(words);
+    Word *link = &table->free_list.head[class];
 
-        } else {
-            if (e->flags & ELEMENT_HAS_COLLISION) {
-                Element *col_e =
-                    &table->element.collision_array[e->collision_next];
-                char *col_element_name =
-                    (char *)&table->block[col_e->data_index];
-
-                while (strcmp(name, col_element_name)) {
-                    if (col_e->flags & ELEMENT_HAS_COLLISION) {
-                        col_e = &table->element
-                                     .collision_array[col_e->collision_next];
-                        col_element_name =
-                            (char *)&table->block[col_e->data_index];
-                    } else {
-                        // debug if
-                        if (col_e->flags != 0) {
-                            fprintf(stderr, "%s: error in get loop.\n",
-                                    __FUNCTION__);
-                        }
-                        return NULL;
-                    }
-                }
+    for (int i = 0; *link != DENV_NO_SLICE && i < DENV_FREE_LIST_SCAN; i++) {
+        if (block[*link] >= words)
+            return link;
 
-                if (col_e->flags & ELEMENT_IS_FREED)
-                    return NULL;
+        link = &block[*link + 1];
+    }
 
-                if (col_e->flags & ELEMENT_IS_USED) {
-                    return col_e;
-                }
-            }
-        }
+    for (class++; class < DENV_SIZE_CLASSES; class++) {
+        if (table->free_list.head[class] != DENV_NO_SLICE)
+            return &table->free_list.head[class];
     }
 
     return NULL;
 }
 
-bool denv_element_on_update(Table *table, Element *element) {
+// Gives a slice back, it's reused by the next allocation that fits it
+void denv_table_free_slice(Table *table, Word index, Word words) {
+    if (words < DENV_MIN_SLICE_WORDS)
+        return;
 
-    if (element->flags & ELEMENT_IS_UPDATED) {
-        sem_wait(&table->denv_sem);
-        element->flags &= ~(ELEMENT_IS_UPDATED);
-        sem_post(&table->denv_sem);
-        return true;
+    // a compaction pass packs the block above its offset, see g_denv_compact
+    if (table->compact_offset != DENV_NO_SLICE &&
+        index >= table->compact_offset)
+        return;
+
+    // slices at the end of the used block go back to the bump pointer
+    if (index + words == table->current_word_block_offset) {
+        table->current_word_block_offset = index;
+        return;
     }
 
-    return false;
-}
+    Word *block = denv_table_block(table);
+    Word class = denv_size_class(words);
 
-// Doing polling is considered bad, I'm looking for a better way to do this
-bool denv_await_element(Table *table, char *name, time_t nsec) {
-    Element *e = denv_table_get_element(table, name);
+    block[index] = words;
+    block[index + 1] = table->free_list.head[class];
+    table->free_list.head[class] = index;
 
-    struct timespec ts = {};
-    ts.tv_sec = 0;
-    ts.tv_nsec = nsec;
+    table->free_list.words += words;
+    table->free_list.slices++;
+}
 
-    while (e == NULL) {
-        nanosleep(&ts, NULL);
-        e = denv_table_get_element(table, name);
-    }
+/* Readers pin the slice of a value to use it in place, see denv_view_pin.
+   Pins are taken under denv_sem and released without it, writers leave a
+   pinned slice where it is and the collector frees it once it's released.
+*/
+bool denv_table_slice_is_pinned(Table *table, Word index) {
+    if (atomic_load_explicit(&table->pins.held, memory_order_acquire) == 0)
+        return false;
 
-    while (denv_element_on_update(table, e) == false) {
-        nanosleep(&ts, NULL);
+    for (int i = 0; i < DENV_PIN_SLOTS; i++) {
+        if (table->pins.slot[i].index == index &&
+            atomic_load_explicit(&table->pins.slot[i].pid,
+                                 memory_order_acquire) != 0)
+            return true;
     }
 
-    return true;
+    return false;
 }
 
-void denv_table_delete_value(Table *table, char *name) {
-    assert(table != NULL && name != NULL);
-
-    sem_wait(&table->denv_sem);
+// Releases the pins of processes that died holding them
+void denv_table_reap_pins(Table *table) {
+    for (int i = 0; i < DENV_PIN_SLOTS; i++) {
+        pid_t pid = atomic_load(&table->pins.slot[i].pid);
 
-    Word hash = denv_hash(name);
-    Element *e = &table->element.array[hash];
+        if (pid != 0 && kill(pid, 0) == -1 && errno == ESRCH &&
+            atomic_compare_exchange_strong(&table->pins.slot[i].pid, &pid, 0))
+            atomic_fetch_sub(&table->pins.held, 1);
+    }
+}
 
-    char *element_name = denv_get_element_name(table, hash);
+// Returns the slot pinning the slice, -1 if they are all taken
+int denv_table_pin_slice(Table *table, Word index) {
+    for (int reaped = 0; reaped < 2; reaped++) {
+        for (int i = 0; i < DENV_PIN_SLOTS; i++) {
+            if (atomic_load(&table->pins.slot[i].pid) != 0 ||
+                table->pins.slot[i].deferred_words != 0)
+                continue;
+
+            table->pins.slot[i].index = index;
+            atomic_fetch_add(&table->pins.held, 1);
+            atomic_store_explicit(&table->pins.slot[i].pid, getpid(),
+                                  memory_order_release);
+            return i;
+        }
 
-    if (strcmp(name, element_name) == 0) {
-        e->flags |= ELEMENT_IS_FREED;
+        denv_table_reap_pins(table);
+    }
 
-        table->element.used--;
+    return -1;
+}
 
-    } else {
-        if (e->flags & ELEMENT_HAS_COLLISION) {
-            Element *col_e =
-                &table->element.collision_array[e->collision_next &
-                                                (DENV_MAX_ELEMENTS - 1)];
-            char *col_element_name = (char *)&table->block[col_e->data_index];
-
-            while (strcmp(name, col_element_name)) {
-                if (col_e->flags & ELEMENT_HAS_COLLISION) {
-                    col_e =
-                        &table->element.collision_array[col_e->collision_next];
-                    col_element_name = (char *)&table->block[col_e->data_index];
-                } else {
-                    break; // return;
-                }
+// Frees a slice, or leaves it to the collector while it's pinned
+void denv_table_release_slice(Table *table, Word index, Word words) {
+    if (words > 0 && denv_table_slice_is_pinned(table, index)) {
+        for (int i = 0; i < DENV_PIN_SLOTS; i++) {
+            if (table->pins.slot[i].index == index &&
+                atomic_load(&table->pins.slot[i].pid) != 0) {
+                table->pins.slot[i].deferred_words = words;
+                table->pins.deferred++;
+                return;
             }
-            col_e->flags |= ELEMENT_IS_FREED;
         }
     }
 
-    sem_post(&table->denv_sem);
+    denv_table_free_slice(table, index, words);
 }
 
-void denv_table_list_values(Table *table, bool list_env) {
-    for (int i = 0; i < DENV_MAX_ELEMENTS; i++) {
+/* Frees the deferred slices nobody has pinned anymore, including readers
+   that died before releasing them. Must be called by a writer.
+*/
+void denv_table_collect_pins(Table *table) {
+    denv_table_reap_pins(table);
+
+    for (int i = 0; i < DENV_PIN_SLOTS; i++) {
+        Word words = table->pins.slot[i].deferred_words;
+        Word index = table->pins.slot[i].index;
+
+        if (words == 0 || denv_table_slice_is_pinned(table, index))
+            continue;
+
+        table->pins.slot[i].deferred_words = 0;
+        table->pins.deferred--;
+        denv_table_free_slice(table, index, words);
+    }
+}
+
+/* Starts a write once no reader has a slice pinned, for writers that don't
+   keep slices where they are
+*/
+void denv_table_write_begin_unpinned(Table *table) {
+    denv_table_write_begin(table);
+
+    while (atomic_load(&table->pins.held) > 0) {
+        denv_table_reap_pins(table);
+        if (atomic_load(&table->pins.held) == 0)
+            break;
+
+        denv_table_write_end(table);
+        nanosleep(&(struct timespec){0, 1000000}, NULL); // 1ms
+        denv_table_write_begin(table);
+    }
+}
+
+bool denv_table_has_room(Table *table, size_t size) {
+    Word words = denv_slice_words(size);
+
+    Word slots = table->element.used + table->element.removed;
+    if (slots + 1 > DENV_MAX_LOAD(table->max_elements))
+        return false;
+
+    return words <= table->block_size - table->current_word_block_offset ||
+           denv_table_find_free_slice(table, words) != NULL;
+}
+
+/* Whether elements more elements and words more words fit at the end of the
+   block, many writes that pass it all succeed without growing the table.
+*/
+bool denv_table_has_room_for(Table *table, Word elements, Word words) {
+    Word slots = table->element.used + table->element.removed;
+    if (slots + elements > DENV_MAX_LOAD(table->max_elements))
+        return false;
+
+    return words <= table->block_size - table->current_word_block_offset;
+}
+
+/* Allocates a slice of words from the free lists or the end of the block and
+   gives it to the element, whatever is left of a bigger free slice is split
+   back into the lists.
+*/
+void *denv_table_slice_block(Table *table, Element *e, Word words) {
+    assert(table != NULL && e != NULL);
+
+    Word *block = denv_table_block(table);
+    Word *link = denv_table_find_free_slice(table, words);
+
+    if (link == NULL) {
+        assert(words <= table->block_size - table->current_word_block_offset &&
+               "Table block is out of memory.");
+
+        e->data_index = table->current_word_block_offset;
+        e->data_word_size = words;
+        table->current_word_block_offset += words;
+
+        return &block[e->data_index];
+    }
+
+    Word index = *link;
+    Word slice_words = block[index];
+
+    *link = block[index + 1];
+    table->free_list.words -= slice_words;
+    table->free_list.slices--;
+
+    if (slice_words - words >= DENV_MIN_SLICE_WORDS)
+        denv_table_free_slice(table, index + words, slice_words - words);
+    else
+        words = slice_words;
+
+    e->data_index = index;
+    e->data_word_size = words;
+
+    return &block[index];
+}
+
+// Writes "name\0value\0", the terminators keep values usable as strings
+void denv_table_write_slice(void *slice_ptr, char *name, size_t name_len,
+                            char *value, size_t value_len) {
+    assert(slice_ptr != NULL && name != NULL);
+
+    char *data = slice_ptr;
+
+    memcpy(data, name, name_len);
+    data[name_len] = '\0';
+
+    if (value != NULL) {
+        memcpy(data + name_len + 1, value, value_len);
+        data[name_len + 1 + value_len] = '\0';
+    }
+}
+
+char *denv_get_element_name(Table *table, Word element_index) {
+
+    Element *e = &denv_table_elements(table)[element_index];
+
+    return (char *)&denv_table_block(table)[e->data_index];
+}
+
+void denv_wal_log(Table *table, const char *name, size_t name_len,
+                  const char *value, size_t value_len, uint32_t flags);
+
+/* Writes name and value to the element data, moving it if it has grown or
+   a reader has it pinned. The old slice is freed first so a value at the end
+   of the block grows in place, a slice twice as big as needed gives its tail
+   back. New values get an exact fit, values that grew get some headroom to
+   grow again.
+*/
+void denv_element_write_data(Table *table, Element *e, char *name,
+                             size_t name_len, char *value, size_t value_len,
+                             Word flags) {
+    Word words = denv_slice_words(name_len + value_len + 2);
+
+    if (e->data_word_size < words ||
+        denv_table_slice_is_pinned(table, e->data_index)) {
+        // size has grown or the old data is in use, allocate new block
+        Word new_words = words;
+        if (e->data_word_size > 0 && e->data_word_size < words)
+            new_words += words / DENV_GROWTH_HEADROOM;
+
+        denv_table_release_slice(table, e->data_index, e->data_word_size);
+        void *new_data = denv_table_slice_block(table, e, new_words);
+        denv_table_write_slice(new_data, name, name_len, value, value_len);
+    } else {
+        // rewrite over old data
+        void *old_data = (void *)&denv_table_block(table)[e->data_index];
+        denv_table_write_slice(old_data, name, name_len, value, value_len);
+
+        if (e->data_word_size >= 2 * words) {
+            denv_table_free_slice(table, e->data_index + words,
+                                  e->data_word_size - words);
+            e->data_word_size = words;
+        }
+    }
+
+    e->name_len = name_len;
+    e->value_len = value_len;
+    e->flags |= ELEMENT_IS_USED | flags;
+    e->generation = ++table->last_generation;
+    e->flags &= ~(ELEMENT_IS_FREED);
+
+    denv_wal_log(table, name, name_len, value, value_len,
+                 (e->flags & ELEMENT_IS_ENV) ? DENV_SAVE_ENV : 0);
+}
+
+int denv_table_grow(Table *table, size_t size, Word elements);
+
+/* Probes the index for a name, returns its slot or the empty slot where it
+   would go, DENV_NO_SLICE if the index is full. Groups are probed in
+   triangular steps which visit every group, only elements whose tag and
+   hash match get their names compared. Safe to call without holding
+   denv_sem, torn reads end the probe and fail denv_table_read_retry.
+*/
+Word denv_table_probe(Table *table, char *name, size_t name_len, uint64_t hash,
+                      bool *found) {
+    uint8_t *tags = denv_table_tags(table);
+    Element *elements = denv_table_elements(table);
+    Word groups = table->max_elements / DENV_GROUP_SIZE;
+    Word g = (hash & (table->max_elements - 1)) / DENV_GROUP_SIZE;
+    uint8_t tag = denv_hash_tag(hash);
+
+    *found = false;
+
+    for (Word i = 0; i < groups; i++) {
+        uint64_t group;
+        memcpy(&group, &tags[g * DENV_GROUP_SIZE], sizeof(group));
+
+        for (uint64_t m = denv_group_match(group, tag); m; m &= m - 1) {
+            Word slot = g * DENV_GROUP_SIZE + denv_group_slot(m);
+            Element *e = &elements[slot];
+
+            if (e->hash == hash &&
+                denv_table_name_equals(table, e, name, name_len)) {
+                *found = true;
+                return slot;
+            }
+        }
+
+        // names never leave the index, an empty slot ends the probe
+        uint64_t empty = denv_group_empty(group);
+        if (empty)
+            return g * DENV_GROUP_SIZE + denv_group_slot(empty);
+
+        g = (g + i + 1) & (groups - 1);
+    }
+
+    return DENV_NO_SLICE;
+}
+
+/* Names are also kept in order, in a treap of the element slots linked by
+   the left, right and parent links of denv_table_links. It's a binary search
+   tree by name and a heap by a priority mixed from the name hash, which keeps
+   it balanced without storing anything else. Like the hash index, removed
+   names stay in it until a rehash builds a new one, so names are only ever
+   inserted. The links are apart from the elements so lookups, which don't
+   follow them, have smaller elements to go through.
+*/
+int denv_name_compare(const char *a, size_t a_len, const char *b,
+                      size_t b_len) {
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    return c != 0 ? c : (a_len > b_len) - (a_len < b_len);
+}
+
+uint64_t denv_order_priority(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    return hash ^ (hash >> 33);
+}
+
+// A name to sort, most names are told apart by their first 16 bytes
+typedef struct {
+    uint64_t prefix[2]; // big endian, '\0' padded
+    Word slot;
+    uint64_t priority; // of the element, so it isn't read again
+} DenvOrderKey;
+
+/* While deferred is set new names are left out of the order, their keys are
+   kept instead and denv_order_build puts them all in it at once, saves come
+   in slot order. Only for a table no other process sees yet, like a staged
+   one.
+*/
+struct {
+    int deferred; // nests like the pause of the log
+    DenvOrderKey *keys;
+    Word len, size;
+    bool failed; // keys couldn't grow, the build fails
+    Table *sorted; // table of the names qsort is comparing
+} g_denv_order = {0};
+
+char *denv_order_name(Table *table, Word slot) {
+    return (char *)&denv_table_block(table)
+        [denv_table_elements(table)[slot].data_index];
+}
+
+// Puts child in place of the old child of parent, the root if there's none
+void denv_order_replace(Table *table, Word parent, Word old, Word child) {
+    DenvOrderLinks *links = denv_table_links(table);
+
+    if (parent == DENV_ORDER_NONE)
+        table->element.root = child;
+    else if (links[parent].left == old)
+        links[parent].left = child;
+    else
+        links[parent].right = child;
+}
+
+// Rotates the element at slot above its parent keeping the order
+void denv_order_rotate_up(Table *table, Word slot) {
+    DenvOrderLinks *links = denv_table_links(table);
+    DenvOrderLinks *e = &links[slot];
+    Word parent = e->parent;
+    DenvOrderLinks *p = &links[parent];
+    Word moved;
+
+    if (p->left == slot) {
+        moved = e->right;
+        p->left = moved;
+        e->right = parent;
+    } else {
+        moved = e->left;
+        p->right = moved;
+        e->left = parent;
+    }
+
+    if (moved != DENV_ORDER_NONE)
+        links[moved].parent = parent;
+
+    denv_order_replace(table, p->parent, parent, slot);
+    e->parent = p->parent;
+    p->parent = slot;
+}
+
+/* Adds slot after the greatest name by climbing the right spine, what it
+   climbs over becomes its left subtree. O(1) amortized.
+*/
+void denv_order_append(Table *table, Word slot) {
+    Element *elements = denv_table_elements(table);
+    DenvOrderLinks *links = denv_table_links(table);
+    DenvOrderLinks *e = &links[slot];
+    uint64_t priority = denv_order_priority(elements[slot].hash);
+    Word parent = table->element.last;
+
+    e->left = DENV_ORDER_NONE;
+    e->right = DENV_ORDER_NONE;
+
+    while (parent != DENV_ORDER_NONE &&
+           denv_order_priority(elements[parent].hash) < priority) {
+        e->left = parent;
+        parent = links[parent].parent;
+    }
+
+    if (e->left != DENV_ORDER_NONE)
+        links[e->left].parent = slot;
+    e->parent = parent;
+
+    if (parent == DENV_ORDER_NONE)
+        table->element.root = slot;
+    else
+        links[parent].right = slot;
+
+    table->element.last = slot;
+}
+
+// Keeps the key of a name left out of the order while it's deferred
+void denv_order_defer(Word slot, char *name, size_t name_len, uint64_t hash) {
+    if (g_denv_order.len == g_denv_order.size) {
+        Word size = g_denv_order.size ? g_denv_order.size * 2 : 1024;
+        DenvOrderKey *keys =
+            realloc(g_denv_order.keys, size * sizeof(DenvOrderKey));
+
+        if (keys == NULL) {
+            g_denv_order.failed = true;
+            return;
+        }
+        g_denv_order.keys = keys;
+        g_denv_order.size = size;
+    }
+
+    DenvOrderKey *key = &g_denv_order.keys[g_denv_order.len++];
+    uint8_t bytes[16] = {0};
+    memcpy(bytes, name, name_len < 16 ? name_len : 16);
+
+    key->prefix[0] = key->prefix[1] = 0;
+    for (int b = 0; b < 16; b++)
+        key->prefix[b / 8] = key->prefix[b / 8] << 8 | bytes[b];
+    key->slot = slot;
+    key->priority = denv_order_priority(hash);
+}
+
+/* Adds the new element at slot to the name order, O(log n) name compares.
+   Names past the greatest one, like the ones of grows that come in order,
+   are appended instead. Must be called by a writer once the name is in the
+   block.
+*/
+void denv_order_insert(Table *table, Word slot, char *name, size_t name_len) {
+    Element *elements = denv_table_elements(table);
+    DenvOrderLinks *links = denv_table_links(table);
+    DenvOrderLinks *e = &links[slot];
+    Word last = table->element.last;
+
+    if (g_denv_order.deferred > 0) {
+        denv_order_defer(slot, name, name_len, elements[slot].hash);
+        return;
+    }
+
+    if (last == DENV_ORDER_NONE ||
+        denv_name_compare(name, name_len, denv_order_name(table, last),
+                          elements[last].name_len) > 0) {
+        denv_order_append(table, slot);
+        return;
+    }
+
+    uint64_t priority = denv_order_priority(elements[slot].hash);
+    Word parent = DENV_ORDER_NONE;
+    int c = 0;
+
+    e->left = DENV_ORDER_NONE;
+    e->right = DENV_ORDER_NONE;
+
+    for (Word i = table->element.root; i != DENV_ORDER_NONE;) {
+        parent = i;
+        c = denv_name_compare(name, name_len, denv_order_name(table, i),
+                              elements[i].name_len);
+        i = c < 0 ? links[i].left : links[i].right;
+    }
+
+    e->parent = parent;
+
+    if (c < 0)
+        links[parent].left = slot;
+    else
+        links[parent].right = slot;
+
+    while (e->parent != DENV_ORDER_NONE &&
+           denv_order_priority(elements[e->parent].hash) < priority)
+        denv_order_rotate_up(table, slot);
+}
+
+int denv_order_compare_keys(const void *a, const void *b) {
+    const DenvOrderKey *x = a, *y = b;
+    Table *table = g_denv_order.sorted;
+    Element *elements = denv_table_elements(table);
+
+    for (int i = 0; i < 2; i++) {
+        if (x->prefix[i] != y->prefix[i])
+            return x->prefix[i] < y->prefix[i] ? -1 : 1;
+    }
+
+    return denv_name_compare(
+        denv_order_name(table, x->slot), elements[x->slot].name_len,
+        denv_order_name(table, y->slot), elements[y->slot].name_len);
+}
+
+/* Sorts keys by their prefixes, a byte at a time from the last one. Bytes
+   every key has the same are skipped, like the '\0' padding and the start
+   names share. scratch is as big as keys, returns the one sorted.
+*/
+DenvOrderKey *denv_order_radix_sort(DenvOrderKey *keys, DenvOrderKey *scratch,
+                                    Word count) {
+    Word counts[16][256] = {{0}};
+
+    for (Word i = 0; i < count; i++) {
+        for (int b = 0; b < 16; b++)
+            counts[b][keys[i].prefix[b / 8] >> (56 - b % 8 * 8) & 0xff]++;
+    }
+
+    for (int b = 15; b >= 0; b--) {
+        int shift = 56 - b % 8 * 8;
+        Word offset = 0;
+
+        if (counts[b][keys[0].prefix[b / 8] >> shift & 0xff] == count)
+            continue;
+
+        for (int d = 0; d < 256; d++) {
+            Word n = counts[b][d];
+            counts[b][d] = offset;
+            offset += n;
+        }
+
+        for (Word i = 0; i < count; i++)
+            scratch[counts[b][keys[i].prefix[b / 8] >> shift & 0xff]++] =
+                keys[i];
+
+        DenvOrderKey *sorted = scratch;
+        scratch = keys;
+        keys = sorted;
+    }
+
+    return keys;
+}
+
+/* Puts the names left out while the order was deferred in it, see
+   g_denv_order, the table must have no others. Their keys are radix sorted,
+   names are only compared when their first 16 bytes are the same. Then
+   they're linked like denv_order_append does one after the other, the right
+   spine kept in the buffer the sort left free. Returns -1 if it can't
+   allocate, the order is then empty.
+*/
+int denv_order_build(Table *table) {
+    DenvOrderKey *keys = g_denv_order.keys;
+    Word n = g_denv_order.len;
+    bool failed = g_denv_order.failed;
+
+    g_denv_order.keys = NULL;
+    g_denv_order.len = g_denv_order.size = 0;
+    g_denv_order.failed = false;
+
+    table->element.root = DENV_ORDER_NONE;
+    table->element.last = DENV_ORDER_NONE;
+
+    if (failed || n == 0) {
+        free(keys);
+        return failed ? -1 : 0;
+    }
+
+    DenvOrderKey *scratch = malloc(n * sizeof(DenvOrderKey));
+    if (scratch == NULL) {
+        free(keys);
+        return -1;
+    }
+
+    DenvOrderKey *sorted = denv_order_radix_sort(keys, scratch, n);
+
+    // names with the same first 16 bytes are compared whole
+    g_denv_order.sorted = table;
+    for (Word i = 0, j; i < n; i = j) {
+        for (j = i + 1; j < n && sorted[j].prefix[0] == sorted[i].prefix[0] &&
+                        sorted[j].prefix[1] == sorted[i].prefix[1];
+             j++)
+            ;
+        if (j - i > 1)
+            qsort(&sorted[i], j - i, sizeof(DenvOrderKey),
+                  denv_order_compare_keys);
+    }
+
+    DenvOrderLinks *links = denv_table_links(table);
+    Word *spine = (Word *)(sorted == keys ? scratch : keys);
+    Word top = 0;
+
+    for (Word i = 0; i < n; i++) {
+        DenvOrderLinks *e = &links[sorted[i].slot];
+        Word left = DENV_ORDER_NONE;
+
+        while (top > 0 && sorted[spine[top - 1]].priority < sorted[i].priority)
+            left = spine[--top];
+
+        e->left = left == DENV_ORDER_NONE ? left : sorted[left].slot;
+        e->right = DENV_ORDER_NONE;
+        if (left != DENV_ORDER_NONE)
+            links[sorted[left].slot].parent = sorted[i].slot;
+
+        if (top > 0) {
+            e->parent = sorted[spine[top - 1]].slot;
+            links[e->parent].right = sorted[i].slot;
+        } else {
+            e->parent = DENV_ORDER_NONE;
+        }
+
+        spine[top++] = i;
+    }
+
+    table->element.root = sorted[spine[0]].slot;
+    table->element.last = sorted[n - 1].slot;
+
+    free(keys);
+    free(scratch);
+    return 0;
+}
+
+/* Function that receives table, variable name and value and allocates the
+   element, it also edits the element if the name match. Grows the table if
+   it's full, returns -1 if it can't.
+*/
+int _denv_table_set_value(Table *table, char *name, char *value,
+                          size_t value_len, Word flags) {
+    assert(table != NULL && name != NULL);
+
+    size_t name_len;
+    uint64_t hash = denv_hash(name, &name_len);
+    Word storage_size = name_len + value_len + 2;
+
+    if (!denv_table_has_room(table, storage_size)) {
+        if (denv_table_grow(table, storage_size, 1) != 0)
+            return -1;
+    }
+
+    bool found;
+    Word slot = denv_table_probe(table, name, name_len, hash, &found);
+
+    if (slot == DENV_NO_SLICE)
+        return -1;
+
+    Element *e = &denv_table_elements(table)[slot];
+
+    // Do not let external flags mess up with crucial flags
+    flags &= ~(ELEMENT_IS_USED | ELEMENT_IS_BEING_READ | ELEMENT_IS_FREED);
+
+    if (!found) {
+        table->element.used++;
+        e->flags = 0;
+        e->hash = hash;
+        e->data_word_size = 0;
+
+        denv_element_write_data(table, e, name, name_len, value, value_len,
+                                flags);
+        denv_table_tags(table)[slot] = denv_hash_tag(hash);
+        denv_order_insert(table, slot, name, name_len);
+        return 0;
+    }
+
+    // a removed variable is set again
+    if (e->flags & ELEMENT_IS_FREED) {
+        table->element.removed--;
+        table->element.used++;
+    }
+
+    denv_element_write_data(table, e, name, name_len, value, value_len, flags);
+    return 0;
+}
+
+// Sets a value of value_len bytes, it can hold any byte including '\0'
+int denv_table_set_value_n(Table *table, char *name, char *value,
+                           size_t value_len, Word flags) {
+    assert(table != NULL && name != NULL && value != NULL);
+
+    denv_table_write_begin(table);
+
+        int ret = _denv_table_set_value(table, name, value, value_len, flags);
+
+    denv_table_write_end(table);
+
+    return ret;
+}
+
+int denv_table_set_value(Table *table, char *name, char *value, Word flags) {
+    assert(value != NULL);
+
+    return denv_table_set_value_n(table, name, value, strlen(value), flags);
+}
+
+/* Looks up the element of a name including removed ones, it's safe to call
+   without holding denv_sem as long as the result is validated with
+   denv_table_read_retry
+*/
+Element *_denv_table_find_element(Table *table, char *name) {
+    assert(table != NULL && name != NULL);
+
+    bool found;
+    size_t name_len;
+    uint64_t hash = denv_hash(name, &name_len);
+    Word slot = denv_table_probe(table, name, name_len, hash, &found);
+
+    return found ? &denv_table_elements(table)[slot] : NULL;
+}
+
+Element *denv_table_get_element(Table *table, char *name) {
+    Element *e = _denv_table_find_element(table, name);
+
+    if (e == NULL || (e->flags & ELEMENT_IS_FREED))
+        return NULL;
+
+    return e;
+}
+
+/* Gives the element a slice of words keeping its data, a slice at the end
+   of the block is extended where it is unless it's pinned. Must be called by
+   a writer and the table must have room for it.
+*/
+void denv_element_resize(Table *table, Element *e, Word words) {
+    Word *block = denv_table_block(table);
+    Word old_index = e->data_index;
+    Word old_words = e->data_word_size;
+
+    if (old_index + old_words == table->current_word_block_offset &&
+        words >= old_words &&
+        words - old_words <= table->block_size - old_index - old_words &&
+        !denv_table_slice_is_pinned(table, old_index)) {
+        table->current_word_block_offset = old_index + words;
+        e->data_word_size = words;
+        return;
+    }
+
+    void *new_data = denv_table_slice_block(table, e, words);
+    memcpy(new_data, &block[old_index],
+           (words < old_words ? words : old_words) * sizeof(Word));
+    denv_table_release_slice(table, old_index, old_words);
+}
+
+/* Appends the separator and data to a value in place, the slice moves with
+   headroom for the next appends only when it's full or a reader has it
+   pinned. Sets the value without separator if the name isn't set. Must be
+   called by a writer.
+*/
+int _denv_table_append_value(Table *table, char *name, char *separator,
+                             size_t separator_len, char *data,
+                             size_t data_len) {
+    Element *e = denv_table_get_element(table, name);
+    if (e == NULL)
+        return _denv_table_set_value(table, name, data, data_len, 0);
+
+    size_t value_len = e->value_len + separator_len + data_len;
+    Word words = denv_slice_words(e->name_len + value_len + 2);
+
+    // a pinned value keeps its bytes, the appended one goes somewhere else
+    if (words > e->data_word_size ||
+        denv_table_slice_is_pinned(table, e->data_index)) {
+        words += words / DENV_GROWTH_HEADROOM;
+
+        if (!denv_table_has_room(table, words * sizeof(Word))) {
+            if (denv_table_grow(table, words * sizeof(Word), 0) != 0)
+                return -1;
+
+            // the elements were copied to the grown table
+            e = denv_table_get_element(table, name);
+        }
+
+        denv_element_resize(table, e, words);
+    }
+
+    char *value = (char *)&denv_table_block(table)[e->data_index] +
+                  e->name_len + 1;
+
+    memcpy(value + e->value_len, separator, separator_len);
+    memcpy(value + e->value_len + separator_len, data, data_len);
+    value[value_len] = '\0';
+
+    e->value_len = value_len;
+    e->generation = ++table->last_generation;
+
+    // the whole value, replaying the log doesn't depend on what it was
+    denv_wal_log(table, value - e->name_len - 1, e->name_len, value,
+                 value_len, (e->flags & ELEMENT_IS_ENV) ? DENV_SAVE_ENV : 0);
+
+    return 0;
+}
+
+// Concurrent appends never lose data, each one runs under the write lock
+int denv_table_append_value(Table *table, char *name, char *separator,
+                            char *data, size_t data_len) {
+    assert(table != NULL && name != NULL && separator != NULL && data != NULL);
+
+    denv_table_write_begin(table);
+
+        int ret = _denv_table_append_value(table, name, separator,
+                                           strlen(separator), data, data_len);
+
+    denv_table_write_end(table);
+
+    return ret;
+}
+
+/* Copies a value out of the table in one memcpy, the copy is consistent even
+   if the value is written at the same time. Returns a malloc'd buffer with a
+   '\0' after its value_len bytes, NULL if the name isn't set.
+*/
+char *denv_table_copy_value(Table *table, char *name, size_t *value_len) {
+    assert(table != NULL && name != NULL && value_len != NULL);
+
+    char *copy = NULL;
+    size_t capacity = 0;
+    bool found;
+    Word seq;
+
+    do {
+        seq = denv_table_read_begin(table);
+        found = false;
+
+        Element *e = denv_table_get_element(table, name);
+        char *e_name, *value;
+        size_t name_len, len;
+
+        if (e == NULL ||
+            !denv_table_read_element(table, e, &e_name, &name_len, &value,
+                                     &len))
+            continue;
+
+        if (len + 1 > capacity) {
+            char *new_copy = realloc(copy, len + 1);
+            if (new_copy == NULL) {
+                fprintf(stderr, "%s: Could not allocate %zu bytes.\n",
+                        __FUNCTION__, len + 1);
+                free(copy);
+                return NULL;
+            }
+            copy = new_copy;
+            capacity = len + 1;
+        }
+
+        memcpy(copy, value, len);
+        copy[len] = '\0';
+        *value_len = len;
+        found = true;
+    } while (denv_table_read_retry(table, seq));
+
+    if (!found) {
+        free(copy);
+        return NULL;
+    }
+
+    return copy;
+}
+
+// Generation of the last write on a name, removals count, 0 if never written
+uint64_t denv_table_get_generation(Table *table, char *name) {
+    assert((table != NULL) && (name != NULL));
+
+    uint64_t generation;
+    Word seq;
+
+    do {
+        seq = denv_table_read_begin(table);
+        Element *e = _denv_table_find_element(table, name);
+        generation = e ? e->generation : 0;
+    } while (denv_table_read_retry(table, seq));
+
+    return generation;
+}
+
+/* Wakes every process sleeping in denv_table_wait, writers call it after
+   each change. The futex lives in the shared table so it works across
+   processes, the syscall is skipped when nobody is waiting.
+*/
+void denv_table_wake(Table *table) {
+    atomic_fetch_add(&table->wake, 1);
+
+    if (atomic_load(&table->waiters) == 0)
+        return;
+
+#ifdef __linux__
+    syscall(SYS_futex, (uint32_t *)&table->wake, FUTEX_WAKE, INT32_MAX, NULL,
+            NULL, 0);
+#endif
+}
+
+/* Sleeps until table->wake is different from the value observed by the
+   caller, or for timeout if it isn't NULL
+*/
+void denv_table_wait(Table *table, uint32_t wake,
+                     const struct timespec *timeout) {
+    atomic_fetch_add(&table->waiters, 1);
+
+#ifdef __linux__
+    syscall(SYS_futex, (uint32_t *)&table->wake, FUTEX_WAIT, wake, timeout,
+            NULL, 0);
+#else
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = DENV_POLLING_INTERVAL};
+
+    if (timeout != NULL && (timeout->tv_sec < ts.tv_sec ||
+                            (timeout->tv_sec == ts.tv_sec &&
+                             timeout->tv_nsec < ts.tv_nsec)))
+        ts = *timeout;
+
+    if (atomic_load(&table->wake) == wake)
+        nanosleep(&ts, NULL);
+#endif
+
+    atomic_fetch_sub(&table->waiters, 1);
+}
+
+/* Blocks until the name is written with a generation newer than since and
+   returns it. Every awaiter compares against its own generation so all of
+   them wake up on the same write.
+*/
+uint64_t denv_await_element(Table *table, char *name, uint64_t since) {
+    uint64_t generation;
+
+    denv_await(table, name, since, -1, &generation);
+    return generation;
+}
+
+// Must be called by a writer
+void _denv_table_delete_value(Table *table, char *name) {
+    assert(table != NULL && name != NULL);
+
+    Element *e = denv_table_get_element(table, name);
+
+    if (e != NULL) {
+        // awaiters return on removal too
+        e->flags |= ELEMENT_IS_FREED;
+        e->generation = ++table->last_generation;
+        denv_wal_log(table, name, e->name_len, NULL, 0, DENV_SAVE_REMOVED);
+
+        // the name stays in the index, the value space is reused
+        Word name_words = denv_slice_words(e->name_len + 1);
+        if (e->data_word_size >= name_words + DENV_MIN_SLICE_WORDS &&
+            !denv_table_slice_is_pinned(table, e->data_index)) {
+            denv_table_free_slice(table, e->data_index + name_words,
+                                  e->data_word_size - name_words);
+            e->data_word_size = name_words;
+        }
+        e->value_len = 0;
+
+        table->element.used--;
+        table->element.removed++;
+    }
+}
+
+void denv_table_delete_value(Table *table, char *name) {
+    denv_table_write_begin(table);
+
+        _denv_table_delete_value(table, name);
+
+    denv_table_write_end(table);
+}
+
+int denv_tx_push(DenvTx *tx, DenvTxOp op) {
+    if (tx->len == tx->capacity) {
+        size_t capacity = tx->capacity ? tx->capacity * 2 : 16;
+        DenvTxOp *ops = realloc(tx->ops, capacity * sizeof(DenvTxOp));
+        if (ops == NULL) {
+            fprintf(stderr, "%s: Couldn't allocate more memory.\n",
+                    __FUNCTION__);
+            return -1;
+        }
+        tx->ops = ops;
+        tx->capacity = capacity;
+    }
+
+    tx->ops[tx->len++] = op;
+    return 0;
+}
+
+int denv_tx_set(DenvTx *tx, char *name, char *value, size_t value_len,
+                Word flags) {
+    assert(tx != NULL && name != NULL && value != NULL);
+    return denv_tx_push(tx, (DenvTxOp){name, value, value_len, flags});
+}
+
+int denv_tx_delete(DenvTx *tx, char *name) {
+    assert(tx != NULL && name != NULL);
+    return denv_tx_push(tx, (DenvTxOp){name, NULL, 0, 0});
+}
+
+void denv_tx_free(DenvTx *tx) {
+    free(tx->ops);
+    *tx = (DenvTx){0};
+}
+
+/* Applies every staged write under one write lock, optimistic readers see
+   the table from before or after the transaction, never in between. Room
+   for all of it is made up front so either every write lands or none does.
+   The touched names share one generation, an awaiter wakes up once.
+*/
+int denv_tx_commit(Table *table, DenvTx *tx) {
+    assert(table != NULL && tx != NULL);
+
+    Word words = 0;
+    for (size_t i = 0; i < tx->len; i++) {
+        DenvTxOp *op = &tx->ops[i];
+        if (op->value != NULL) {
+            Word slice = denv_slice_words(strlen(op->name) + op->value_len + 2);
+            words += slice + slice / DENV_GROWTH_HEADROOM;
+        }
+    }
+
+    denv_table_write_begin(table);
+
+    if (!denv_table_has_room_for(table, tx->len, words)) {
+        if (denv_table_grow(table, words * sizeof(Word), tx->len) != 0) {
+            denv_table_write_end(table);
+            return -1;
+        }
+    }
+
+    uint64_t first = table->last_generation;
+    uint64_t generation = first + 1;
+
+    for (size_t i = 0; i < tx->len; i++) {
+        DenvTxOp *op = &tx->ops[i];
+
+        if (op->value == NULL) {
+            _denv_table_delete_value(table, op->name);
+        } else if (_denv_table_set_value(table, op->name, op->value,
+                                         op->value_len, op->flags) != 0) {
+            // can't happen, the room was checked
+            assert(false && "Transaction ran out of room.");
+        }
+
+        // removing a missing name doesn't touch it
+        Element *e = _denv_table_find_element(table, op->name);
+        if (e != NULL && e->generation > first)
+            e->generation = generation;
+    }
+
+    table->last_generation = generation;
+
+    denv_table_write_end(table);
+
+    return 0;
+}
+
+/* The first element of the name order whose name isn't below key, or
+   DENV_ORDER_NONE. Safe to call without holding denv_sem, a torn link ends
+   the walk and fails denv_table_read_retry.
+*/
+Word denv_order_lower_bound(Table *table, const char *key, size_t key_len) {
+    Element *elements = denv_table_elements(table);
+    DenvOrderLinks *links = denv_table_links(table);
+    Word found = DENV_ORDER_NONE;
+    Word i = table->element.root;
+
+    for (Word steps = 0; i < table->max_elements && steps < table->max_elements;
+         steps++) {
+        Element *e = &elements[i];
+        char *name, *value;
+        size_t name_len, value_len;
+
+        if (!denv_table_read_element(table, e, &name, &name_len, &value,
+                                     &value_len))
+            return DENV_ORDER_NONE;
+
+        if (denv_name_compare(name, name_len, key, key_len) >= 0) {
+            found = i;
+            i = links[i].left;
+        } else {
+            i = links[i].right;
+        }
+    }
+
+    return found;
+}
+
+// The element with the smallest name, DENV_ORDER_NONE if there's none
+Word denv_order_first(Table *table) {
+    DenvOrderLinks *links = denv_table_links(table);
+    Word i = table->element.root;
+
+    if (i == DENV_ORDER_NONE)
+        return i;
+
+    while (links[i].left != DENV_ORDER_NONE)
+        i = links[i].left;
+
+    return i;
+}
+
+// The element after slot in the name order, safe like the lower bound
+Word denv_order_next(Table *table, Word slot) {
+    DenvOrderLinks *links = denv_table_links(table);
+    Word steps = 0;
+
+    if (links[slot].right != DENV_ORDER_NONE) {
+        Word i = links[slot].right;
+
+        while (i < table->max_elements &&
+               links[i].left < table->max_elements &&
+               steps++ < table->max_elements)
+            i = links[i].left;
+
+        return i < table->max_elements ? i : DENV_ORDER_NONE;
+    }
+
+    Word parent = links[slot].parent;
+
+    while (parent < table->max_elements && links[parent].right == slot &&
+           steps++ < table->max_elements) {
+        slot = parent;
+        parent = links[slot].parent;
+    }
+
+    return parent < table->max_elements ? parent : DENV_ORDER_NONE;
+}
+
+typedef enum {
+    DENV_LIST_ENV = (1 << 0),     // mark environment variables
+    DENV_LIST_VALUES = (1 << 1),  // name=value lines instead of names
+    DENV_LIST_RECORDS = (1 << 2), // flags, name_len and value_len words
+                                  // followed by "name\0value\0"
+} DenvListFlags;
+
+/* Lists the variables whose name matches pattern in name order into a
+   malloc'd string made from one consistent read, see DenvListFlags for what
+   is written of each. A pattern with *, ? or [ is a glob matched against the
+   whole name, with \ as an ordinary character, otherwise it's a prefix and
+   "" lists every variable. Only the names starting with the part of the
+   pattern before its first wildcard are visited. Returns NULL if it can't
+   allocate.
+*/
+char *denv_table_copy_list(Table *table, const char *pattern, int flags,
+                           size_t *len) {
+    size_t prefix_len = strcspn(pattern, "*?[");
+    bool is_glob = pattern[prefix_len] != '\0';
+    char *list = NULL;
+    size_t list_size = 0;
+    Word seq;
+
+    // print to memory and only hand it out once it's consistent
+    do {
+        free(list);
+        list = NULL;
+
+        FILE *stream = open_memstream(&list, &list_size);
+        if (stream == NULL) {
+            perror("open_memstream");
+            return NULL;
+        }
+
+        seq = denv_table_read_begin(table);
+
+        Word steps = table->max_elements;
+        for (Word i = denv_order_lower_bound(table, pattern, prefix_len);
+             i != DENV_ORDER_NONE && steps-- > 0;
+             i = denv_order_next(table, i)) {
+            Element *e = &denv_table_elements(table)[i];
+
+            Word header[3] = {e->flags};
+            char *name, *value;
+
+            if (!denv_table_read_element(table, e, &name, &header[1], &value,
+                                         &header[2]))
+                break;
+
+            // past the names starting with the prefix
+            if (header[1] < prefix_len || memcmp(name, pattern, prefix_len))
+                break;
+
+            if ((header[0] & (ELEMENT_IS_USED | ELEMENT_IS_FREED)) !=
+                ELEMENT_IS_USED)
+                continue;
+
+            // a name without its '\0' is torn, the read is retried
+            if (is_glob && (name[header[1]] != '\0' ||
+                            fnmatch(pattern, name, FNM_NOESCAPE) != 0))
+                continue;
+
+            if (flags & DENV_LIST_RECORDS) {
+                fwrite(header, 1, sizeof(header), stream);
+                fwrite(name, 1, header[1] + 1, stream);
+                fwrite(value, 1, header[2] + 1, stream);
+            } else if (flags & DENV_LIST_VALUES) {
+                fprintf(stream, "%.*s=", (int)header[1], name);
+                fwrite(value, 1, header[2], stream);
+                fputc('\n', stream);
+            } else if ((flags & DENV_LIST_ENV) &&
+                       (header[0] & ELEMENT_IS_ENV)) {
+                fprintf(stream, "%-20.*s (ENV)\n", (int)header[1], name);
+            } else {
+                fprintf(stream, "%.*s\n", (int)header[1], name);
+            }
+        }
+
+        fclose(stream);
+    } while (denv_table_read_retry(table, seq));
+
+    *len = list_size;
+    return list;
+}
+
+void denv_table_list_values(Table *table, const char *pattern, int flags) {
+    size_t len;
+    char *list = denv_table_copy_list(table, pattern, flags, &len);
+
+    if (list != NULL) {
+        fwrite(list, 1, len, stdout);
+        free(list);
+    }
+}
+
+/* Copies every environment variable to a "name\0value\0" list, the copy is
+   consistent even if the table is written at the same time
+*/
+char *denv_table_snapshot_env(Table *table, size_t *size) {
+    char *env = NULL;
+    Word seq;
+
+    do {
+        free(env);
+        env = NULL;
+
+        FILE *stream = open_memstream(&env, size);
+        if (stream == NULL) {
+            perror("open_memstream");
+            return NULL;
+        }
+
+        seq = denv_table_read_begin(table);
+
+        for (Word i = 0; i < table->max_elements; i++) {
+            Element *e = &denv_table_elements(table)[i];
+
+            char *name, *value;
+            size_t name_len, value_len;
+
+            if ((e->flags &
+                 (ELEMENT_IS_USED | ELEMENT_IS_FREED | ELEMENT_IS_ENV)) !=
+                (ELEMENT_IS_USED | ELEMENT_IS_ENV))
+                continue;
+
+            if (!denv_table_read_element(table, e, &name, &name_len, &value,
+                                         &value_len))
+                continue;
+
+            if (name_len == 0)
+                continue;
+
+            fwrite(name, 1, name_len + 1, stream);
+            fwrite(value, 1, value_len + 1, stream);
+        }
+
+        fclose(stream);
+    } while (denv_table_read_retry(table, seq));
+
+    return env;
+}
+
+int denv_get_shid(char *file_name, size_t size) {
+    key_t key = ftok(file_name, 'D');
+    if (key == DENV_IPC_RESULT_ERROR) {
+        return DENV_IPC_RESULT_ERROR;
+    }
+
+    int shmid = shmget(key, size, 0644 | IPC_CREAT);
+
+    // one smaller than size, left by another version, see
+    // denv_table_is_compatible
+    if (shmid == DENV_IPC_RESULT_ERROR && errno == EINVAL)
+        shmid = shmget(key, 0, 0644);
+
+    return shmid;
+}
+
+size_t denv_shmem_size(int shmid) {
+    struct shmid_ds ds;
+
+    if (shmctl(shmid, IPC_STAT, &ds) == DENV_IPC_RESULT_ERROR)
+        return 0;
+
+    return ds.shm_segsz;
+}
+
+// Maps a segment at addr, replacing whatever this process had mapped there
+void *denv_shmem_map_at(int shmid, void *addr, size_t size) {
+#ifdef SHM_REMAP
+    (void)size;
+    return shmat(shmid, addr, SHM_REMAP);
+#else
+    shmdt(addr);
+    munmap(addr, size);
+    return shmat(shmid, addr, 0);
+#endif
+}
+
+// Applies the DenvShmFlags of this process to a mapping
+void denv_shmem_advise(void *addr, size_t size, int flags) {
+#ifdef MADV_HUGEPAGE
+    // before populating, so the pages faulted in are huge already
+    if (flags & DENV_SHM_HUGE_PAGES)
+        madvise(addr, size, MADV_HUGEPAGE);
+#endif
+#ifdef MADV_POPULATE_WRITE
+    if (flags & DENV_SHM_POPULATE)
+        madvise(addr, size, MADV_POPULATE_WRITE);
+#endif
+    (void)addr, (void)size, (void)flags;
+}
+
+/* Names the key and the root object of a bind path for a backend. The
+   POSIX object is named after its device and inode like ftok does, the
+   table file goes in the bind path directory or next to the bind file.
+*/
+bool denv_mapping_init(DenvMapping *mapping, char *file_name,
+                       DenvShmBackend backend) {
+    struct stat st;
+    int len;
+
+    if (stat(file_name, &st) == -1)
+        return false;
+
+    mapping->backend = backend;
+    mapping->key = ftok(file_name, 'D');
+
+    if (backend == DENV_SHM_FILE)
+        len = snprintf(mapping->name, sizeof(mapping->name),
+                       S_ISDIR(st.st_mode) ? "%s/" DENV_TABLE_FILE
+                                           : "%s." DENV_TABLE_FILE,
+                       file_name);
+    else
+        len = snprintf(mapping->name, sizeof(mapping->name), "/denv-%jx-%jx",
+                       (uintmax_t)st.st_dev, (uintmax_t)st.st_ino);
+
+    if (len < 0 || (size_t)len >= sizeof(mapping->name)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    len = snprintf(mapping->wal_name, sizeof(mapping->wal_name),
+                   S_ISDIR(st.st_mode) ? "%s/" DENV_WAL_FILE
+                                       : "%s." DENV_WAL_FILE,
+                   file_name);
+
+    if (len < 0 || (size_t)len >= sizeof(mapping->wal_name)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    return mapping->key != DENV_IPC_RESULT_ERROR;
+}
+
+// Objects the table grew into are named after the root with their number
+bool denv_posix_name(DenvMapping *mapping, int n, char *name) {
+    int len;
+
+    if (n == 0)
+        len = snprintf(name, DENV_SHM_NAME_LENGTH, "%s", mapping->name);
+    else
+        len = snprintf(name, DENV_SHM_NAME_LENGTH, "%s.%d", mapping->name, n);
+
+    if (len < 0 || len >= DENV_SHM_NAME_LENGTH) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    return true;
+}
+
+int denv_posix_open(DenvMapping *mapping, int n, int oflag) {
+    char name[DENV_SHM_NAME_LENGTH];
+
+    if (!denv_posix_name(mapping, n, name))
+        return -1;
+
+    if (mapping->backend == DENV_SHM_FILE)
+        return open(name, oflag | O_CLOEXEC, 0644);
+
+    return shm_open(name, oflag, 0644);
+}
+
+int denv_posix_unlink(DenvMapping *mapping, int n) {
+    char name[DENV_SHM_NAME_LENGTH];
+
+    if (!denv_posix_name(mapping, n, name))
+        return -1;
+
+    if (mapping->backend == DENV_SHM_FILE)
+        return unlink(name);
+
+    return shm_unlink(name);
+}
+
+// Creates object n with size bytes, an object left by a crash is replaced
+int denv_posix_create(DenvMapping *mapping, int n, size_t size) {
+    int fd = denv_posix_open(mapping, n, O_RDWR | O_CREAT | O_EXCL);
+    if (fd == -1 && errno == EEXIST && n > 0) {
+        denv_posix_unlink(mapping, n);
+        fd = denv_posix_open(mapping, n, O_RDWR | O_CREAT | O_EXCL);
+    }
+    if (fd == -1)
+        return -1;
+
+    if (ftruncate(fd, size) == -1) {
+        close(fd);
+        denv_posix_unlink(mapping, n);
+        return -1;
+    }
+
+    return fd;
+}
+
+size_t denv_posix_size(int fd) {
+    struct stat st;
+
+    if (fstat(fd, &st) == -1)
+        return 0;
+
+    return st.st_size;
+}
+
+/* Maps the whole reserved range at addr to the object, the part past its
+   end faults until the object grows with ftruncate. Every process sees the
+   new size without remapping. Returns the size of the object, 0 on failure.
+*/
+size_t denv_posix_map_at(DenvMapping *mapping, int fd, void *addr) {
+    size_t size = denv_posix_size(fd);
+    if (size < sizeof(Table) || size > DENV_MAX_TABLE_SIZE)
+        return 0;
+
+    // populating only stops at the end of the object, with small pages
+    int populate = (mapping->flags & DENV_SHM_POPULATE) &&
+                           !(mapping->flags & DENV_SHM_HUGE_PAGES)
+                       ? MAP_POPULATE
+                       : 0;
+
+    void *result = mmap(addr, DENV_MAX_TABLE_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_FIXED | MAP_NORESERVE | populate,
+                        fd, 0);
+    if (result == MAP_FAILED)
+        return 0;
+
+    denv_shmem_advise(addr, size, populate ? 0 : mapping->flags);
+
+    return size;
+}
+
+// Segment id or object number of the root, the table is found through it
+int denv_shmem_root_id(DenvMapping *mapping) {
+    if (mapping->backend != DENV_SHM_SYSV)
+        return 0;
+
+    return shmget(mapping->key, 0, 0);
+}
+
+// Maps a segment or object anywhere, NULL if it's gone
+Table *denv_shmem_map_id(DenvMapping *mapping, int id, size_t size) {
+    if (mapping->backend == DENV_SHM_SYSV) {
+        Table *table = shmat(id, NULL, 0);
+        return table == (void *)DENV_IPC_RESULT_ERROR ? NULL : table;
+    }
+
+    int fd = denv_posix_open(mapping, id, O_RDWR);
+    if (fd == -1)
+        return NULL;
+
+    Table *table =
+        mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return table == MAP_FAILED ? NULL : table;
+}
+
+void denv_shmem_unmap(DenvMapping *mapping, void *addr, size_t size) {
+    if (mapping->backend == DENV_SHM_SYSV)
+        shmdt(addr);
+    else
+        munmap(addr, size);
+}
+
+// The memory stays until the last process mapping it lets go
+bool denv_shmem_remove(DenvMapping *mapping, int id) {
+    if (mapping->backend == DENV_SHM_SYSV)
+        return shmctl(id, IPC_RMID, NULL) != DENV_IPC_RESULT_ERROR;
+
+    return denv_posix_unlink(mapping, id) == 0;
+}
+
+// Id of the segment holding the table, the root forwards to it once it grew
+int denv_shmem_current_id(DenvMapping *mapping) {
+    int root_id = denv_shmem_root_id(mapping);
+    if (root_id == DENV_IPC_RESULT_ERROR)
+        return DENV_IPC_RESULT_ERROR;
+
+    Table *root = NULL;
+
+    if (mapping->backend == DENV_SHM_SYSV) {
+        root = shmat(root_id, NULL, SHM_RDONLY);
+        if (root == (void *)DENV_IPC_RESULT_ERROR)
+            return DENV_IPC_RESULT_ERROR;
+    } else {
+        int fd = denv_posix_open(mapping, root_id, O_RDONLY);
+        if (fd == -1)
+            return DENV_IPC_RESULT_ERROR;
+
+        root = mmap(NULL, sizeof(Table), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (root == MAP_FAILED)
+            return DENV_IPC_RESULT_ERROR;
+    }
+
+    int shmid = root_id;
+
+    if (root->magic == DENV_TABLE_MAGIC && (root->flags & TABLE_IS_MOVED)) {
+        atomic_thread_fence(memory_order_acquire);
+        shmid = root->moved_shmid;
+    }
+
+    denv_shmem_unmap(mapping, root, sizeof(Table));
+
+    return shmid;
+}
+
+// Maps the segment or object id at addr, returns its size, 0 on failure
+size_t denv_shmem_map_id_at(DenvMapping *mapping, int id, void *addr) {
+    if (mapping->backend != DENV_SHM_SYSV) {
+        int fd = denv_posix_open(mapping, id, O_RDWR);
+        if (fd == -1)
+            return 0;
+
+        size_t size = denv_posix_map_at(mapping, fd, addr);
+
+        if (size > 0 && mapping->backend == DENV_SHM_FILE) {
+            // held while mapped, see denv_table_recover
+            flock(fd, LOCK_SH);
+            if (mapping->fd != -1)
+                close(mapping->fd);
+            mapping->fd = fd;
+        } else {
+            close(fd);
+        }
+
+        return size;
+    }
+
+    size_t size = denv_shmem_size(id);
+    if (size == 0 || size > DENV_MAX_TABLE_SIZE)
+        return 0;
+
+    if (denv_shmem_map_at(id, addr, size) == (void *)DENV_IPC_RESULT_ERROR)
+        return 0;
+
+    denv_shmem_advise(addr, size, mapping->flags);
+
+    return size;
+}
+
+bool denv_shmem_detach(void *attached_shmem) {
+    bool ret = true;
+
+    if (attached_shmem != g_denv_mapping.table ||
+        g_denv_mapping.backend == DENV_SHM_SYSV)
+        ret = (shmdt(attached_shmem) != DENV_IPC_RESULT_ERROR);
+
+    if (attached_shmem == g_denv_mapping.table) {
+        munmap(attached_shmem, DENV_MAX_TABLE_SIZE);
+        if (g_denv_mapping.backend == DENV_SHM_FILE)
+            close(g_denv_mapping.fd);
+        memset(&g_denv_mapping, 0, sizeof(g_denv_mapping));
+    }
+
+    return ret;
+}
+
+/* Opens the root object of the table file or the POSIX table of the bind
+   path, creating one for backend if no table is there yet. A table created
+   by another process can still be empty, it's waited for.
+*/
+int denv_posix_attach(DenvMapping *mapping, char *file_name, size_t size,
+                      DenvShmBackend backend) {
+    DenvShmBackend backends[] = {DENV_SHM_FILE, DENV_SHM_POSIX};
+    int fd = -1;
+
+    for (size_t i = 0; fd == -1 && i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (!denv_mapping_init(mapping, file_name, backends[i]))
+            return -1;
+        fd = denv_posix_open(mapping, 0, O_RDWR);
+    }
+
+    if (fd == -1 && errno == ENOENT && backend != DENV_SHM_SYSV &&
+        shmget(mapping->key, 0, 0) == DENV_IPC_RESULT_ERROR &&
+        denv_mapping_init(mapping, file_name, backend)) {
+        fd = denv_posix_create(mapping, 0, size);
+        if (fd != -1 || errno != EEXIST)
+            return fd;
+
+        fd = denv_posix_open(mapping, 0, O_RDWR);
+    }
+
+    for (int i = 0; fd != -1 && i < 1000; i++) {
+        if (denv_posix_size(fd) >= sizeof(Table))
+            break;
+        nanosleep(&(struct timespec){0, 1000000}, NULL); // 1ms
+    }
+
+    return fd;
+}
+
+/* A table file outlives the processes that had it mapped, the first one to
+   map it again clears what they left: the semaphore of a writer that died,
+   sleepers that are gone and their pins. A write cut halfway stays as it is.
+*/
+void denv_table_recover(Table *table) {
+    if ((table->flags & TABLE_IS_INITIALIZED) == 0)
+        return;
+
+    sem_init(&table->denv_sem, 1, 1);
+    atomic_store(&table->locker, 0);
+
+    // readers would wait forever on an odd seq
+    if (atomic_load(&table->seq) & 1)
+        atomic_fetch_add(&table->seq, 1);
+
+    atomic_store(&table->waiters, 0);
+
+    for (int i = 0; i < DENV_PIN_SLOTS; i++)
+        atomic_store(&table->pins.slot[i].pid, 0);
+    atomic_store(&table->pins.held, 0);
+}
+
+/* A segment left by a denv with another table layout would be misread, it
+   has to have this layout and the size it was made with. A fresh segment is
+   all zeros.
+*/
+bool denv_table_is_compatible(const Table *table, size_t segment_size) {
+    if (segment_size < sizeof(Table))
+        return false;
+
+    if (table->magic == 0 && table->flags == 0)
+        return true;
+
+    return table->magic == DENV_TABLE_MAGIC &&
+           table->total_size ==
+               denv_table_size(table->max_elements, table->block_size) &&
+           table->total_size <= segment_size;
+}
+
+/* Attaches the table of a bind path inside an address range reserved for
+   the table to grow, see denv_table_remap. A table that exists keeps its
+   backend, a new one is created with the backend in options.
+*/
+void *denv_shmem_attach(char *file_name, size_t size,
+                        const DenvShmOptions *options) {
+    DenvShmOptions defaults = {DENV_SHM_SYSV, 0};
+    DenvMapping mapping = {.fd = -1};
+
+    if (options == NULL)
+        options = &defaults;
+
+    mapping.flags = options->flags;
+
+    void *reserved = mmap(NULL, DENV_MAX_TABLE_SIZE, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED) {
+        fprintf(stderr, "%s: %s at line %i\n", strerror(errno), __FUNCTION__,
+                __LINE__);
+        return NULL;
+    }
+
+    int fd = denv_posix_attach(&mapping, file_name, size, options->backend);
+    size_t segment_size = 0;
+
+    if (fd != -1) {
+        // alone on a table file, nothing of the old processes is running
+        bool is_first = mapping.backend == DENV_SHM_FILE &&
+                        flock(fd, LOCK_EX | LOCK_NB) == 0;
+
+        segment_size = denv_posix_map_at(&mapping, fd, reserved);
+
+        if (segment_size > 0 && mapping.backend == DENV_SHM_FILE) {
+            if (is_first && denv_table_is_compatible(reserved, segment_size))
+                denv_table_recover(reserved);
+            flock(fd, LOCK_SH);
+            mapping.fd = fd;
+        } else {
+            close(fd);
+        }
+    } else if (denv_mapping_init(&mapping, file_name, DENV_SHM_SYSV)) {
+        mapping.shmid = denv_get_shid(file_name, size);
+
+        if (mapping.shmid != DENV_IPC_RESULT_ERROR)
+            segment_size = denv_shmem_map_id_at(&mapping, mapping.shmid,
+                                                 reserved);
+    }
+
+    if (segment_size == 0) {
+        fprintf(stderr, "%s: %s at line %i\n", strerror(errno), __FUNCTION__,
+                __LINE__);
+        if (mapping.fd != -1)
+            close(mapping.fd);
+        munmap(reserved, DENV_MAX_TABLE_SIZE);
+        return NULL;
+    }
+
+    mapping.table = reserved;
+    mapping.size = segment_size;
+    g_denv_mapping = mapping;
+
+    if (!denv_table_is_compatible(reserved, segment_size)) {
+        fprintf(stderr,
+                "%s: The table of \"%s\" was made by another version of "
+                "denv, remove it with `denv drop -b %s`.\n",
+                __FUNCTION__, file_name, file_name);
+        denv_shmem_detach(reserved);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    if (g_denv_mapping.table->flags & TABLE_IS_MOVED) {
+        if (!denv_table_remap(g_denv_mapping.table)) {
+            denv_shmem_detach(reserved);
+            return NULL;
+        }
+    }
+
+    return reserved;
+}
+
+bool denv_shmem_destroy(char *filename) {
+    DenvShmBackend backends[] = {DENV_SHM_FILE, DENV_SHM_POSIX,
+                                 DENV_SHM_SYSV};
+    DenvMapping mapping = {0};
+    int root_id = DENV_IPC_RESULT_ERROR;
+
+    for (size_t i = 0; root_id == DENV_IPC_RESULT_ERROR &&
+                       i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (!denv_mapping_init(&mapping, filename, backends[i])) {
+            fprintf(stderr, "%s: %s at line %i\n", strerror(errno),
+                    __FUNCTION__, __LINE__);
+            return false;
+        }
+
+        if (backends[i] == DENV_SHM_SYSV) {
+            root_id = denv_shmem_root_id(&mapping);
+        } else {
+            int fd = denv_posix_open(&mapping, 0, O_RDONLY);
+            if (fd != -1) {
+                close(fd);
+                root_id = 0;
+            }
+        }
+    }
+
+    if (root_id == DENV_IPC_RESULT_ERROR) {
+        fprintf(stderr, "%s: %s at line %i\n", strerror(errno), __FUNCTION__,
+                __LINE__);
+        return false;
+    }
+
+    // the segment the table grew into goes too, and one a load left
+    int current_id = denv_shmem_current_id(&mapping);
+    Table *current = current_id == DENV_IPC_RESULT_ERROR
+                         ? NULL
+                         : denv_shmem_map_id(&mapping, current_id,
+                                             sizeof(Table));
+    if (current != NULL) {
+        if (current->magic == DENV_TABLE_MAGIC && current->staged.pid != 0)
+            denv_shmem_remove(&mapping, current->staged.shmid);
+        denv_shmem_unmap(&mapping, current, sizeof(Table));
+    }
+
+    if (current_id != DENV_IPC_RESULT_ERROR && current_id != root_id)
+        denv_shmem_remove(&mapping, current_id);
+
+    return denv_shmem_remove(&mapping, root_id);
+}
+
+/* Maps the segment currently holding the table at the same address, so
+   pointers to the table stay valid. Called when a table is found moved.
+*/
+bool denv_table_remap(Table *table) {
+    DenvMapping *mapping = &g_denv_mapping;
+
+    assert(table == mapping->table);
+
+    for (int tries = 0; tries < 16; tries++) {
+        int shmid = denv_shmem_current_id(mapping);
+        if (shmid == DENV_IPC_RESULT_ERROR)
+            break;
+
+        // removed by a newer grow when it fails, look again
+        size_t size = denv_shmem_map_id_at(mapping, shmid, table);
+        if (size == 0)
+            continue;
+
+        mapping->shmid = shmid;
+        mapping->size = size;
+        mapping->moves++;
+
+        return true;
+    }
+
+    fprintf(stderr, "%s: Couldn't follow the table to its new segment.\n",
+            __FUNCTION__);
+    return false;
+}
+
+// The log goes on where it was in a table that replaces src
+void denv_table_copy_wal(Table *dst, Table *src) {
+    atomic_store(&dst->wal.level, atomic_load(&src->wal.level));
+    atomic_store(&dst->wal.epoch, atomic_load(&src->wal.epoch));
+    atomic_store(&dst->wal.appended, atomic_load(&src->wal.appended));
+    atomic_store(&dst->wal.synced, atomic_load(&src->wal.synced));
+    dst->wal.rotated_generation = src->wal.rotated_generation;
+}
+
+/* Copies every live element from src to dst keeping their generations,
+   the names of removed ones are left behind
+*/
+int denv_table_copy_elements(Table *dst, Table *src) {
+    if (dst->dropped_generation < src->dropped_generation)
+        dst->dropped_generation = src->dropped_generation;
+
+    denv_table_copy_wal(dst, src);
+
+    // the copies aren't writes, the log already has them
+    g_denv_wal.paused++;
+
+    // in name order, every name is appended to the new order
+    for (Word i = denv_order_first(src); i != DENV_ORDER_NONE;
+         i = denv_order_next(src, i)) {
+        Element *e = &denv_table_elements(src)[i];
+
+        if (e->flags & ELEMENT_IS_FREED) {
+            if (dst->dropped_generation < e->generation)
+                dst->dropped_generation = e->generation;
+            continue;
+        }
+
+        char *name, *value;
+        size_t name_len, value_len;
+
+        if (!denv_table_read_element(src, e, &name, &name_len, &value,
+                                     &value_len))
+            continue;
+
+        if (_denv_table_set_value(dst, name, value, value_len, e->flags) !=
+            0) {
+            g_denv_wal.paused--;
+            return -1;
+        }
+
+        // keep generations so awaiters don't miss or repeat writes
+        denv_table_get_element(dst, name)->generation = e->generation;
+    }
+
+    g_denv_wal.paused--;
+
+    if (dst->last_generation < src->last_generation)
+        dst->last_generation = src->last_generation;
+
+    return 0;
+}
+
+/* Makes room for size more bytes at the end of the block by growing the
+   POSIX object under it, every process sees the bigger block right away.
+   Nothing moves, free slices stay for compaction to pack.
+*/
+int denv_table_grow_in_place(Table *table, size_t size) {
+    DenvMapping *mapping = &g_denv_mapping;
+    Word block_size = table->block_size;
+    Word words = denv_slice_words(size);
+
+    while (words > block_size - table->current_word_block_offset)
+        block_size *= 2;
+
+    size_t total_size = denv_table_size(table->max_elements, block_size);
+    if (total_size > DENV_MAX_TABLE_SIZE) {
+        fprintf(stderr, "%s: Table can't grow past %zu bytes.\n", __FUNCTION__,
+                (size_t)DENV_MAX_TABLE_SIZE);
+        return -1;
+    }
+
+    int fd = denv_posix_open(mapping, mapping->shmid, O_RDWR);
+    if (fd == -1 || ftruncate(fd, total_size) == -1) {
+        fprintf(stderr, "%s: %s at line %i\n", strerror(errno), __FUNCTION__,
+                __LINE__);
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+
+    denv_shmem_advise((char *)table + mapping->size,
+                      total_size - mapping->size, mapping->flags);
+
+    table->block_size = block_size;
+    table->total_size = total_size;
+    mapping->size = total_size;
+
+    return 0;
+}
+
+/* Creates and maps a segment for the table to move to, numbered past every
+   one given out before with POSIX. Must be called with the lock held.
+*/
+Table *denv_table_new_segment(DenvMapping *mapping, size_t total_size,
+                              int *new_id) {
+    if (mapping->backend != DENV_SHM_SYSV) {
+        Table *table = mapping->table;
+
+        // the writer lock keeps the numbers of concurrent grows and loads
+        // apart, a segment being loaded is only known by the counter
+        *new_id = table->next_shmid > mapping->shmid ? table->next_shmid
+                                                     : mapping->shmid;
+        table->next_shmid = ++*new_id;
+
+        int fd = denv_posix_create(mapping, *new_id, total_size);
+        if (fd != -1)
+            close(fd);
+        else
+            *new_id = DENV_IPC_RESULT_ERROR;
+    } else {
+        *new_id = shmget(IPC_PRIVATE, total_size, 0644 | IPC_CREAT);
+    }
+
+    if (*new_id == DENV_IPC_RESULT_ERROR) {
+        fprintf(stderr, "%s: %s at line %i\n", strerror(errno), __FUNCTION__,
+                __LINE__);
+        return NULL;
+    }
+
+    Table *new_table = denv_shmem_map_id(mapping, *new_id, total_size);
+    if (new_table == NULL) {
+        fprintf(stderr, "%s: %s at line %i\n", strerror(errno), __FUNCTION__,
+                __LINE__);
+        denv_shmem_remove(mapping, *new_id);
+        return NULL;
+    }
+
+    return new_table;
+}
+
+/* Moves every process to new_table, a complete table in the segment new_id
+   that is locked and mid-write. Returns with it in place of the old one,
+   the caller's write_end releases it. Old mappings keep working until
+   their processes notice TABLE_IS_MOVED and remap.
+*/
+int denv_table_switch(Table *table, Table *new_table, int new_id,
+                      size_t total_size) {
+    DenvMapping *mapping = &g_denv_mapping;
+
+    // a table file is replaced once the new one is complete on disk
+    if (mapping->backend == DENV_SHM_FILE) {
+        char new_name[DENV_SHM_NAME_LENGTH];
+
+        msync(new_table, total_size, MS_SYNC);
+
+        if (!denv_posix_name(mapping, new_id, new_name) ||
+            rename(new_name, mapping->name) == -1) {
+            fprintf(stderr, "%s: %s at line %i\n", strerror(errno),
+                    __FUNCTION__, __LINE__);
+            denv_shmem_unmap(mapping, new_table, total_size);
+            denv_shmem_remove(mapping, new_id);
+            return -1;
+        }
+
+        new_id = 0;
+    }
+
+    // forward the root first so new attachers go straight to the new table
+    int root_id = denv_shmem_root_id(mapping);
+    int old_id = mapping->shmid;
+
+    if (root_id != old_id && root_id != DENV_IPC_RESULT_ERROR) {
+        Table *root = denv_shmem_map_id(mapping, root_id, sizeof(Table));
+        if (root != NULL) {
+            root->moved_shmid = new_id;
+            denv_shmem_unmap(mapping, root, sizeof(Table));
+        }
+    }
+
+    table->moved_shmid = new_id;
+    atomic_thread_fence(memory_order_release);
+    table->flags |= TABLE_IS_MOVED;
+
+    // the old table stays readable, waiters wake up and follow it
+    atomic_fetch_add_explicit(&table->seq, 1, memory_order_release);
+    denv_table_unlock(table);
+    denv_table_wake(table);
+
+    denv_shmem_unmap(mapping, new_table, total_size);
+
+    size_t new_size = denv_shmem_map_id_at(mapping, new_id, table);
+    if (new_size == 0) {
+        fprintf(stderr, "%s: %s at line %i\n", strerror(errno), __FUNCTION__,
+                __LINE__);
+        abort();
+    }
+
+    mapping->shmid = new_id;
+    mapping->size = new_size;
+    mapping->moves++;
+
+    if (old_id != root_id)
+        denv_shmem_remove(mapping, old_id);
+
+    return 0;
+}
+
+/* Moves the table to a new segment big enough to store size more bytes and
+   elements more elements, rehashing into a bigger element array when it gets
+   half full. A POSIX table that only needs block space grows in place
+   instead. Must be called by a writer, it returns with the new table locked.
+*/
+int denv_table_grow(Table *table, size_t size, Word elements) {
+    DenvMapping *mapping = &g_denv_mapping;
+
+    // only the attached table can move
+    if (table != mapping->table)
+        return -1;
+
+    Word max_elements = table->max_elements;
+    Word block_size = table->block_size;
+    Word live_words = denv_slice_words(size);
+
+    for (Word i = 0; i < table->max_elements; i++) {
+        Element *e = &denv_table_elements(table)[i];
+
+        if ((e->flags & (ELEMENT_IS_USED | ELEMENT_IS_FREED)) ==
+            ELEMENT_IS_USED)
+            live_words += e->data_word_size;
+    }
+
+    // removed variables aren't copied, they don't count
+    while ((table->element.used + elements) * 2 > max_elements)
+        max_elements *= 2;
+
+    Word slots = table->element.used + table->element.removed;
+
+    if (mapping->backend != DENV_SHM_SYSV &&
+        max_elements == table->max_elements &&
+        slots + elements <= DENV_MAX_LOAD(max_elements))
+        return denv_table_grow_in_place(table, size);
+
+    // freed data isn't copied, the block only grows if live data needs it
+    while (live_words > block_size / 2)
+        block_size *= 2;
+
+    size_t total_size = denv_table_size(max_elements, block_size);
+    if (total_size > DENV_MAX_TABLE_SIZE) {
+        fprintf(stderr, "%s: Table can't grow past %zu bytes.\n", __FUNCTION__,
+                (size_t)DENV_MAX_TABLE_SIZE);
+        return -1;
+    }
+
+    int new_id;
+    Table *new_table = denv_table_new_segment(mapping, total_size, &new_id);
+    if (new_table == NULL)
+        return -1;
+
+    // born locked and mid-write, the caller's write_end releases it
+    denv_table_init(new_table, max_elements, block_size);
+    sem_init(&new_table->denv_sem, 1, 0);
+    atomic_store(&new_table->locker, getpid());
+    new_table->next_shmid = table->next_shmid;
+    new_table->staged = table->staged;
+    // slices gathered for a pass on the old block are of no use in this one
+    new_table->compact_epoch = table->compact_epoch + 1;
+    // same count as the old table, versions taken on either stay comparable
+    atomic_store(&new_table->seq, atomic_load(&table->seq));
+
+    if (denv_table_copy_elements(new_table, table) != 0) {
+        denv_shmem_unmap(mapping, new_table, total_size);
+        denv_shmem_remove(mapping, new_id);
+        return -1;
+    }
+
+    return denv_table_switch(table, new_table, new_id, total_size);
+}
+
+bool denv_table_is_file(Table *table) {
+    return table == g_denv_mapping.table &&
+           g_denv_mapping.backend == DENV_SHM_FILE;
+}
+
+/* Writes the pages of a table file to disk. A consistent copy holds the
+   writer lock until they are written, otherwise writeback is only started.
+*/
+int denv_table_sync(Table *table, bool is_consistent) {
+    if (!denv_table_is_file(table))
+        return 0;
+
+    if (!is_consistent)
+        return msync(table, table->total_size, MS_ASYNC);
+
+    denv_table_lock(table);
+    int ret = msync(table, table->total_size, MS_SYNC);
+    denv_table_unlock(table);
+
+    return ret;
+}
+
+void denv_print_version(void) {
+
+    // discriminator for compiled versions on the same day
+    int disc =
+        denv_hash(__DATE__ __TIME__, NULL) & (DENV_INITIAL_ELEMENTS - 1);
+
+    disc ^= 9733; // xor to generate a bigger number
+
+#ifdef DEBUG_ON
+    printf("denv %d.%d.%d.%04d (DEBUG)\n", DENV_VERSION_A, DENV_VERSION_B,
+           DENV_VERSION_C, disc);
+    return;
+#endif
+    printf("denv %d.%d.%d.%04d\n", DENV_VERSION_A, DENV_VERSION_B,
+           DENV_VERSION_C, disc);
+}
+
+// Share of the used block sitting in the free lists
+double denv_table_fragmentation(Table *table) {
+    if (table->current_word_block_offset == 0)
+        return 0;
+
+    return (double)table->free_list.words / table->current_word_block_offset;
+}
+
+/* Bytes saved by word sized slices compared to the power of two sizes used
+   before, the headroom given to growing values is counted against it
+*/
+long denv_table_saved_bytes(Table *table) {
+    long saved;
+    Word seq;
+
+    do {
+        seq = denv_table_read_begin(table);
+        saved = 0;
+
+        for (Word i = 0; i < table->max_elements; i++) {
+            Element *e = &denv_table_elements(table)[i];
+
+            if ((e->flags & (ELEMENT_IS_USED | ELEMENT_IS_FREED)) !=
+                ELEMENT_IS_USED)
+                continue;
+
+            saved += denv_round_to_power_of_two(e->name_len + e->value_len + 2);
+            saved -= e->data_word_size * sizeof(Word);
+        }
+    } while (denv_table_read_retry(table, seq));
+
+    return saved;
+}
+
+void denv_print_stats_csv(Table *table) {
+    DenvStats stats;
+
+    denv_stats(table, &stats);
+
+    printf("total_size_bytes,data_offset,used,removed,max_elements,block_size,"
+           "free_words,free_slices,fragmentation,saved_bytes\n"
+           "%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%.3f,%ld\n",
+           stats.total_size, stats.data_offset, stats.used, stats.removed,
+           stats.max_elements, stats.block_size, stats.free_words,
+           stats.free_slices, stats.fragmentation, stats.saved_bytes);
+}
+
+// True while a compaction pass is under way or the block is fragmented enough
+bool denv_table_should_compact(Table *table) {
+    denv_table_read_begin(table); // follow the table if it has grown
+
+    if (table->compact_offset != DENV_NO_SLICE)
+        return true;
+
+    return table->free_list.words >= DENV_COMPACT_MIN_WORDS &&
+           denv_table_fragmentation(table) >= DENV_COMPACT_THRESHOLD;
+}
+
+// A slice of the block and the element slot owning it
+typedef struct {
+    Word index;
+    Word slot;
+} DenvCompactSlice;
+
+/* The slices above compact_offset in block order, gathered once per pass by
+   the process stepping it. epoch is the table's compact_epoch they were
+   gathered at, a step of another process or a new block makes them stale.
+*/
+struct {
+    DenvCompactSlice *slices;
+    Word len, next, size;
+    Word epoch;
+} g_denv_compact = {0};
+
+int denv_compact_slice_cmp(const void *a, const void *b) {
+    Word x = ((const DenvCompactSlice *)a)->index;
+    Word y = ((const DenvCompactSlice *)b)->index;
+
+    return (x > y) - (x < y);
+}
+
+// Gathers the slices at or above offset and sorts them, -1 if out of memory
+int denv_compact_gather(Table *table, Word offset) {
+    Element *elements = denv_table_elements(table);
+
+    g_denv_compact.len = 0;
+    g_denv_compact.next = 0;
+
+    for (Word i = 0; i < table->max_elements; i++) {
+        Element *e = &elements[i];
+
+        if ((e->flags & ELEMENT_IS_USED) == 0 || e->data_word_size == 0 ||
+            e->data_index < offset)
+            continue;
+
+        if (g_denv_compact.len == g_denv_compact.size) {
+            Word size = g_denv_compact.size ? g_denv_compact.size * 2 : 1024;
+            DenvCompactSlice *slices = realloc(
+                g_denv_compact.slices, size * sizeof(DenvCompactSlice));
+            if (slices == NULL) {
+                fprintf(stderr, "%s: out of memory\n", __FUNCTION__);
+                g_denv_compact.len = 0;
+                return -1;
+            }
+
+            g_denv_compact.slices = slices;
+            g_denv_compact.size = size;
+        }
+
+        g_denv_compact.slices[g_denv_compact.len++] =
+            (DenvCompactSlice){e->data_index, i};
+    }
+
+    qsort(g_denv_compact.slices, g_denv_compact.len, sizeof(DenvCompactSlice),
+          denv_compact_slice_cmp);
+
+    return 0;
+}
+
+/* Pinned slices can't move, the block is packed around them. Frees the gap
+   between the offset and the pinned slice and returns the offset past it.
+*/
+Word denv_compact_skip(Table *table, Word offset, Word index, Word words) {
+    table->compact_offset = index + words;
+    denv_table_free_slice(table, offset, index - offset);
+
+    return index + words;
+}
+
+// Skips the replaced slices still pinned between the offset and limit
+Word denv_compact_skip_deferred(Table *table, Word offset, Word limit) {
+    if (table->pins.deferred == 0)
+        return offset;
+
+    for (;;) {
+        int lowest = -1;
+
+        for (int i = 0; i < DENV_PIN_SLOTS; i++) {
+            Word index = table->pins.slot[i].index;
+
+            if (table->pins.slot[i].deferred_words != 0 && index >= offset &&
+                index < limit &&
+                (lowest == -1 || index < table->pins.slot[lowest].index))
+                lowest = i;
+        }
+
+        if (lowest == -1)
+            return offset;
+
+        offset = denv_compact_skip(table, offset,
+                                   table->pins.slot[lowest].index,
+                                   table->pins.slot[lowest].deferred_words);
+    }
+}
+
+/* Moves the next DENV_COMPACT_STEP_SLICES slices above compact_offset down
+   to it in block order, packing the block from its start around pinned
+   slices. Removed variables keep their name slices. Must be called by a
+   writer, returns true while there's work left.
+*/
+bool _denv_table_compact_step(Table *table) {
+    Word *block = denv_table_block(table);
+    Element *elements = denv_table_elements(table);
+
+    denv_table_collect_pins(table);
+
+    bool is_stale = g_denv_compact.epoch != table->compact_epoch ||
+                    table->compact_offset == DENV_NO_SLICE;
+
+    // holes above the offset get packed, frees there are dropped meanwhile
+    if (table->compact_offset == DENV_NO_SLICE) {
+        for (int i = 0; i < DENV_SIZE_CLASSES; i++)
+            table->free_list.head[i] = DENV_NO_SLICE;
+
+        table->free_list.words = 0;
+        table->free_list.slices = 0;
+        table->compact_offset = 0;
+    }
+
+    Word offset = table->compact_offset;
+
+    if (is_stale && denv_compact_gather(table, offset) != 0)
+        return false;
+
+    g_denv_compact.epoch = ++table->compact_epoch;
+
+    for (int moved = 0;; moved++) {
+        // slices written at the end of the block since they were gathered
+        if (g_denv_compact.next == g_denv_compact.len) {
+            if (denv_compact_gather(table, offset) != 0)
+                return false;
+            if (g_denv_compact.len == 0)
+                break;
+        }
+
+        if (moved == DENV_COMPACT_STEP_SLICES)
+            return true;
+
+        DenvCompactSlice *s = &g_denv_compact.slices[g_denv_compact.next++];
+        Element *e = &elements[s->slot];
+
+        // the slice was replaced or its variable dropped since then
+        if ((e->flags & ELEMENT_IS_USED) == 0 || e->data_word_size == 0 ||
+            e->data_index != s->index || e->data_index < offset)
+            continue;
+
+        offset = denv_compact_skip_deferred(table, offset, e->data_index);
+
+        if (denv_table_slice_is_pinned(table, e->data_index)) {
+            offset = denv_compact_skip(table, offset, e->data_index,
+                                       e->data_word_size);
+            continue;
+        }
+
+        if (e->data_index != offset) {
+            memmove(&block[offset], &block[e->data_index],
+                    e->data_word_size * sizeof(Word));
+            e->data_index = offset;
+        }
+
+        offset += e->data_word_size;
+        table->compact_offset = offset;
+    }
+
+    // everything is packed, the rest of the block is free again
+    offset = denv_compact_skip_deferred(table, offset,
+                                        table->current_word_block_offset);
+    if (offset < table->current_word_block_offset)
+        table->current_word_block_offset = offset;
+
+    table->compact_offset = DENV_NO_SLICE;
+
+    return false;
+}
+
+// Runs one compaction step under the write lock, true while there's more
+bool denv_table_compact_step(Table *table) {
+    denv_table_write_begin(table);
+    bool more = _denv_table_compact_step(table);
+    denv_table_write_end(table);
+
+    return more;
+}
+
+/* Packs the block in place without a second table. The write lock is only
+   held for one step at a time, readers and writers run in between.
+*/
+void denv_table_compact(Table *table) {
+    while (denv_table_compact_step(table))
+        sched_yield();
+}
+
+int denv_compress(FILE *source, FILE *dest, int level) {
+    int ret, flush;
+    unsigned have;
+    z_stream strm;
+    uint8_t *in = malloc(DENV_CHUNK);
+    uint8_t *out = malloc(DENV_CHUNK);
+    if (!in || !out) {
+        fprintf(stderr, "%s: Failed to allocate buffers\n", __FUNCTION__);
+        return -1;
+    }
+
+    /* allocate deflate state */
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    ret = deflateInit(&strm, level);
+    if (ret != Z_OK)
+        return ret;
+
+    /* compress until end of file */
+    do {
+        strm.avail_in = fread(in, 1, DENV_CHUNK, source);
+        if (ferror(source)) {
+            (void)deflateEnd(&strm);
+            return Z_ERRNO;
+        }
+        flush = feof(source) ? Z_FINISH : Z_NO_FLUSH;
+        strm.next_in = in;
+
+        /* run deflate() on input until output buffer not full, finish
+           compression if all of source has been read in */
+        do {
+            strm.avail_out = DENV_CHUNK;
+            strm.next_out = out;
+            ret = deflate(&strm, flush);   /* no bad return value */
+            assert(ret != Z_STREAM_ERROR); /* state not clobbered */
+            have = DENV_CHUNK - strm.avail_out;
+            if (fwrite(out, 1, have, dest) != have || ferror(dest)) {
+                (void)deflateEnd(&strm);
+                return Z_ERRNO;
+            }
+        } while (strm.avail_out == 0);
+        assert(strm.avail_in == 0); /* all input will be used */
+
+        /* done when last data in file processed */
+    } while (flush != Z_FINISH);
+    assert(ret == Z_STREAM_END); /* stream will be complete */
+
+    /* clean up and return */
+    (void)deflateEnd(&strm);
+
+    free(in);
+    free(out);
+
+    return Z_OK;
+}
+
+int denv_decompress(FILE *source, FILE *dest) {
+    int ret;
+    unsigned have;
+    z_stream strm;
+    uint8_t *in = malloc(DENV_CHUNK);
+    uint8_t *out = malloc(DENV_CHUNK);
+    if (!in || !out) {
+        fprintf(stderr, "%s: Failed to allocate buffers\n", __FUNCTION__);
+        return -1;
+    }
+
+    /* allocate inflate state */
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    ret = inflateInit(&strm);
+    if (ret != Z_OK)
+        return ret;
+
+    /* decompress until deflate stream ends or end of file */
+    do {
+        strm.avail_in = fread(in, 1, DENV_CHUNK, source);
+        if (ferror(source)) {
+            (void)inflateEnd(&strm);
+            return Z_ERRNO;
+        }
+        if (strm.avail_in == 0)
+            break;
+        strm.next_in = in;
+
+        /* run inflate() on input until output buffer not full */
+        do {
+            strm.avail_out = DENV_CHUNK;
+            strm.next_out = out;
+            ret = inflate(&strm, Z_NO_FLUSH);
+            assert(ret != Z_STREAM_ERROR); /* state not clobbered */
+            switch (ret) {
+            case Z_NEED_DICT:
+                ret = Z_DATA_ERROR; /* and fall through */
+            case Z_DATA_ERROR:
+            case Z_MEM_ERROR:
+                (void)inflateEnd(&strm);
+                return ret;
+            }
+            have = DENV_CHUNK - strm.avail_out;
+            if (fwrite(out, 1, have, dest) != have || ferror(dest)) {
+                (void)inflateEnd(&strm);
+                return Z_ERRNO;
+            }
+        } while (strm.avail_out == 0);
+
+        /* done when inflate() says it's done */
+    } while (ret != Z_STREAM_END);
+
+    /* clean up and return */
+    (void)inflateEnd(&strm);
+
+    free(in);
+    free(out);
+
+    return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
+}
+
+// Codecs of save files, each one is recognised by the magic of its stream
+typedef enum {
+    DENV_CODEC_NONE,
+    DENV_CODEC_ZLIB,
+    DENV_CODEC_LZ4,
+    DENV_CODEC_ZSTD,
+    DENV_CODEC_COUNT
+} DenvCodec;
+
+typedef struct {
+    const char *name;
+    const char *magic;
+    size_t magic_len;
+    // NULL when denv was built without the codec
+    int (*compress)(FILE *source, FILE *dest);
+    int (*decompress)(FILE *source, FILE *dest);
+} DenvCodecInfo;
+
+int denv_copy_stream(FILE *source, FILE *dest) {
+    uint8_t *buffer = malloc(DENV_CHUNK);
+    if (buffer == NULL) {
+        fprintf(stderr, "%s: Failed to allocate buffers\n", __FUNCTION__);
+        return -1;
+    }
+
+    size_t len;
+    int ret = 0;
+    while (ret == 0 && (len = fread(buffer, 1, DENV_CHUNK, source)) > 0) {
+        if (fwrite(buffer, 1, len, dest) != len)
+            ret = -1;
+    }
+
+    if (ferror(source))
+        ret = -1;
+
+    free(buffer);
+    return ret;
+}
+
+int denv_zlib_compress(FILE *source, FILE *dest) {
+    return denv_compress(source, dest, DENV_COMPRESSION_LEVEL) == Z_OK ? 0
+                                                                       : -1;
+}
+
+int denv_zlib_decompress(FILE *source, FILE *dest) {
+    return denv_decompress(source, dest) == Z_OK ? 0 : -1;
+}
+
+#ifdef DENV_WITH_LZ4
+// Writes what an LZ4F call left in out, false if it failed
+bool denv_lz4_write(size_t n, uint8_t *out, FILE *dest) {
+    if (LZ4F_isError(n)) {
+        fprintf(stderr, "%s: %s\n", __FUNCTION__, LZ4F_getErrorName(n));
+        return false;
+    }
+
+    return fwrite(out, 1, n, dest) == n;
+}
+
+int denv_lz4_compress(FILE *source, FILE *dest) {
+    LZ4F_cctx *ctx;
+    if (LZ4F_isError(LZ4F_createCompressionContext(&ctx, LZ4F_VERSION)))
+        return -1;
+
+    // room for the frame header, one chunk and the frame footer
+    size_t out_size = LZ4F_compressBound(DENV_CHUNK, NULL) +
+                      LZ4F_HEADER_SIZE_MAX;
+    uint8_t *in = malloc(DENV_CHUNK);
+    uint8_t *out = malloc(out_size);
+    bool ok = in != NULL && out != NULL;
+
+    if (ok)
+        ok = denv_lz4_write(LZ4F_compressBegin(ctx, out, out_size, NULL), out,
+                            dest);
+
+    size_t len;
+    while (ok && (len = fread(in, 1, DENV_CHUNK, source)) > 0) {
+        ok = denv_lz4_write(
+            LZ4F_compressUpdate(ctx, out, out_size, in, len, NULL), out,
+            dest);
+    }
+
+    ok = ok && !ferror(source) &&
+         denv_lz4_write(LZ4F_compressEnd(ctx, out, out_size, NULL), out,
+                        dest);
+
+    LZ4F_freeCompressionContext(ctx);
+    free(in);
+    free(out);
+
+    return ok ? 0 : -1;
+}
+
+int denv_lz4_decompress(FILE *source, FILE *dest) {
+    LZ4F_dctx *ctx;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)))
+        return -1;
+
+    uint8_t *in = malloc(DENV_CHUNK);
+    uint8_t *out = malloc(DENV_CHUNK);
+    bool ok = in != NULL && out != NULL;
+
+    // 0 once the whole frame was decoded
+    size_t hint = 1;
+    size_t len;
+
+    while (ok && (len = fread(in, 1, DENV_CHUNK, source)) > 0) {
+        size_t pos = 0;
+        size_t out_len;
+
+        // a full output buffer may leave decoded data in the context
+        do {
+            size_t in_len = len - pos;
+            out_len = DENV_CHUNK;
+
+            hint = LZ4F_decompress(ctx, out, &out_len, in + pos, &in_len, NULL);
+            if (LZ4F_isError(hint)) {
+                fprintf(stderr, "%s: %s\n", __FUNCTION__,
+                        LZ4F_getErrorName(hint));
+                ok = false;
+                break;
+            }
+
+            pos += in_len;
+            ok = fwrite(out, 1, out_len, dest) == out_len;
+        } while (ok && (pos < len || out_len == DENV_CHUNK));
+    }
+
+    ok = ok && !ferror(source) && hint == 0;
+
+    LZ4F_freeDecompressionContext(ctx);
+    free(in);
+    free(out);
+
+    return ok ? 0 : -1;
+}
+#endif
+
+#ifdef DENV_WITH_ZSTD
+bool denv_zstd_ok(size_t ret) {
+    if (ZSTD_isError(ret)) {
+        fprintf(stderr, "%s: %s\n", __FUNCTION__, ZSTD_getErrorName(ret));
+        return false;
+    }
+
+    return true;
+}
+
+// Compresses with a worker thread per online CPU
+int denv_zstd_compress(FILE *source, FILE *dest) {
+    ZSTD_CCtx *ctx = ZSTD_createCCtx();
+    if (ctx == NULL)
+        return -1;
+
+    uint8_t *in = malloc(DENV_CHUNK);
+    uint8_t *out = malloc(DENV_CHUNK);
+    bool ok = in != NULL && out != NULL;
+
+    ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, DENV_ZSTD_LEVEL);
+
+    // a libzstd without threads refuses it and compresses on this thread
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 1)
+        ZSTD_CCtx_setParameter(ctx, ZSTD_c_nbWorkers, (int)cpus);
+
+    bool last = false;
+    while (ok && !last) {
+        size_t len = fread(in, 1, DENV_CHUNK, source);
+        if (ferror(source)) {
+            ok = false;
+            break;
+        }
+
+        last = feof(source);
+        ZSTD_EndDirective mode = last ? ZSTD_e_end : ZSTD_e_continue;
+        ZSTD_inBuffer input = {in, len, 0};
+        bool done;
+
+        do {
+            ZSTD_outBuffer output = {out, DENV_CHUNK, 0};
+            size_t left = ZSTD_compressStream2(ctx, &output, &input, mode);
+
+            ok = denv_zstd_ok(left) &&
+                 fwrite(out, 1, output.pos, dest) == output.pos;
+
+            // the last chunk is done once the frame is flushed
+            done = last ? left == 0 : input.pos == input.size;
+        } while (ok && !done);
+    }
+
+    ZSTD_freeCCtx(ctx);
+    free(in);
+    free(out);
+
+    return ok ? 0 : -1;
+}
+
+int denv_zstd_decompress(FILE *source, FILE *dest) {
+    ZSTD_DCtx *ctx = ZSTD_createDCtx();
+    if (ctx == NULL)
+        return -1;
+
+    uint8_t *in = malloc(DENV_CHUNK);
+    uint8_t *out = malloc(DENV_CHUNK);
+    bool ok = in != NULL && out != NULL;
+
+    // 0 once the whole frame was decoded
+    size_t left = 1;
+    size_t len;
+
+    while (ok && (len = fread(in, 1, DENV_CHUNK, source)) > 0) {
+        ZSTD_inBuffer input = {in, len, 0};
+        ZSTD_outBuffer output;
+
+        // a full output buffer may leave decoded data in the context
+        do {
+            output = (ZSTD_outBuffer){out, DENV_CHUNK, 0};
+            left = ZSTD_decompressStream(ctx, &output, &input);
+
+            ok = denv_zstd_ok(left) &&
+                 fwrite(out, 1, output.pos, dest) == output.pos;
+        } while (ok && (input.pos < input.size || output.pos == output.size));
+    }
+
+    ok = ok && !ferror(source) && left == 0;
+
+    ZSTD_freeDCtx(ctx);
+    free(in);
+    free(out);
+
+    return ok ? 0 : -1;
+}
+#endif
+
+#ifdef DENV_WITH_LZ4
+#define DENV_LZ4_FUNCTIONS denv_lz4_compress, denv_lz4_decompress
+#else
+#define DENV_LZ4_FUNCTIONS NULL, NULL
+#endif
+
+#ifdef DENV_WITH_ZSTD
+#define DENV_ZSTD_FUNCTIONS denv_zstd_compress, denv_zstd_decompress
+#else
+#define DENV_ZSTD_FUNCTIONS NULL, NULL
+#endif
+
+static const DenvCodecInfo denv_codecs[DENV_CODEC_COUNT] = {
+    [DENV_CODEC_NONE] = {"none", DENV_SAVE_MAGIC, 8, denv_copy_stream,
+                         denv_copy_stream},
+    // every deflate stream with the default window starts with 0x78
+    [DENV_CODEC_ZLIB] = {"zlib", "\x78", 1, denv_zlib_compress,
+                         denv_zlib_decompress},
+    [DENV_CODEC_LZ4] = {"lz4", "\x04\x22\x4d\x18", 4, DENV_LZ4_FUNCTIONS},
+    [DENV_CODEC_ZSTD] = {"zstd", "\x28\xb5\x2f\xfd", 4, DENV_ZSTD_FUNCTIONS},
+};
+
+bool denv_codec_from_name(const char *name, DenvCodec *codec) {
+    for (int i = 0; i < DENV_CODEC_COUNT; i++) {
+        if (strcmp(name, denv_codecs[i].name) == 0) {
+            *codec = (DenvCodec)i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Finds the codec of a save file from its first bytes, -1 if none matches
+int denv_codec_detect(const uint8_t *head, size_t len) {
+    for (int i = 0; i < DENV_CODEC_COUNT; i++) {
+        const DenvCodecInfo *info = &denv_codecs[i];
+        if (len >= info->magic_len &&
+            memcmp(head, info->magic, info->magic_len) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+// Integers in save files are little endian on every platform
+void denv_save_put(uint8_t *p, uint64_t n, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        p[i] = (uint8_t)(n >> (8 * i));
+}
+
+uint64_t denv_save_get(const uint8_t *p, int bytes) {
+    uint64_t n = 0;
+    for (int i = 0; i < bytes; i++)
+        n |= (uint64_t)p[i] << (8 * i);
+    return n;
+}
+
+static uint32_t denv_crc_tables[8][256];
+static pthread_once_t denv_crc_once = PTHREAD_ONCE_INIT;
+
+void denv_crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+        denv_crc_tables[0][i] = c;
+    }
+
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t c = denv_crc_tables[t - 1][i];
+            denv_crc_tables[t][i] = (c >> 8) ^ denv_crc_tables[0][c & 0xff];
+        }
+    }
+}
+
+/* The crc32 of zlib, eight bytes at a time. Records are mostly shorter than
+   what zlib needs to leave its byte loop and this is the bulk of checking a
+   save.
+*/
+uLong denv_crc32(uLong crc, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    uint32_t (*t)[256] = denv_crc_tables;
+    uint32_t c = ~(uint32_t)crc;
+
+    pthread_once(&denv_crc_once, denv_crc_init);
+
+    for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+        c = t[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t w = denv_save_get(p, 8) ^ c;
+        c = t[7][w & 0xff] ^ t[6][(w >> 8) & 0xff] ^ t[5][(w >> 16) & 0xff] ^
+            t[4][(w >> 24) & 0xff] ^ t[3][(w >> 32) & 0xff] ^
+            t[2][(w >> 40) & 0xff] ^ t[1][(w >> 48) & 0xff] ^ t[0][w >> 56];
+    }
+
+    for (; len > 0; len--)
+        c = t[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+
+    return ~c;
+}
+
+// Writes a record head and everything after it, adding its crc to crcs
+void denv_save_record(FILE *stream, uint8_t *head, const char *name,
+                      size_t name_len, const char *value, size_t value_len,
+                      uLong *crcs) {
+    uLong crc = denv_crc32(0, head, DENV_SAVE_RECORD);
+    crc = denv_crc32(crc, name, name_len + 1);
+    crc = denv_crc32(crc, value, value_len);
+
+    uint8_t tail[sizeof(uint32_t)];
+    denv_save_put(tail, crc, 4);
+    *crcs = denv_crc32(*crcs, tail, sizeof(tail));
+
+    fwrite(head, 1, DENV_SAVE_RECORD, stream);
+    fwrite(name, 1, name_len + 1, stream);
+    fwrite(value, 1, value_len, stream);
+    fwrite(tail, 1, sizeof(tail), stream);
+}
+
+// Bytes of the table in use, the header, the index and the used block
+size_t denv_table_used_size(Table *table) {
+    return (char *)&denv_table_block(table)[table->current_word_block_offset] -
+           (char *)table;
+}
+
+/* Copies the used part of the table into process memory as it was at one
+   point in time, saves are serialized from the copy while writers go on.
+   The copy is taken like a read and retried if a write got in the way,
+   after DENV_SNAPSHOT_TRIES it's taken under the writer lock, held only
+   for the memcpy. The memory is faulted in before, outside of the lock.
+   Returns NULL on failure, the copy is freed by denv_snapshot_release.
+*/
+Table *denv_table_snapshot(Table *table) {
+    Table *snapshot = NULL;
+    size_t capacity = 0;
+
+    for (int tries = 0;; tries++) {
+        bool is_locked = tries >= DENV_SNAPSHOT_TRIES;
+        Word seq = 0;
+
+        if (is_locked)
+            denv_table_lock(table);
+        else
+            seq = denv_table_read_begin(table);
+
+        size_t size = denv_table_used_size(table);
+
+        if (size <= capacity) {
+            memcpy(snapshot, table, size);
+
+            if (is_locked) {
+                denv_table_unlock(table);
+                break;
+            }
+            if (!denv_table_read_retry(table, seq))
+                break;
+            continue;
+        }
+
+        if (is_locked)
+            denv_table_unlock(table);
+        else if (denv_table_read_retry(table, seq))
+            continue; // the size was torn
+
+        // room for the writes made until the next try
+        if (snapshot != NULL)
+            munmap(snapshot, capacity);
+        capacity = size + size / 8;
+
+        snapshot = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (snapshot == MAP_FAILED) {
+            perror("mmap");
+            return NULL;
+        }
+    }
+
+    // nothing past the used block was copied
+    snapshot->block_size = snapshot->current_word_block_offset;
+    snapshot->total_size = capacity;
+
+    return snapshot;
+}
+
+void denv_snapshot_release(Table *snapshot) {
+    munmap(snapshot, snapshot->total_size);
+}
+
+/* Writes a snapshot in the logical save format, only names and values are
+   kept so the file doesn't depend on the layout of the table, the build or
+   the platform. The table must not change meanwhile, see
+   denv_table_snapshot.
+
+     header   "DENVSAVE" u32 version u32 flags u64 generation u64 base
+     record   u32 name_len u32 flags u64 value_len u64 generation
+              name\0 value u32 crc
+     trailer  u32 DENV_SAVE_END u32 0 u64 records u64 0 u32 crc
+
+   The crc of a record covers all of its bytes, the one of the trailer covers
+   the crcs of the records in order. A full save has every live variable, a
+   delta (info->is_delta) has every variable written or removed after
+   info->base. It fails if removals after the base left the index since.
+*/
+char *denv_table_write_save(Table *table, DenvSaveInfo *info) {
+    char *save = NULL;
+
+    if (info->is_delta && table->dropped_generation > info->base)
+        return NULL;
+
+    FILE *stream = open_memstream(&save, &info->size);
+    if (stream == NULL) {
+        perror("open_memstream");
+        return NULL;
+    }
+
+    uint8_t head[DENV_SAVE_HEADER];
+
+    info->generation = table->last_generation;
+
+    memcpy(head, DENV_SAVE_MAGIC, 8);
+    denv_save_put(head + 8, DENV_SAVE_VERSION, 4);
+    denv_save_put(head + 12, info->is_delta ? DENV_SAVE_DELTA : 0, 4);
+    denv_save_put(head + 16, info->generation, 8);
+    denv_save_put(head + 24, info->is_delta ? info->base : 0, 8);
+    fwrite(head, 1, DENV_SAVE_HEADER, stream);
+
+    uLong crcs = 0;
+    info->records = 0;
+
+    // in slot order, a load fills the slots of the new table one by one
+    for (Word i = 0; i < table->max_elements; i++) {
+        Element *e = &denv_table_elements(table)[i];
+        Word flags = e->flags;
+        uint64_t generation = e->generation;
+
+        char *name, *value;
+        size_t name_len, value_len;
+
+        if ((flags & ELEMENT_IS_USED) == 0)
+            continue;
+
+        if (info->is_delta ? generation <= info->base
+                           : (flags & ELEMENT_IS_FREED) != 0)
+            continue;
+
+        if (!denv_table_read_element(table, e, &name, &name_len, &value,
+                                     &value_len))
+            continue;
+
+        if (name_len == 0)
+            continue;
+
+        uint32_t save_flags = 0;
+        if (flags & ELEMENT_IS_ENV)
+            save_flags |= DENV_SAVE_ENV;
+        if (flags & ELEMENT_IS_FREED) {
+            save_flags |= DENV_SAVE_REMOVED;
+            value_len = 0;
+        }
+
+        denv_save_put(head, name_len, 4);
+        denv_save_put(head + 4, save_flags, 4);
+        denv_save_put(head + 8, value_len, 8);
+        denv_save_put(head + 16, generation, 8);
+        denv_save_record(stream, head, name, name_len, value, value_len,
+                         &crcs);
+        info->records++;
+    }
+
+    denv_save_put(head, DENV_SAVE_END, 4);
+    denv_save_put(head + 4, 0, 4);
+    denv_save_put(head + 8, info->records, 8);
+    denv_save_put(head + 16, 0, 8);
+    denv_save_put(head + 24, crcs, 4);
+    fwrite(head, 1, DENV_SAVE_RECORD + sizeof(uint32_t), stream);
+
+    if (fclose(stream) != 0) {
+        perror("fclose");
+        free(save);
+        return NULL;
+    }
+
+    return save;
+}
+
+// Records of a save checked by one thread, see denv_save_check
+typedef struct {
+    const uint8_t *save;
+    size_t begin; // first record
+    size_t end;   // after the last record
+    bool is_valid;
+    pthread_t thread;
+} DenvSaveChunk;
+
+// Checks the names and crcs of a chunk whose record lengths were checked
+void *denv_save_check_chunk(void *arg) {
+    DenvSaveChunk *chunk = arg;
+
+    chunk->is_valid = true;
+
+    for (size_t pos = chunk->begin; pos < chunk->end;) {
+        const uint8_t *p = chunk->save + pos;
+        size_t name_len = denv_save_get(p, 4);
+        size_t len = DENV_SAVE_RECORD + name_len + 1 + denv_save_get(p + 8, 8);
+        const char *name = (const char *)p + DENV_SAVE_RECORD;
+
+        if (memchr(name, '\0', name_len) != NULL ||
+            denv_crc32(0, p, len) != denv_save_get(p + len, 4)) {
+            chunk->is_valid = false;
+            break;
+        }
+
+        pos += len + sizeof(uint32_t);
+    }
+
+    return NULL;
+}
+
+/* Checks every record of a logical save before anything is loaded and fills
+   info from it, returns -1 if the save is damaged, truncated or from a newer
+   version. The lengths are walked first, then the crcs of big saves are
+   checked in chunks by a thread per CPU.
+*/
+int denv_save_check(const uint8_t *save, size_t size, DenvSaveInfo *info) {
+    if (size < DENV_SAVE_HEADER || memcmp(save, DENV_SAVE_MAGIC, 8) != 0 ||
+        denv_save_get(save + 8, 4) != DENV_SAVE_VERSION)
+        return -1;
+
+    *info = (DenvSaveInfo){
+        .generation = denv_save_get(save + 16, 8),
+        .base = denv_save_get(save + 24, 8),
+        .size = size,
+        .is_delta = denv_save_get(save + 12, 4) & DENV_SAVE_DELTA,
+    };
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 1 ? 1 : cpus > DENV_CHECK_THREADS ? DENV_CHECK_THREADS
+                                                           : (int)cpus;
+    size_t chunk_size = size / threads;
+    if (chunk_size < DENV_CHECK_CHUNK)
+        chunk_size = DENV_CHECK_CHUNK;
+
+    DenvSaveChunk chunks[DENV_CHECK_THREADS];
+    int count = 0;
+
+    size_t pos = DENV_SAVE_HEADER;
+    uLong crcs = 0;
+
+    chunks[0] = (DenvSaveChunk){.save = save, .begin = pos};
+
+    for (;;) {
+        const uint8_t *p = save + pos;
+
+        if (size - pos < DENV_SAVE_RECORD + sizeof(uint32_t))
+            return -1;
+
+        uint64_t name_len = denv_save_get(p, 4);
+        uint64_t flags = denv_save_get(p + 4, 4);
+        uint64_t value_len = denv_save_get(p + 8, 8);
+
+        if (name_len == DENV_SAVE_END) {
+            uint64_t saved_records = denv_save_get(p + 8, 8);
+            uint64_t saved_crcs = denv_save_get(p + 24, 4);
+
+            if (size - pos != DENV_SAVE_RECORD + sizeof(uint32_t) ||
+                saved_records != info->records || saved_crcs != crcs)
+                return -1;
+
+            break;
+        }
+
+        // bounded by the size first so the sum can't overflow
+        if (name_len == 0 || value_len > size)
+            return -1;
+
+        size_t len = DENV_SAVE_RECORD + name_len + 1 + value_len;
+        if (size - pos < len + sizeof(uint32_t) ||
+            p[DENV_SAVE_RECORD + name_len] != '\0')
+            return -1;
+
+        crcs = denv_crc32(crcs, p + len, sizeof(uint32_t));
+        if ((flags & DENV_SAVE_REMOVED) == 0)
+            info->words += denv_slice_words(name_len + value_len + 2);
+        info->records++;
+        pos += len + sizeof(uint32_t);
+
+        if (pos - chunks[count].begin >= chunk_size &&
+            count + 1 < threads) {
+            chunks[count++].end = pos;
+            chunks[count] = (DenvSaveChunk){.save = save, .begin = pos};
+        }
+    }
+
+    chunks[count++].end = pos;
+
+    // the first chunk is checked here, a chunk without a thread too
+    for (int i = 1; i < count; i++) {
+        if (pthread_create(&chunks[i].thread, NULL, denv_save_check_chunk,
+                           &chunks[i]) != 0) {
+            chunks[i].thread = pthread_self();
+            denv_save_check_chunk(&chunks[i]);
+        }
+    }
+
+    denv_save_check_chunk(&chunks[0]);
+    bool is_valid = chunks[0].is_valid;
+
+    for (int i = 1; i < count; i++) {
+        if (!pthread_equal(chunks[i].thread, pthread_self()))
+            pthread_join(chunks[i].thread, NULL);
+        is_valid = is_valid && chunks[i].is_valid;
+    }
+
+    return is_valid ? 0 : -1;
+}
+
+/* Applies the records of a checked logical save written after since, a full
+   save goes in an empty table
+*/
+int denv_table_read_save(Table *table, const uint8_t *save,
+                         DenvSaveInfo *info, uint64_t since) {
+    if (!denv_table_has_room_for(table, info->records, info->words)) {
+        if (denv_table_grow(table, info->words * sizeof(Word),
+                            info->records) != 0)
+            return -1;
+    }
+
+    const uint8_t *p = save + DENV_SAVE_HEADER;
+
+    for (Word i = 0; i < info->records; i++) {
+        size_t name_len = denv_save_get(p, 4);
+        uint32_t flags = denv_save_get(p + 4, 4);
+        size_t value_len = denv_save_get(p + 8, 8);
+        uint64_t generation = denv_save_get(p + 16, 8);
+
+        char *name = (char *)p + DENV_SAVE_RECORD;
+        char *value = name + name_len + 1;
+
+        p += DENV_SAVE_RECORD + name_len + 1 + value_len + sizeof(uint32_t);
+
+        if (generation <= since)
+            continue;
+
+        if (flags & DENV_SAVE_REMOVED) {
+            _denv_table_delete_value(table, name);
+        } else if (_denv_table_set_value(table, name, value, value_len,
+                                         (flags & DENV_SAVE_ENV)
+                                             ? ELEMENT_IS_ENV
+                                             : 0) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Removes every variable and their names, a write like any other for the
+   log. Pinned readers must have finished, see
+   denv_table_write_begin_unpinned.
+*/
+void denv_table_clear(Table *table) {
+    memset(denv_table_tags(table), 0, table->max_elements);
+    memset(denv_table_elements(table), 0,
+           table->max_elements * sizeof(Element));
+    table->element.used = 0;
+    table->element.removed = 0;
+    table->element.root = DENV_ORDER_NONE;
+    table->element.last = DENV_ORDER_NONE;
+    table->dropped_generation = ++table->last_generation;
+    denv_table_reset_block(table);
+
+    denv_wal_log(table, "", 0, NULL, 0, DENV_SAVE_CLEAR);
+}
+
+/* Generations of a table loaded from files carry on after theirs, so every
+   write made from now on is newer than what the files and the log have
+*/
+void denv_table_follow_generation(Table *table, uint64_t generation) {
+    if (table->last_generation < generation)
+        table->last_generation = generation;
+}
+
+// Makes a rename or a new file in the directory of path survive a crash
+int denv_sync_dir(const char *path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL)
+        snprintf(dir, sizeof(dir), ".");
+    else if (slash == dir)
+        slash[1] = '\0';
+    else
+        *slash = '\0';
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+/* Compresses a logical save next to pathname and renames it over it, the
+   save is on disk when it returns
+*/
+int denv_write_save_file(const char *save, size_t size, char *pathname,
+                         DenvCodec codec) {
+    assert(save && pathname && codec < DENV_CODEC_COUNT);
+
+    const DenvCodecInfo *info = &denv_codecs[codec];
+    if (info->compress == NULL) {
+        fprintf(stderr, "%s: denv was built without %s.\n", __FUNCTION__,
+                info->name);
+        return -1;
+    }
+
+    char temp_path[PATH_MAX];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", pathname) >=
+        (int)sizeof(temp_path)) {
+        fprintf(stderr, "%s: Path \"%s\" is too long.\n", __FUNCTION__,
+                pathname);
+        return -1;
+    }
+
+    FILE *save_file = fmemopen((void *)save, size, "r");
+    if (save_file == NULL) {
+        perror("fmemopen");
+        return -1;
+    }
+
+    FILE *dst_file = fopen(temp_path, "w");
+    if (dst_file == NULL) {
+        perror("fopen");
+        fclose(save_file);
+        return -1;
+    }
+
+    int ret = info->compress(save_file, dst_file);
+    if (ret != 0) {
+        fprintf(stderr, "%s: Failed to compress table with %s.\n",
+                __FUNCTION__, info->name);
+    }
+    fclose(save_file);
+
+    if (ret == 0 && (fflush(dst_file) != 0 || fsync(fileno(dst_file)) != 0)) {
+        perror("fsync");
+        ret = -1;
+    }
+
+    if (fclose(dst_file) != 0 && ret == 0) {
+        perror("fclose");
+        ret = -1;
+    }
+
+    if (ret == 0 && rename(temp_path, pathname) != 0) {
+        perror("rename");
+        ret = -1;
+    }
+
+    // the file is kept if only its directory entry isn't synced
+    if (ret == 0 && denv_sync_dir(pathname) != 0)
+        perror("fsync");
+
+    // callers report errno, which the temporary file can't hide
+    if (ret != 0) {
+        int error = errno;
+        unlink(temp_path);
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Saves a snapshot of the table compressed with codec, the file is written
+   next to the destination and renamed over it so a crash never leaves half
+   a save. A NULL info saves every live variable, see denv_table_write_save.
+*/
+int denv_save_to_file(Table *table, char *pathname, DenvCodec codec,
+                      DenvSaveInfo *info) {
+    assert(table && pathname);
+
+    DenvSaveInfo full = {0};
+    if (info == NULL)
+        info = &full;
+
+    Table *snapshot = denv_table_snapshot(table);
+    if (snapshot == NULL)
+        return -1;
+
+    char *save = denv_table_write_save(snapshot, info);
+    denv_snapshot_release(snapshot);
+    if (save == NULL)
+        return -1;
+
+    int ret = denv_write_save_file(save, info->size, pathname, codec);
+    free(save);
+
+    return ret;
+}
+
+/* Reads a save file decompressed into memory, an uncompressed one is mapped
+   instead of copied. Returns NULL if it can't be read.
+*/
+uint8_t *denv_read_save_file(char *pathname, size_t *size, bool *is_mapped) {
+    char *saved = NULL;
+    size_t saved_size = 0;
+
+    FILE *src_file = fopen(pathname, "r");
+    if (!src_file) {
+        perror("fopen");
+        return NULL;
+    }
+
+    uint8_t head[8];
+    size_t head_len = fread(head, 1, sizeof(head), src_file);
+    int codec = denv_codec_detect(head, head_len);
+    const DenvCodecInfo *codec_info = codec < 0 ? NULL : &denv_codecs[codec];
+    struct stat st;
+
+    *is_mapped = false;
+
+    if (codec == DENV_CODEC_NONE && fstat(fileno(src_file), &st) == 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                         fileno(src_file), 0);
+        if (map != MAP_FAILED) {
+            fclose(src_file);
+            *size = st.st_size;
+            *is_mapped = true;
+            return map;
+        }
+    }
+
+    int ret = -1;
+    FILE *table_file = open_memstream(&saved, &saved_size);
+
+    if (table_file == NULL) {
+        perror("open_memstream");
+    } else if (codec_info == NULL) {
+        fprintf(stderr, "%s: \"%s\" isn't a denv save file.\n", __FUNCTION__,
+                pathname);
+    } else if (codec_info->decompress == NULL) {
+        fprintf(stderr, "%s: \"%s\" is compressed with %s, denv was built "
+                        "without it.\n",
+                __FUNCTION__, pathname, codec_info->name);
+    } else if (fseek(src_file, 0, SEEK_SET) != 0) {
+        perror("fseek");
+    } else {
+        ret = codec_info->decompress(src_file, table_file);
+        if (ret != 0)
+            fprintf(stderr, "%s: Failed to decompress table with %s.\n",
+                    __FUNCTION__, codec_info->name);
+    }
+
+    if (table_file != NULL)
+        fclose(table_file);
+    fclose(src_file);
+
+    if (ret != 0) {
+        free(saved);
+        return NULL;
+    }
+
+    *size = saved_size;
+    return (uint8_t *)saved;
+}
+
+void denv_release_save_file(uint8_t *saved, size_t size, bool is_mapped) {
+    if (is_mapped)
+        munmap(saved, size);
+    else
+        free(saved);
+}
+
+/* Removes the segment of a load whose process died before publishing it.
+   Returns -1 with errno EBUSY if the process is still loading. Must be
+   called with the lock held.
+*/
+int denv_table_reclaim_staged(Table *table) {
+    pid_t pid = table->staged.pid;
+
+    if (pid == 0)
+        return 0;
+
+    if (pid != getpid() && (kill(pid, 0) == 0 || errno != ESRCH)) {
+        fprintf(stderr, "%s: Process %d is loading a save into the table.\n",
+                __FUNCTION__, (int)pid);
+        errno = EBUSY;
+        return -1;
+    }
+
+    denv_shmem_remove(&g_denv_mapping, table->staged.shmid);
+    table->staged.pid = 0;
+
+    return 0;
+}
+
+/* Builds the table of a checked full save in a segment of its own, sized
+   like a table grown to hold it. Only the segment is created under the lock,
+   nothing points to it until denv_table_publish but the live table records
+   it, see denv_table_reclaim_staged. The load is logged as a clear and the
+   records, see denv_wal_spill, flushed when it's published.
+*/
+Table *denv_table_stage(Table *table, const uint8_t *save, DenvSaveInfo *info,
+                        int *staged_id) {
+    DenvMapping *mapping = &g_denv_mapping;
+    Word max_elements = DENV_INITIAL_ELEMENTS;
+    Word block_size = DENV_INITIAL_BLOCK_SIZE;
+
+    while (info->records * 2 > max_elements)
+        max_elements *= 2;
+    while (info->words > block_size / 2)
+        block_size *= 2;
+
+    size_t total_size = denv_table_size(max_elements, block_size);
+    if (total_size > DENV_MAX_TABLE_SIZE) {
+        fprintf(stderr, "%s: Table can't grow past %zu bytes.\n", __FUNCTION__,
+                (size_t)DENV_MAX_TABLE_SIZE);
+        return NULL;
+    }
+
+    Table *staged = NULL;
+
+    // recorded so it can be removed if this process dies before publishing
+    denv_table_lock(table);
+    if (denv_table_reclaim_staged(table) == 0) {
+        staged = denv_table_new_segment(mapping, total_size, staged_id);
+        if (staged != NULL) {
+            table->staged.shmid = *staged_id;
+            table->staged.pid = getpid();
+        }
+    }
+    denv_table_unlock(table);
+
+    if (staged == NULL)
+        return NULL;
+
+    // born locked like a grown table, it's released once published
+    denv_table_init(staged, max_elements, block_size);
+    sem_init(&staged->denv_sem, 1, 0);
+    atomic_store(&staged->locker, getpid());
+    atomic_store(&staged->wal.level, atomic_load(&table->wal.level));
+
+    // the generations are moved past the table's when it's published
+    staged->last_generation = info->generation;
+    staged->dropped_generation = ++staged->last_generation;
+    g_denv_wal.spill.is_enabled = true;
+    denv_wal_log(staged, "", 0, NULL, 0, DENV_SAVE_CLEAR);
+
+    // the names of a save come in slot order, they're put in order at once
+    g_denv_order.deferred++;
+    int ret = denv_table_read_save(staged, save, info, 0);
+    g_denv_order.deferred--;
+
+    if (denv_order_build(staged) != 0)
+        ret = -1;
+
+    if (ret != 0) {
+        g_denv_wal.pending.len = 0;
+        denv_wal_spill_end();
+        denv_shmem_unmap(mapping, staged, total_size);
+
+        denv_table_lock(table);
+        denv_shmem_remove(mapping, *staged_id);
+        table->staged.pid = 0;
+        denv_table_unlock(table);
+        return NULL;
+    }
+
+    // most of a table file is written back before the lock is taken
+    if (mapping->backend == DENV_SHM_FILE)
+        msync(staged, total_size, MS_SYNC);
+
+    return staged;
+}
+
+/* Replaces the table with a staged one the same way a grown table replaces
+   it, readers see the old variables or the new ones. Generations of the
+   staged table move past the writes made while it was built.
+*/
+int denv_table_publish(Table *table, Table *staged, int staged_id) {
+    Element *elements = denv_table_elements(staged);
+
+    denv_table_write_begin(table);
+
+    uint64_t first = staged->dropped_generation;
+    if (table->last_generation >= first) {
+        uint64_t shift = table->last_generation - first + 1;
+
+        for (Word i = 0; i < staged->max_elements; i++) {
+            if (elements[i].flags & ELEMENT_IS_USED)
+                elements[i].generation += shift;
+        }
+        staged->last_generation += shift;
+        staged->dropped_generation += shift;
+    }
+
+    staged->next_shmid = table->next_shmid;
+    staged->compact_epoch = table->compact_epoch + 1;
+    atomic_store(&staged->seq, atomic_load(&table->seq));
+    denv_table_copy_wal(staged, table);
+
+    // the switch removes the segment if it fails
+    table->staged.pid = 0;
+
+    int ret = denv_table_switch(table, staged, staged_id, staged->total_size);
+    if (ret != 0)
+        g_denv_wal.pending.len = 0;
+
+    denv_table_write_end(table);
+    denv_wal_spill_end();
+
+    return ret;
+}
+
+/* Saves of the 1.x releases are the whole table deflated, with the fixed
+   layout below. Element flags kept their bits since.
+*/
+#define DENV_LEGACY_ELEMENTS (1 << 11)
+#define DENV_LEGACY_BLOCK_SIZE (1 << 20) // in words
+
+typedef struct {
+    Word flags;
+    Word data_index;     // block index
+    Word data_word_size; // size in words
+    Word collision_next; // get collision member
+} DenvLegacyElement;
+
+typedef struct {
+    Word magic;
+    Word flags;
+    sem_t denv_sem;
+    struct {
+        Word used;
+        Word collision_used;
+        DenvLegacyElement array[DENV_LEGACY_ELEMENTS];
+        DenvLegacyElement collision_array[DENV_LEGACY_ELEMENTS];
+    } element;
+    Word total_size;
+    Word current_word_block_offset;
+    Word block[DENV_LEGACY_BLOCK_SIZE];
+} DenvLegacyTable;
+
+/* Turns a legacy save into a logical save with every live variable at
+   generation 1, NULL if raw isn't one. Names and values are C strings that
+   must end inside the block.
+*/
+uint8_t *denv_legacy_to_save(const uint8_t *raw, size_t raw_size,
+                             size_t *size) {
+    const DenvLegacyTable *legacy = (const DenvLegacyTable *)raw;
+
+    if (raw_size != sizeof(DenvLegacyTable) || legacy->magic != DENV_MAGIC)
+        return NULL;
+
+    char *save = NULL;
+    FILE *stream = open_memstream(&save, size);
+    if (stream == NULL) {
+        perror("open_memstream");
+        return NULL;
+    }
+
+    uint8_t head[DENV_SAVE_HEADER];
+
+    memcpy(head, DENV_SAVE_MAGIC, 8);
+    denv_save_put(head + 8, DENV_SAVE_VERSION, 4);
+    denv_save_put(head + 12, 0, 4);
+    denv_save_put(head + 16, 1, 8);
+    denv_save_put(head + 24, 0, 8);
+    fwrite(head, 1, DENV_SAVE_HEADER, stream);
+
+    const char *block = (const char *)legacy->block;
+    size_t block_bytes = sizeof(legacy->block);
+    uLong crcs = 0;
+    uint64_t records = 0;
+
+    for (Word i = 0; i < 2 * DENV_LEGACY_ELEMENTS; i++) {
+        const DenvLegacyElement *e =
+            i < DENV_LEGACY_ELEMENTS
+                ? &legacy->element.array[i]
+                : &legacy->element.collision_array[i - DENV_LEGACY_ELEMENTS];
+
+        if ((e->flags & (ELEMENT_IS_USED | ELEMENT_IS_FREED)) !=
+                ELEMENT_IS_USED ||
+            e->data_index >= DENV_LEGACY_BLOCK_SIZE)
+            continue;
+
+        const char *name = block + e->data_index * sizeof(Word);
+        size_t room = block_bytes - e->data_index * sizeof(Word);
+        size_t name_len = strnlen(name, room);
+
+        if (name_len == 0 || name_len + 1 >= room)
+            continue;
+
+        const char *value = name + name_len + 1;
+        size_t value_len = strnlen(value, room - name_len - 1);
+
+        if (value_len == room - name_len - 1)
+            continue;
+
+        denv_save_put(head, name_len, 4);
+        denv_save_put(head + 4, (e->flags & ELEMENT_IS_ENV) ? DENV_SAVE_ENV : 0,
+                      4);
+        denv_save_put(head + 8, value_len, 8);
+        denv_save_put(head + 16, 1, 8);
+        denv_save_record(stream, head, name, name_len, value, value_len,
+                         &crcs);
+        records++;
+    }
+
+    denv_save_put(head, DENV_SAVE_END, 4);
+    denv_save_put(head + 4, 0, 4);
+    denv_save_put(head + 8, records, 8);
+    denv_save_put(head + 16, 0, 8);
+    denv_save_put(head + 24, crcs, 4);
+    fwrite(head, 1, DENV_SAVE_RECORD + sizeof(uint32_t), stream);
+
+    if (fclose(stream) != 0) {
+        perror("fclose");
+        free(save);
+        return NULL;
+    }
+
+    return (uint8_t *)save;
+}
+
+/* Replaces the variables of the table with the ones in a save file. The
+   save is checked and built into a table of its own while the table is
+   used, then published in its place under a brief write lock. Legacy saves
+   are converted first.
+
+   A delta is applied on top of the variables instead. With info set to what
+   the full save it follows returned, a delta newer than it is refused and
+   only its writes after that save are applied, so a delta older than the
+   save can still be loaded. On return info describes the file.
+*/
+Table *denv_load_from_file(Table *table, char *pathname, DenvSaveInfo *info) {
+    assert(table && pathname);
 
-        Word flags = table->element.array[i].flags;
+    // only the attached table can be replaced
+    if (table != g_denv_mapping.table)
+        return NULL;
 
-        if ((flags & (ELEMENT_IS_USED | ELEMENT_IS_FREED)) == ELEMENT_IS_USED) {
+    size_t saved_size;
+    bool is_mapped;
 
-            if (list_env && (flags & ELEMENT_IS_ENV)) {
-                printf(
-                    "%-20s (ENV)\n",
-                    (char *)&table->block[table->element.array[i].data_index]);
-            } else {
-                printf(
-                    "%s\n",
-                    (char *)&table->block[table->element.array[i].data_index]);
-            }
-        }
+    uint8_t *saved = denv_read_save_file(pathname, &saved_size, &is_mapped);
+    if (saved == NULL)
+        return NULL;
 
-        Word col_flags = table->element.collision_array[i].flags;
+    size_t legacy_size;
+    uint8_t *legacy = denv_legacy_to_save(saved, saved_size, &legacy_size);
+    if (legacy != NULL) {
+        denv_release_save_file(saved, saved_size, is_mapped);
+        saved = legacy;
+        saved_size = legacy_size;
+        is_mapped = false;
+    }
 
-        if ((col_flags & (ELEMENT_IS_USED | ELEMENT_IS_FREED)) ==
-            ELEMENT_IS_USED) {
+    DenvSaveInfo saved_info;
 
-            if (list_env && (col_flags & ELEMENT_IS_ENV)) {
-                printf(
-                    "%-20s (ENV)\n",
-                    (char *)&table
-                        ->block[table->element.collision_array[i].data_index]);
-            } else {
-                printf(
-                    "%s\n",
-                    (char *)&table
-                        ->block[table->element.collision_array[i].data_index]);
-            }
+    if (denv_save_check(saved, saved_size, &saved_info) != 0) {
+        fprintf(stderr, "%s: \"%s\" is damaged or isn't a compatible save "
+                        "file.\n",
+                __FUNCTION__, pathname);
+        denv_release_save_file(saved, saved_size, is_mapped);
+        return NULL;
+    }
+
+    int ret;
+
+    if (saved_info.is_delta) {
+        uint64_t since = info ? info->generation : 0;
+
+        if (info && saved_info.base > since) {
+            fprintf(stderr, "%s: \"%s\" doesn't follow the loaded save.\n",
+                    __FUNCTION__, pathname);
+            denv_release_save_file(saved, saved_size, is_mapped);
+            return NULL;
         }
+
+        denv_table_write_begin(table);
+        denv_table_follow_generation(table, saved_info.generation);
+        ret = denv_table_read_save(table, saved, &saved_info, since);
+        denv_table_write_end(table);
+    } else {
+        int staged_id;
+        Table *staged = denv_table_stage(table, saved, &saved_info, &staged_id);
+
+        ret = staged ? denv_table_publish(table, staged, staged_id) : -1;
     }
-}
 
-int denv_get_shid(char *file_name, size_t size) {
-    key_t key = ftok(file_name, 'D');
-    if (key == DENV_IPC_RESULT_ERROR) {
-        return DENV_IPC_RESULT_ERROR;
+    denv_release_save_file(saved, saved_size, is_mapped);
+
+    if (ret != 0) {
+        fprintf(stderr, "%s: Couldn't load \"%s\" into the table.\n",
+                __FUNCTION__, pathname);
+        return NULL;
     }
 
-    return shmget(key, size, 0644 | IPC_CREAT);
+    if (info != NULL)
+        *info = saved_info;
+
+    return table;
 }
 
-void *denv_shmem_attach(char *file_name, size_t size) {
-    int shared_block_id = denv_get_shid(file_name, size);
+/* Write-ahead log. Every write made while the table's level isn't
+   DENV_DURABILITY_NONE is appended to the log in the record format of the
+   saves before the writer lock is released, one write() per lock hold.
 
-    if (shared_block_id == DENV_IPC_RESULT_ERROR) {
-        fprintf(stderr, "%s: %s at line %i\n", strerror(errno), __FUNCTION__,
-                __LINE__);
-        return NULL;
-    }
+     header   "DENVWAL\0" u32 version u32 level
+     record   u32 name_len u32 flags u64 value_len u64 generation
+              name\0 value u32 crc
 
-    void *result = shmat(shared_block_id, NULL, 0);
-    if (result == (char *)DENV_IPC_RESULT_ERROR) {
-        fprintf(stderr, "%s: %s at line %i\n", strerror(errno), __FUNCTION__,
-                __LINE__);
-        return NULL;
+   The records of one lock hold are a group, all but the last have
+   DENV_SAVE_MORE and all have the generation of the table when the lock was
+   released. Groups are replayed whole on top of the saves older than them,
+   a transaction is never half applied. Appends log their whole value and a
+   cleared table logs a DENV_SAVE_CLEAR record without a name.
+*/
+int denv_bytes_append(DenvBytes *b, const void *data, size_t len);
+
+void denv_wal_spill(size_t last);
+
+// Adds a record to the write being made, its generation is set on flush
+void denv_wal_log(Table *table, const char *name, size_t name_len,
+                  const char *value, size_t value_len, uint32_t flags) {
+    if (g_denv_wal.paused > 0 || g_denv_wal.spill.is_dropped ||
+        atomic_load_explicit(&table->wal.level, memory_order_relaxed) ==
+            DENV_DURABILITY_NONE)
+        return;
+
+    uint8_t head[DENV_SAVE_RECORD] = {0};
+    uint8_t tail[sizeof(uint32_t)] = {0};
+
+    denv_save_put(head, name_len, 4);
+    denv_save_put(head + 4, flags, 4);
+    denv_save_put(head + 8, value_len, 8);
+
+    DenvBytes *pending = &g_denv_wal.pending;
+    size_t len = pending->len;
+
+    if (denv_bytes_append(pending, head, sizeof(head)) != 0 ||
+        denv_bytes_append(pending, name, name_len) != 0 ||
+        denv_bytes_append(pending, "", 1) != 0 ||
+        denv_bytes_append(pending, value, value_len) != 0 ||
+        denv_bytes_append(pending, tail, sizeof(tail)) != 0) {
+        fprintf(stderr, "%s: Couldn't log a write.\n", __FUNCTION__);
+        pending->len = len;
+        g_denv_wal.failed = true;
+        return;
     }
-    return result;
+
+    if (g_denv_wal.spill.is_enabled && pending->len > DENV_WAL_SPILL_SIZE)
+        denv_wal_spill(len);
 }
 
-bool denv_shmem_detach(void *attached_shmem) {
-    return (shmdt(attached_shmem) != DENV_IPC_RESULT_ERROR);
+// Size of the record at p of a write being made
+size_t denv_wal_pending_size(const uint8_t *p) {
+    return DENV_SAVE_RECORD + denv_save_get(p, 4) + 1 +
+           denv_save_get(p + 8, 8) + sizeof(uint32_t);
 }
 
-bool denv_shmem_destroy(char *filename) {
+// Writes all of data to fd, false on an error
+bool denv_wal_write(int fd, const char *data, size_t len) {
+    size_t written = 0;
+
+    while (written < len) {
+        ssize_t n = write(fd, data + written, len - written);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return false;
+        written += n;
+    }
+
+    return true;
+}
 
-    int shared_block_id = denv_get_shid(filename, 0);
+/* The records of a load are one write as big as the save, they're kept in
+   a file past DENV_WAL_SPILL_SIZE instead of memory. The first one, which
+   has the generation of the write, and the last one, which ends it, stay
+   in pending. The file is unlinked at once so a crash leaves nothing,
+   denv_wal_flush copies it to the log. If it can't be written the load
+   isn't logged at all.
+*/
+void denv_wal_spill(size_t last) {
+    DenvBytes *pending = &g_denv_wal.pending;
+    size_t first = denv_wal_pending_size((uint8_t *)pending->data);
 
-    if (shared_block_id == DENV_IPC_RESULT_ERROR) {
-        fprintf(stderr, "%s: %s at line %i\n", strerror(errno), __FUNCTION__,
-                __LINE__);
-        return false;
+    if (last <= first)
+        return;
+
+    if (g_denv_wal.spill.fd == -1) {
+        char name[DENV_WAL_ROTATED_LENGTH];
+
+        snprintf(name, sizeof(name), "%s.XXXXXX", g_denv_mapping.wal_name);
+        g_denv_wal.spill.fd = mkstemp(name);
+        if (g_denv_wal.spill.fd != -1)
+            unlink(name);
     }
-    return (shmctl(shared_block_id, IPC_RMID, NULL) != DENV_IPC_RESULT_ERROR);
+
+    if (g_denv_wal.spill.fd == -1 ||
+        !denv_wal_write(g_denv_wal.spill.fd, pending->data + first,
+                        last - first)) {
+        fprintf(stderr, "%s: Couldn't keep the records of a load next to "
+                        "\"%s\": %s.\n",
+                __FUNCTION__, g_denv_mapping.wal_name, strerror(errno));
+        pending->len = 0;
+        g_denv_wal.spill.is_dropped = true;
+        g_denv_wal.failed = true;
+        return;
+    }
+
+    g_denv_wal.spill.size += last - first;
+    memmove(pending->data + first, pending->data + last, pending->len - last);
+    pending->len -= last - first;
 }
 
-void denv_print_version(void) {
+// Ends the logging of a load, its records were flushed or dropped
+void denv_wal_spill_end(void) {
+    if (g_denv_wal.spill.fd != -1)
+        close(g_denv_wal.spill.fd);
 
-    // discriminator for compiled versions on the same day
-    int disc = denv_hash(__DATE__ __TIME__);
+    g_denv_wal.spill.fd = -1;
+    g_denv_wal.spill.size = 0;
+    g_denv_wal.spill.is_enabled = false;
+    g_denv_wal.spill.is_dropped = false;
+}
 
-    disc ^= 9733; // xor to generate a bigger number
+static const char *denv_durability_names[] = {"none", "log", "sync"};
 
-#ifdef DEBUG_ON
-    printf("denv %d.%d.%d.%04d (DEBUG)\n", DENV_VERSION_A, DENV_VERSION_B,
-           DENV_VERSION_C, disc);
-    return;
-#endif
-    printf("denv %d.%d.%d.%04d\n", DENV_VERSION_A, DENV_VERSION_B,
-           DENV_VERSION_C, disc);
+bool denv_durability_from_name(const char *name, DenvDurability *level) {
+    for (int i = DENV_DURABILITY_NONE; i <= DENV_DURABILITY_SYNC; i++) {
+        if (strcmp(name, denv_durability_names[i]) == 0) {
+            *level = i;
+            return true;
+        }
+    }
+
+    return false;
 }
 
-void denv_print_stats_csv(Table *table) {
-    Word used = table->element.used;
-    Word col_used = table->element.collision_used;
-    Word total = used + col_used;
+// Whether a write failed to be logged since the last call
+bool denv_wal_take_failure(void) {
+    bool failed = g_denv_wal.failed;
+
+    g_denv_wal.failed = false;
+    return failed;
+}
+
+// Starts a log with its header, fd must be empty
+int denv_wal_write_header(int fd, DenvDurability level) {
+    uint8_t head[DENV_WAL_HEADER];
 
-    printf("total_size_bytes,data_offset,used_hash,used_collision,used_total\n"
-           "%lu,%lu,%lu,%lu,%lu\n",
-           table->total_size, table->current_word_block_offset, used, col_used,
-           total);
+    memcpy(head, DENV_WAL_MAGIC, 8);
+    denv_save_put(head + 8, DENV_WAL_VERSION, 4);
+    denv_save_put(head + 12, level, 4);
+
+    return pwrite(fd, head, sizeof(head), 0) == sizeof(head) ? 0 : -1;
 }
 
-int denv_clear_freed(Table *table) {
-    Table *clean_table = malloc(table->total_size);
-    if (!clean_table) {
-        fprintf(stderr, "%s: Could not allocate memory to clean the table\n",
-                __FUNCTION__);
+/* Returns this process' descriptor of the current log, opened again when
+   another log was started. The first writer creates the log, it must hold
+   the lock to do it.
+*/
+int denv_wal_open(Table *table, bool create) {
+    uint32_t epoch = atomic_load(&table->wal.epoch);
+
+    if (g_denv_wal.fd != -1 && g_denv_wal.epoch == epoch)
+        return g_denv_wal.fd;
+
+    if (g_denv_wal.fd != -1)
+        close(g_denv_wal.fd);
+
+    int fd = open(g_denv_mapping.wal_name,
+                  O_WRONLY | O_APPEND | O_CLOEXEC | (create ? O_CREAT : 0),
+                  0644);
+    if (fd == -1) {
+        g_denv_wal.fd = -1;
         return -1;
     }
 
-    // Initialize the clean table with the source table attributes
-    clean_table->magic = table->magic;
-    clean_table->flags = table->flags;
-    clean_table->denv_sem = table->denv_sem;
-    clean_table->element.used = 0;
-    clean_table->element.collision_used = 0;
-    clean_table->total_size = table->total_size;
-    clean_table->current_word_block_offset = 0;
+    if (create && lseek(fd, 0, SEEK_END) == 0 &&
+        denv_wal_write_header(fd, atomic_load(&table->wal.level)) != 0) {
+        close(fd);
+        g_denv_wal.fd = -1;
+        return -1;
+    }
 
-    for (int i = 0; i < DENV_MAX_ELEMENTS; i++) {
+    g_denv_wal.fd = fd;
+    g_denv_wal.epoch = epoch;
 
-        Element *e = &table->element.array[i];
-        Element *coll_e = &table->element.collision_array[i];
+    return fd;
+}
 
-        if ((e->flags & (ELEMENT_IS_USED | ELEMENT_IS_FREED)) ==
-            ELEMENT_IS_USED) {
-            char *name = (char *)&table->block[e->data_index];
-            char *value = denv_table_get_value(table, name);
-            if (value != NULL) {
-                denv_table_set_value(clean_table, name, value, e->flags);
-            }
+// Sets the flags, generation and crc of a record of a write being made
+void denv_wal_seal(uint8_t *p, bool more, uint64_t generation) {
+    size_t len = denv_wal_pending_size(p) - sizeof(uint32_t);
+    uint32_t flags = denv_save_get(p + 4, 4);
+
+    if (more)
+        flags |= DENV_SAVE_MORE;
+
+    denv_save_put(p + 4, flags, 4);
+    denv_save_put(p + 16, generation, 8);
+    denv_save_put(p + len, denv_crc32(0, p, len), 4);
+}
+
+/* Appends the records denv_wal_spill kept apart to the log, sealed like
+   the ones of pending, a buffer of DENV_WAL_SPILL_SIZE at a time
+*/
+bool denv_wal_copy_spill(int fd, uint64_t generation) {
+    int spill = g_denv_wal.spill.fd;
+    size_t left = g_denv_wal.spill.size;
+    size_t size = DENV_WAL_SPILL_SIZE, have = 0;
+
+    if (left == 0)
+        return true;
+
+    uint8_t *buffer = lseek(spill, 0, SEEK_SET) == 0 ? malloc(size) : NULL;
+    bool ret = buffer != NULL;
+
+    while (ret && (left > 0 || have > 0)) {
+        ssize_t n = left > 0 ? read(spill, buffer + have,
+                                    size - have < left ? size - have : left)
+                             : 0;
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 || (n == 0 && left > 0)) {
+            ret = false;
+            break;
+        }
+        have += n;
+        left -= n;
+
+        size_t pos = 0, len;
+        while (have - pos >= DENV_SAVE_RECORD &&
+               (len = denv_wal_pending_size(buffer + pos)) <= have - pos) {
+            denv_wal_seal(buffer + pos, true, generation);
+            pos += len;
         }
-        if ((coll_e->flags & (ELEMENT_IS_USED | ELEMENT_IS_FREED)) ==
-            ELEMENT_IS_USED) {
-            char *name = (char *)&table->block[coll_e->data_index];
-            char *value = denv_table_get_value(table, name);
-            if (value != NULL) {
-                denv_table_set_value(clean_table, name, value, coll_e->flags);
+
+        // a record bigger than the buffer
+        if (pos == 0 && have == size) {
+            size_t need = denv_wal_pending_size(buffer);
+            uint8_t *bigger = realloc(buffer, need);
+            if (bigger == NULL) {
+                ret = false;
+                break;
             }
+            buffer = bigger;
+            size = need;
+            continue;
         }
+
+        // nothing is left to complete a torn record
+        if (pos == 0 && left == 0) {
+            ret = false;
+            break;
+        }
+
+        ret = denv_wal_write(fd, (char *)buffer, pos);
+        memmove(buffer, buffer + pos, have - pos);
+        have -= pos;
     }
 
-    memcpy(table, clean_table, table->total_size);
+    free(buffer);
+    return ret;
+}
+
+/* Appends the records of the write ending to the log, called by
+   denv_table_write_end before the lock is released. A failed append is cut
+   off the log so the records after it can still be replayed. Returns true
+   if the records were logged.
+*/
+bool denv_wal_flush(Table *table) {
+    DenvBytes *pending = &g_denv_wal.pending;
+    uint64_t generation = table->last_generation;
 
-    free(clean_table);
+    for (size_t pos = 0; pos < pending->len;) {
+        uint8_t *p = (uint8_t *)pending->data + pos;
 
-    return 0;
+        pos += denv_wal_pending_size(p);
+        denv_wal_seal(p, pos < pending->len, generation);
+    }
+
+    // the records of a load kept apart go after its first one
+    size_t first = g_denv_wal.spill.size > 0
+                       ? denv_wal_pending_size((uint8_t *)pending->data)
+                       : pending->len;
+
+    int fd = denv_wal_open(table, true);
+    off_t end = fd == -1 ? -1 : lseek(fd, 0, SEEK_END);
+
+    bool is_logged =
+        end != -1 && denv_wal_write(fd, pending->data, first) &&
+        denv_wal_copy_spill(fd, generation) &&
+        denv_wal_write(fd, pending->data + first, pending->len - first);
+    pending->len = 0;
+
+    if (!is_logged) {
+        fprintf(stderr, "%s: Couldn't write to \"%s\": %s.\n", __FUNCTION__,
+                g_denv_mapping.wal_name, strerror(errno));
+        if (end != -1 && ftruncate(fd, end) != 0)
+            perror("ftruncate");
+        g_denv_wal.failed = true;
+        return false;
+    }
+
+    atomic_store(&table->wal.appended, generation);
+    g_denv_wal.logged = generation;
+
+    return true;
 }
 
-int denv_compress(FILE *source, FILE *dest, int level) {
-    int ret, flush;
-    unsigned have;
-    z_stream strm;
-    uint8_t *in = malloc(DENV_CHUNK);
-    uint8_t *out = malloc(DENV_CHUNK);
-    if (!in || !out) {
-        fprintf(stderr, "%s: Failed to allocate buffers\n", __FUNCTION__);
+void denv_wal_advance_synced(Table *table, uint64_t generation) {
+    uint64_t synced = atomic_load(&table->wal.synced);
+
+    while (synced < generation &&
+           !atomic_compare_exchange_weak(&table->wal.synced, &synced,
+                                         generation))
+        ;
+}
+
+/* Puts the current log on disk, up to what was appended to it before.
+   Returns 1 if a new log was started meanwhile, its records may not be.
+*/
+int denv_wal_sync(Table *table) {
+    uint32_t epoch = atomic_load(&table->wal.epoch);
+    int fd = denv_wal_open(table, false);
+    uint64_t appended = atomic_load(&table->wal.appended);
+
+    if (fd == -1 || fdatasync(fd) != 0) {
+        fprintf(stderr, "%s: Couldn't sync \"%s\": %s.\n", __FUNCTION__,
+                g_denv_mapping.wal_name, strerror(errno));
         return -1;
     }
 
-    /* allocate deflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    ret = deflateInit(&strm, level);
-    if (ret != Z_OK)
-        return ret;
+    if (atomic_load(&table->wal.epoch) != epoch)
+        return 1;
 
-    /* compress until end of file */
-    do {
-        strm.avail_in = fread(in, 1, DENV_CHUNK, source);
-        if (ferror(source)) {
-            (void)deflateEnd(&strm);
-            return Z_ERRNO;
-        }
-        flush = feof(source) ? Z_FINISH : Z_NO_FLUSH;
-        strm.next_in = in;
+    denv_wal_advance_synced(table, appended);
+    return 0;
+}
 
-        /* run deflate() on input until output buffer not full, finish
-           compression if all of source has been read in */
-        do {
-            strm.avail_out = DENV_CHUNK;
-            strm.next_out = out;
-            ret = deflate(&strm, flush);   /* no bad return value */
-            assert(ret != Z_STREAM_ERROR); /* state not clobbered */
-            have = DENV_CHUNK - strm.avail_out;
-            if (fwrite(out, 1, have, dest) != have || ferror(dest)) {
-                (void)deflateEnd(&strm);
-                return Z_ERRNO;
-            }
-        } while (strm.avail_out == 0);
-        assert(strm.avail_in == 0); /* all input will be used */
+/* Waits until the log is on disk up to generation. One process at a time
+   runs fdatasync for everyone, the others sleep until it's done and usually
+   find their writes synced with it, concurrent durable writes share fsyncs.
+   A syncer that died is replaced.
+*/
+int denv_wal_commit(Table *table, uint64_t generation) {
+    pid_t pid = getpid();
 
-        /* done when last data in file processed */
-    } while (flush != Z_FINISH);
-    assert(ret == Z_STREAM_END); /* stream will be complete */
+    for (;;) {
+        if (table->flags & TABLE_IS_MOVED)
+            denv_table_remap(table);
 
-    /* clean up and return */
-    (void)deflateEnd(&strm);
+        if (atomic_load(&table->wal.synced) >= generation)
+            return 0;
 
-    free(in);
-    free(out);
+        uint32_t commits = atomic_load(&table->wal.commits);
+        pid_t syncer = 0;
 
-    return Z_OK;
+        if (atomic_compare_exchange_strong(&table->wal.syncer, &syncer, pid)) {
+            int ret = denv_wal_sync(table);
+
+            atomic_store(&table->wal.syncer, 0);
+            atomic_fetch_add(&table->wal.commits, 1);
+#ifdef __linux__
+            syscall(SYS_futex, (uint32_t *)&table->wal.commits, FUTEX_WAKE,
+                    INT32_MAX, NULL, NULL, 0);
+#endif
+            if (ret == -1) {
+                g_denv_wal.failed = true;
+                return -1;
+            }
+            continue;
+        }
+
+        if (kill(syncer, 0) == -1 && errno == ESRCH) {
+            atomic_compare_exchange_strong(&table->wal.syncer, &syncer, 0);
+            continue;
+        }
+
+        struct timespec ts = {.tv_sec = 0, .tv_nsec = DENV_WAL_COMMIT_WAIT};
+#ifdef __linux__
+        syscall(SYS_futex, (uint32_t *)&table->wal.commits, FUTEX_WAIT,
+                commits, &ts, NULL, 0);
+#else
+        if (atomic_load(&table->wal.commits) == commits)
+            nanosleep(&ts, NULL);
+#endif
+    }
 }
 
-int denv_decompress(FILE *source, FILE *dest) {
-    int ret;
-    unsigned have;
-    z_stream strm;
-    uint8_t *in = malloc(DENV_CHUNK);
-    uint8_t *out = malloc(DENV_CHUNK);
-    if (!in || !out) {
-        fprintf(stderr, "%s: Failed to allocate buffers\n", __FUNCTION__);
+// Level in the header of a log, -1 if there is no log or it isn't one
+int denv_wal_read_level(const char *path) {
+    uint8_t head[DENV_WAL_HEADER];
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
         return -1;
-    }
 
-    /* allocate inflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;
-    strm.next_in = Z_NULL;
-    ret = inflateInit(&strm);
-    if (ret != Z_OK)
-        return ret;
+    ssize_t n = pread(fd, head, sizeof(head), 0);
+    close(fd);
 
-    /* decompress until deflate stream ends or end of file */
-    do {
-        strm.avail_in = fread(in, 1, DENV_CHUNK, source);
-        if (ferror(source)) {
-            (void)inflateEnd(&strm);
-            return Z_ERRNO;
+    if (n != sizeof(head) || memcmp(head, DENV_WAL_MAGIC, 8) != 0 ||
+        denv_save_get(head + 8, 4) != DENV_WAL_VERSION)
+        return -1;
+
+    uint32_t level = denv_save_get(head + 12, 4);
+    return level <= DENV_DURABILITY_SYNC ? (int)level : -1;
+}
+
+/* Sets the level of every process using the table and keeps it in the log,
+   creating it if it has to log
+*/
+int denv_table_set_durability(Table *table, DenvDurability level) {
+    assert(table != NULL && level <= DENV_DURABILITY_SYNC);
+
+    char *path = g_denv_mapping.wal_name;
+    int ret = 0;
+
+    denv_table_write_begin(table);
+
+    int fd = open(path, O_RDWR | O_CLOEXEC |
+                            (level != DENV_DURABILITY_NONE ? O_CREAT : 0),
+                  0644);
+
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "%s: Couldn't open \"%s\": %s.\n", __FUNCTION__,
+                    path, strerror(errno));
+            ret = -1;
+        }
+    } else {
+        uint8_t field[sizeof(uint32_t)];
+        denv_save_put(field, level, 4);
+
+        bool is_new = lseek(fd, 0, SEEK_END) == 0;
+        if (is_new ? denv_wal_write_header(fd, level) != 0
+                   : denv_wal_read_level(path) == -1 ||
+                         pwrite(fd, field, sizeof(field), 12) !=
+                             sizeof(field)) {
+            fprintf(stderr, "%s: \"%s\" isn't a denv log.\n", __FUNCTION__,
+                    path);
+            ret = -1;
+        } else if (fdatasync(fd) != 0 || (is_new && denv_sync_dir(path))) {
+            perror("fsync");
+            ret = -1;
         }
-        if (strm.avail_in == 0)
-            break;
-        strm.next_in = in;
 
-        /* run inflate() on input until output buffer not full */
-        do {
-            strm.avail_out = DENV_CHUNK;
-            strm.next_out = out;
-            ret = inflate(&strm, Z_NO_FLUSH);
-            assert(ret != Z_STREAM_ERROR); /* state not clobbered */
-            switch (ret) {
-            case Z_NEED_DICT:
-                ret = Z_DATA_ERROR; /* and fall through */
-            case Z_DATA_ERROR:
-            case Z_MEM_ERROR:
-                (void)inflateEnd(&strm);
-                return ret;
-            }
-            have = DENV_CHUNK - strm.avail_out;
-            if (fwrite(out, 1, have, dest) != have || ferror(dest)) {
-                (void)inflateEnd(&strm);
-                return Z_ERRNO;
-            }
-        } while (strm.avail_out == 0);
+        close(fd);
+    }
 
-        /* done when inflate() says it's done */
-    } while (ret != Z_STREAM_END);
+    if (ret == 0)
+        atomic_store(&table->wal.level, level);
+
+    denv_table_write_end(table);
+
+    return ret;
+}
+
+// Length of the whole record at p, 0 if it's cut or damaged
+size_t denv_wal_record_size(const uint8_t *p, size_t size) {
+    if (size < DENV_SAVE_RECORD + sizeof(uint32_t))
+        return 0;
+
+    uint64_t name_len = denv_save_get(p, 4);
+    uint64_t value_len = denv_save_get(p + 8, 8);
+
+    // bounded by the size first so the sum can't overflow
+    if (name_len > size || value_len > size)
+        return 0;
+
+    size_t len = DENV_SAVE_RECORD + name_len + 1 + value_len;
+    if (size < len + sizeof(uint32_t) || p[DENV_SAVE_RECORD + name_len] != 0 ||
+        denv_crc32(0, p, len) != denv_save_get(p + len, 4))
+        return 0;
+
+    return len + sizeof(uint32_t);
+}
+
+// Applies a group of records, nothing else is logged meanwhile
+int denv_wal_apply(Table *table, const uint8_t *p, const uint8_t *end) {
+    int ret = 0;
+
+    // a clear rewrites the block
+    denv_table_write_begin_unpinned(table);
+    denv_table_follow_generation(table, denv_save_get(p + 16, 8));
+
+    while (p < end && ret == 0) {
+        size_t name_len = denv_save_get(p, 4);
+        uint32_t flags = denv_save_get(p + 4, 4);
+        size_t value_len = denv_save_get(p + 8, 8);
+        char *name = (char *)p + DENV_SAVE_RECORD;
+        char *value = name + name_len + 1;
+
+        p += DENV_SAVE_RECORD + name_len + 1 + value_len + sizeof(uint32_t);
+
+        if (flags & DENV_SAVE_CLEAR)
+            denv_table_clear(table);
+        else if (flags & DENV_SAVE_REMOVED)
+            _denv_table_delete_value(table, name);
+        else
+            ret = _denv_table_set_value(table, name, value, value_len,
+                                        (flags & DENV_SAVE_ENV) ? ELEMENT_IS_ENV
+                                                                : 0);
+    }
+
+    denv_table_write_end(table);
+
+    return ret;
+}
+
+/* Applies the groups of a log newer than since in the order they were
+   written. The log ends before the first group that isn't whole, the torn
+   tail left by a crash is cut off so new records follow the last good one.
+   Returns the number of groups applied, -1 if the log can't be replayed.
+*/
+long denv_wal_replay(Table *table, const char *path, uint64_t since) {
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    struct stat st;
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "%s: Couldn't open \"%s\": %s.\n", __FUNCTION__, path,
+                strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    size_t size = st.st_size;
+
+    // a crash while the log was created, it starts over
+    if (size < DENV_WAL_HEADER) {
+        int ret = ftruncate(fd, 0);
+        close(fd);
+        return ret == 0 ? 0 : -1;
+    }
+
+    uint8_t *log = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (log == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return -1;
+    }
 
-    /* clean up and return */
-    (void)inflateEnd(&strm);
+    long groups = 0;
+    size_t group = DENV_WAL_HEADER;
+    size_t pos = group;
 
-    free(in);
-    free(out);
+    if (memcmp(log, DENV_WAL_MAGIC, 8) != 0 ||
+        denv_save_get(log + 8, 4) != DENV_WAL_VERSION) {
+        fprintf(stderr, "%s: \"%s\" isn't a compatible denv log.\n",
+                __FUNCTION__, path);
+        groups = -1;
+    }
 
-    return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
-}
+    g_denv_wal.paused++;
 
-int denv_save_to_file(Table *table, char *pathname) {
-    assert(table && pathname);
+    while (groups != -1) {
+        size_t len = denv_wal_record_size(log + pos, size - pos);
+        if (len == 0)
+            break;
 
-    sem_post(&table->denv_sem); // must do this to avoid blocking the table!!
+        uint32_t flags = denv_save_get(log + pos + 4, 4);
+        pos += len;
 
-    FILE *table_file = fmemopen(table, table->total_size, "r");
-    if (ferror(table_file)) {
-        perror("fmemopen");
-        return -1;
-    }
+        if (flags & DENV_SAVE_MORE)
+            continue;
 
-    FILE *dst_file = fopen(pathname, "w");
-    if (ferror(dst_file)) {
-        perror("fopen");
-        return -1;
+        if (denv_save_get(log + group + 16, 8) > since) {
+            if (denv_wal_apply(table, log + group, log + pos) != 0) {
+                fprintf(stderr, "%s: Not enough memory to replay \"%s\".\n",
+                        __FUNCTION__, path);
+                groups = -1;
+                break;
+            }
+            groups++;
+        }
+        group = pos;
     }
 
-    int ret = denv_compress(table_file, dst_file, DENV_COMPRESSION_LEVEL);
-    if (ret != Z_OK) {
-        fprintf(stderr, "%s: Failed to compress table.\n", __FUNCTION__);
+    g_denv_wal.paused--;
+
+    if (groups != -1 && group < size) {
+        fprintf(stderr, "%s: Cut %zu bytes of a write that didn't finish "
+                        "from \"%s\".\n",
+                __FUNCTION__, size - group, path);
+        if (ftruncate(fd, group) != 0 || fsync(fd) != 0)
+            perror("ftruncate");
     }
-    fclose(table_file);
-    fclose(dst_file);
 
-    if (ret != Z_OK)
-        return -1;
+    munmap(log, size);
+    close(fd);
 
-    return 0;
+    return groups;
 }
 
-Table *denv_load_from_file(Table *table, char *pathname) {
-    assert(table && pathname);
+// Name of the log before the current one until saves have its writes
+void denv_wal_rotated_name(char name[DENV_WAL_ROTATED_LENGTH]) {
+    snprintf(name, DENV_WAL_ROTATED_LENGTH, "%s.old", g_denv_mapping.wal_name);
+}
 
-    FILE *table_file = fmemopen(table, table->total_size, "w");
-    if (ferror(table_file)) {
-        perror("fmemopen");
-        return NULL;
-    }
+/* Starts a new log, the current one is synced and renamed to .old where it
+   stays until saves have every write in it, table->wal.rotated_generation.
+   Writers follow the epoch to the new log.
+*/
+int denv_wal_rotate(Table *table) {
+    char *path = g_denv_mapping.wal_name;
+    char old_path[DENV_WAL_ROTATED_LENGTH];
+    int ret = -1;
 
-    FILE *src_file = fopen(pathname, "r");
-    if (!src_file) {
-        perror("fopen");
-        fclose(table_file);
+    denv_wal_rotated_name(old_path);
 
-        sem_post(&table->denv_sem); // must do this to avoid blocking the table
+    denv_table_write_begin(table);
 
-        return NULL;
-    }
+    int fd = denv_wal_open(table, false);
 
-    int ret = denv_decompress(src_file, table_file);
-    if (ret != Z_OK) {
-        fprintf(stderr, "%s: Failed to decompress table.\n", __FUNCTION__);
+    if (fd != -1 && fdatasync(fd) == 0 && rename(path, old_path) == 0) {
+        int new_fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
 
-        fclose(table_file);
-        fclose(src_file);
-        return NULL;
+        if (new_fd != -1) {
+            if (denv_wal_write_header(new_fd,
+                                      atomic_load(&table->wal.level)) == 0 &&
+                fdatasync(new_fd) == 0)
+                ret = 0;
+            close(new_fd);
+        }
+
+        if (denv_sync_dir(path) != 0)
+            ret = -1;
+
+        // the rename is done, writers have to move on either way
+        table->wal.rotated_generation = table->last_generation;
+        denv_wal_advance_synced(table, atomic_load(&table->wal.appended));
+        atomic_fetch_add(&table->wal.epoch, 1);
     }
 
-    fclose(table_file);
-    fclose(src_file);
-    return table;
+    if (ret != 0)
+        fprintf(stderr, "%s: Couldn't start a new log at \"%s\": %s.\n",
+                __FUNCTION__, path, strerror(errno));
+
+    denv_table_write_end(table);
+
+    return ret;
 }
 
-int denv_exec(Table *table, char *program_path, char **argv) {
-    assert(table != NULL && program_path != NULL);
+// Removes the old log once saves have every write in it
+void denv_wal_drop_rotated(Table *table) {
+    char old_path[DENV_WAL_ROTATED_LENGTH];
 
-    sem_wait(&table->denv_sem);
+    denv_wal_rotated_name(old_path);
+    if (unlink(old_path) != 0 && errno != ENOENT)
+        perror("unlink");
 
-    for (int i = 0; i < DENV_MAX_ELEMENTS; i++) {
-        Element *e = &table->element.array[i];
-        Element *coll_e = &table->element.collision_array[i];
+    table->wal.rotated_generation = 0;
+}
 
-        if ((e->flags &
-             (ELEMENT_IS_USED | ELEMENT_IS_FREED | ELEMENT_IS_ENV)) ==
-            (ELEMENT_IS_USED | ELEMENT_IS_ENV)) {
-            char *name = (char *)&table->block[e->data_index];
-            char *value = _denv_table_get_value(table, name);
+int denv_exec(Table *table, char *program_path, char **argv) {
+    assert(table != NULL && program_path != NULL);
 
-            if (name[0] && value) {
-                if (setenv(name, value, 1) != 0) {
-                    perror("setenv");
-                    return -1;
-                }
-            }
-        }
+    size_t env_size = 0;
+    char *env = denv_table_snapshot_env(table, &env_size);
+    if (env == NULL)
+        return -1;
 
-        if ((coll_e->flags &
-             (ELEMENT_IS_USED | ELEMENT_IS_FREED | ELEMENT_IS_ENV)) ==
-            (ELEMENT_IS_USED | ELEMENT_IS_ENV)) {
-            char *name = (char *)&table->block[coll_e->data_index];
-            char *value = _denv_table_get_value(table, name);
+    for (char *name = env; name < env + env_size;) {
+        char *value = name + strlen(name) + 1;
 
-            if (name[0] && value) {
-                if (setenv(name, value, 1) != 0) {
-                    perror("setenv");
-                    return -1;
-                }
-            }
+        if (setenv(name, value, 1) != 0) {
+            perror("setenv");
+            free(env);
+            return -1;
         }
+
+        name = value + strlen(value) + 1;
     }
 
-    sem_post(&table->denv_sem);
+    free(env);
 
     if (execvp(program_path, argv) == -1) {
         perror("execvp");
@@ -922,32 +5267,11 @@ int denv_exec(Table *table, char *program_path, char **argv) {
 
 int denv_clone_env(Table *table, char **envp) {
     assert(envp && envp[0]);
-    // calculate env size
-    size_t env_size = 0;
-    size_t env_lines = 0;
-
-    Word used = table->element.used;
-    Word col_used = table->element.collision_used;
-
-    for (int i = 0; envp[i]; i++) {
-        env_size += strlen(envp[i]);
-        env_lines++;
-    }
-
-    if (env_lines > ((2 * DENV_MAX_ELEMENTS) - (used + col_used))) {
-        fprintf(stderr, "Not enough space to store environment variables.\n");
-        return -1;
-    }
-
-    if (env_size > ((DENV_BLOCK_SIZE - table->current_word_block_offset) *
-                    (sizeof(Word)))) {
-        fprintf(stderr, "Not enough space to store environment variables.\n");
-        return -1;
-    }
 
     char *name = NULL;
     char *value = NULL;
 
+    // the table grows as needed, it only fails at DENV_MAX_TABLE_SIZE
     for (int i = 0; envp[i]; i++) {
         name = &envp[i][0];
         for (size_t j = 0; j <= strlen(envp[i]); j++) {
@@ -955,7 +5279,12 @@ int denv_clone_env(Table *table, char **envp) {
                 envp[i][j] = '\0';
                 if (envp[i][j + 1]) {
                     value = &envp[i][j + 1];
-                    denv_table_set_value(table, name, value, ELEMENT_IS_ENV);
+                    if (denv_table_set_value(table, name, value,
+                                             ELEMENT_IS_ENV) != 0) {
+                        fprintf(stderr, "Not enough space to store "
+                                        "environment variables.\n");
+                        return -1;
+                    }
                 }
                 break;
             }
@@ -968,32 +5297,20 @@ void denv_make_env_save_file(Table *table, FILE *file) {
 
     assert((table != NULL) && (file != NULL));
 
-    for (int i = 0; i < DENV_MAX_ELEMENTS; i++) {
-        Element *e = &table->element.array[i];
-        Element *coll_e = &table->element.collision_array[i];
-
-        if ((e->flags &
-             (ELEMENT_IS_USED | ELEMENT_IS_FREED | ELEMENT_IS_ENV)) ==
-            (ELEMENT_IS_USED | ELEMENT_IS_ENV)) {
-            char *name = (char *)&table->block[e->data_index];
-            char *value = denv_table_get_value(table, name);
+    size_t env_size = 0;
+    char *env = denv_table_snapshot_env(table, &env_size);
+    if (env == NULL)
+        return;
 
-            if (name[0] && value) {
-                fprintf(file, "export %s=%s\n", name, value);
-            }
-        }
+    for (char *name = env; name < env + env_size;) {
+        char *value = name + strlen(name) + 1;
 
-        if ((coll_e->flags &
-             (ELEMENT_IS_USED | ELEMENT_IS_FREED | ELEMENT_IS_ENV)) ==
-            (ELEMENT_IS_USED | ELEMENT_IS_ENV)) {
-            char *name = (char *)&table->block[coll_e->data_index];
-            char *value = denv_table_get_value(table, name);
+        fprintf(file, "export %s=%s\n", name, value);
 
-            if (name[0] && value) {
-                fprintf(file, "export %s=%s\n", name, value);
-            }
-        }
+        name = value + strlen(value) + 1;
     }
+
+    free(env);
 }
 
 // String Pools
@@ -1118,4 +5435,475 @@ int denv_mkdir_parents(char *path_buff, size_t size) {
     return 0;  
 }
 
-#endif /* _DENV_H */
+// Makes room for more bytes after len, doubling the capacity
+int denv_bytes_reserve(DenvBytes *b, size_t more) {
+    if (b->len + more <= b->capacity)
+        return 0;
+
+    size_t capacity = b->capacity ? b->capacity : 4096;
+    while (capacity < b->len + more)
+        capacity *= 2;
+
+    char *new_data = realloc(b->data, capacity);
+    if (new_data == NULL) {
+        fprintf(stderr, "%s: Couldn't allocate more memory.\n", __FUNCTION__);
+        return -1;
+    }
+    b->data = new_data;
+    b->capacity = capacity;
+
+    return 0;
+}
+
+int denv_bytes_append(DenvBytes *b, const void *data, size_t len) {
+    if (denv_bytes_reserve(b, len) != 0)
+        return -1;
+
+    if (len > 0)
+        memcpy(b->data + b->len, data, len);
+    b->len += len;
+
+    return 0;
+}
+
+// Drops the first len bytes
+void denv_bytes_consume(DenvBytes *b, size_t len) {
+    if (len == 0)
+        return;
+
+    memmove(b->data, b->data + len, b->len - len);
+    b->len -= len;
+}
+
+void denv_bytes_free(DenvBytes *b) {
+    free(b->data);
+    *b = (DenvBytes){0};
+}
+
+// Queues a request, the caller fills op, flags, since and value_len
+int denv_request_push(DenvBytes *out, DenvRequest req, char *name,
+                      char *separator, char *value) {
+    req.name_len = strlen(name);
+    req.separator_len = separator ? strlen(separator) : 0;
+
+    if (denv_bytes_append(out, &req, sizeof(req)) != 0 ||
+        denv_bytes_append(out, name, req.name_len + 1) != 0 ||
+        denv_bytes_append(out, separator ? separator : "",
+                          req.separator_len + 1) != 0 ||
+        denv_bytes_append(out, value, req.value_len) != 0)
+        return -1;
+
+    return 0;
+}
+
+/* Parses the request at the start of data, returns its length, 0 if it
+   isn't all there yet or -1 if it's malformed. Names are cut in place.
+*/
+ssize_t denv_request_parse(char *data, size_t len, DenvRequest *req,
+                           char **name, char **separator, char **value) {
+    if (len < sizeof(DenvRequest))
+        return 0;
+
+    memcpy(req, data, sizeof(DenvRequest));
+
+    if (req->value_len > DENV_MAX_TABLE_SIZE)
+        return -1;
+
+    size_t frame_len = sizeof(DenvRequest) + req->name_len + 1 +
+                       req->separator_len + 1 + req->value_len;
+    if (len < frame_len)
+        return 0;
+
+    *name = data + sizeof(DenvRequest);
+    *separator = *name + req->name_len + 1;
+    *value = *separator + req->separator_len + 1;
+
+    (*name)[req->name_len] = '\0';
+    (*separator)[req->separator_len] = '\0';
+
+    return frame_len;
+}
+
+int denv_response_push(DenvBytes *out, DenvResponse resp, char *data) {
+    if (denv_bytes_append(out, &resp, sizeof(resp)) != 0 ||
+        denv_bytes_append(out, data, resp.len) != 0)
+        return -1;
+
+    return 0;
+}
+
+int denv_client_connect(DenvClient *c, char *socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    *c = (DenvClient){.fd = -1};
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, socket_path);
+
+    c->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (c->fd == -1)
+        return -1;
+
+    if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+void denv_client_close(DenvClient *c) {
+    if (c->fd != -1)
+        close(c->fd);
+    denv_bytes_free(&c->out);
+    denv_bytes_free(&c->in);
+    c->fd = -1;
+}
+
+// Queues a request, it's sent along with the others by the next flush
+int denv_client_request(DenvClient *c, DenvRequest req, char *name,
+                        char *separator, char *value) {
+    return denv_request_push(&c->out, req, name, separator, value);
+}
+
+int denv_client_flush(DenvClient *c) {
+    size_t sent = 0;
+
+    while (sent < c->out.len) {
+        ssize_t n = send(c->fd, c->out.data + sent, c->out.len - sent,
+                         MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        sent += n;
+    }
+
+    c->out.len = 0;
+    return 0;
+}
+
+/* Reads the response to the oldest request, flushing queued ones first. Its
+   data stays valid until the next call.
+*/
+int denv_client_response(DenvClient *c, DenvResponse *resp, char **data) {
+    if (c->out.len > 0 && denv_client_flush(c) != 0)
+        return -1;
+
+    // the last response was handed out, its space can go
+    denv_bytes_consume(&c->in, c->in_pos);
+    c->in_pos = 0;
+
+    for (;;) {
+        size_t want = 4096;
+
+        if (c->in.len >= sizeof(DenvResponse)) {
+            memcpy(resp, c->in.data, sizeof(DenvResponse));
+
+            size_t frame_len = sizeof(DenvResponse) + resp->len;
+            if (c->in.len >= frame_len) {
+                *data = c->in.data + sizeof(DenvResponse);
+                c->in_pos = frame_len;
+                return 0;
+            }
+
+            // big values are read straight into place
+            if (frame_len - c->in.len > want)
+                want = frame_len - c->in.len;
+        }
+
+        if (denv_bytes_reserve(&c->in, want) != 0)
+            return -1;
+
+        ssize_t n = recv(c->fd, c->in.data + c->in.len,
+                         c->in.capacity - c->in.len, 0);
+        if (n == 0)
+            return -1;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        c->in.len += n;
+    }
+}
+
+DenvTable *denv_attach(const char *path) {
+    return denv_attach_with(path, NULL);
+}
+
+DenvTable *denv_attach_with(const char *path, const DenvShmOptions *options) {
+    // the mapping and the log are per process, see the API above
+    if (g_denv_mapping.table != NULL) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    Table *table = denv_shmem_attach(
+        (char *)path,
+        denv_table_size(DENV_INITIAL_ELEMENTS, DENV_INITIAL_BLOCK_SIZE),
+        options);
+
+    if (table == NULL)
+        return NULL;
+
+    if ((table->flags & TABLE_IS_INITIALIZED) == 0) {
+        if (sem_init(&table->denv_sem, 1, 1) < 0) {
+            perror("sem_init");
+            denv_shmem_detach(table);
+            return NULL;
+        }
+        denv_table_init(table, DENV_INITIAL_ELEMENTS, DENV_INITIAL_BLOCK_SIZE);
+    }
+
+    return table;
+}
+
+void denv_detach(DenvTable *table) {
+    // the next table's log is opened by its first logged write
+    if (g_denv_wal.fd != -1)
+        close(g_denv_wal.fd);
+    g_denv_wal.fd = -1;
+    g_denv_wal.pending.len = 0;
+    g_denv_wal.failed = false;
+    denv_wal_spill_end();
+
+    denv_shmem_detach(table);
+}
+
+int denv_sync(DenvTable *table) {
+    return denv_table_sync(table, true) == 0 ? 0 : -1;
+}
+
+ssize_t denv_get(DenvTable *table, const char *name, void *buf, size_t size) {
+    assert(table != NULL && name != NULL && (buf != NULL || size == 0));
+
+    ssize_t ret;
+    Word seq;
+
+    do {
+        seq = denv_table_read_begin(table);
+        ret = -1;
+
+        Element *e = denv_table_get_element(table, (char *)name);
+        char *e_name, *value;
+        size_t name_len, len;
+
+        if (e == NULL ||
+            !denv_table_read_element(table, e, &e_name, &name_len, &value,
+                                     &len))
+            continue;
+
+        memcpy(buf, value, len < size ? len : size);
+        if (len < size)
+            ((char *)buf)[len] = '\0';
+        ret = len;
+    } while (denv_table_read_retry(table, seq));
+
+    return ret;
+}
+
+int denv_view(DenvTable *table, const char *name, DenvView *view) {
+    assert(table != NULL && name != NULL && view != NULL);
+
+    int ret;
+    Word seq;
+
+    // a torn view is no use to anyone, take a consistent one
+    do {
+        seq = denv_table_read_begin(table);
+        ret = -1;
+
+        Element *e = denv_table_get_element(table, (char *)name);
+        char *e_name, *value;
+        size_t name_len, len;
+
+        if (e == NULL ||
+            !denv_table_read_element(table, e, &e_name, &name_len, &value,
+                                     &len))
+            continue;
+
+        *view = (DenvView){value, len, seq, -1, 0};
+        ret = 0;
+    } while (denv_table_read_retry(table, seq));
+
+    return ret;
+}
+
+bool denv_view_is_valid(DenvTable *table, const DenvView *view) {
+    return view->pin >= 0 || !denv_table_read_retry(table, view->version);
+}
+
+int denv_view_pin(DenvTable *table, const char *name, DenvView *view) {
+    assert(table != NULL && name != NULL && view != NULL);
+
+    int ret = -1;
+
+    // no writer runs while the pin is taken, no need to retry
+    denv_table_lock(table);
+
+    Element *e = denv_table_get_element(table, (char *)name);
+    char *e_name, *value;
+    size_t name_len, len;
+
+    if (e != NULL && denv_table_read_element(table, e, &e_name, &name_len,
+                                             &value, &len)) {
+        int pin = denv_table_pin_slice(table, e->data_index);
+        Word seq = atomic_load(&table->seq);
+
+        *view = (DenvView){value, len, seq, pin, g_denv_mapping.moves};
+        ret = pin == -1 ? 1 : 0;
+    }
+
+    denv_table_unlock(table);
+
+    return ret;
+}
+
+void denv_view_release(DenvTable *table, DenvView *view) {
+    assert(table != NULL && view != NULL);
+
+    // pins of a table that moved went away with it
+    if (view->pin >= 0 && view->segment == g_denv_mapping.moves) {
+        atomic_store_explicit(&table->pins.slot[view->pin].pid, 0,
+                              memory_order_release);
+        atomic_fetch_sub(&table->pins.held, 1);
+    }
+
+    view->pin = -1;
+}
+
+// A write that couldn't be logged is in the table but fails
+int denv_set(DenvTable *table, const char *name, const void *value,
+             size_t len, bool is_env) {
+    int ret = denv_table_set_value_n(table, (char *)name, (char *)value, len,
+                                     is_env ? ELEMENT_IS_ENV : 0);
+
+    return denv_wal_take_failure() ? -1 : ret;
+}
+
+int denv_append(DenvTable *table, const char *name, const char *separator,
+                const void *data, size_t len) {
+    int ret = denv_table_append_value(table, (char *)name,
+                                      separator ? (char *)separator : "",
+                                      (char *)data, len);
+
+    return denv_wal_take_failure() ? -1 : ret;
+}
+
+void denv_delete(DenvTable *table, const char *name) {
+    denv_table_delete_value(table, (char *)name);
+}
+
+int denv_iterate_match(DenvTable *table, const char *pattern,
+                       DenvIterator fn, void *arg) {
+    size_t size = 0;
+    char *copy = denv_table_copy_list(table, pattern, DENV_LIST_RECORDS, &size);
+    if (copy == NULL)
+        return -1;
+
+    int ret = 0;
+
+    for (size_t offset = 0; offset < size && ret == 0;) {
+        Word header[3];
+        memcpy(header, copy + offset, sizeof(header));
+
+        char *name = copy + offset + sizeof(header);
+        char *value = name + header[1] + 1;
+
+        ret = fn(name, value, header[2], header[0] & ELEMENT_IS_ENV, arg);
+        offset += sizeof(header) + header[1] + header[2] + 2;
+    }
+
+    free(copy);
+    return ret;
+}
+
+int denv_iterate(DenvTable *table, DenvIterator fn, void *arg) {
+    return denv_iterate_match(table, "", fn, arg);
+}
+
+uint64_t denv_generation(DenvTable *table, const char *name) {
+    return denv_table_get_generation(table, (char *)name);
+}
+
+int denv_await(DenvTable *table, const char *name, uint64_t since,
+               int timeout_ms, uint64_t *generation) {
+    assert(table != NULL && name != NULL);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+
+    uint32_t wake = atomic_load(&table->wake);
+    uint64_t current = denv_table_get_generation(table, (char *)name);
+
+    while (current <= since) {
+        struct timespec left, *timeout = NULL;
+
+        if (timeout_ms >= 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+
+            long long ns = (deadline.tv_sec - now.tv_sec) * 1000000000LL +
+                           (deadline.tv_nsec - now.tv_nsec);
+            if (ns <= 0)
+                return 1;
+
+            left = (struct timespec){ns / 1000000000, ns % 1000000000};
+            timeout = &left;
+        }
+
+        denv_table_wait(table, wake, timeout);
+        wake = atomic_load(&table->wake);
+        current = denv_table_get_generation(table, (char *)name);
+    }
+
+    if (generation != NULL)
+        *generation = current;
+
+    return 0;
+}
+
+void denv_stats(DenvTable *table, DenvStats *stats) {
+    Word seq;
+
+    do {
+        seq = denv_table_read_begin(table);
+
+        stats->total_size = table->total_size;
+        stats->data_offset = table->current_word_block_offset;
+        stats->used = table->element.used;
+        stats->removed = table->element.removed;
+        stats->max_elements = table->max_elements;
+        stats->block_size = table->block_size;
+        stats->free_words = table->free_list.words;
+        stats->free_slices = table->free_list.slices;
+        stats->fragmentation = denv_table_fragmentation(table);
+    } while (denv_table_read_retry(table, seq));
+
+    stats->saved_bytes = denv_table_saved_bytes(table);
+}
+
+int denv_set_durability(DenvTable *table, DenvDurability level) {
+    if (level > DENV_DURABILITY_SYNC)
+        return -1;
+
+    return denv_table_set_durability(table, level);
+}
+
+DenvDurability denv_durability(DenvTable *table) {
+    return atomic_load(&table->wal.level);
+}
+
+int denv_commit(DenvTable *table) {
+    int ret = denv_wal_commit(table, g_denv_wal.logged);
+
+    return denv_wal_take_failure() ? -1 : ret;
+}
+
+#endif /* _DENV_IMPLEMENTATION */
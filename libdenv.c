@@ -0,0 +1,7 @@
+/*
+        LIBDENV
+        LICENSE: GPLv3
+*/
+
+#define DENV_IMPLEMENTATION
+#include "denv.h"
@@ -3,12 +3,17 @@
         LICENSE: GPLv3
 */
 
+#define DENV_IMPLEMENTATION
 #include "denv.h"
 #include <ctype.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <syslog.h>
@@ -17,12 +22,18 @@
 
 #define DENV_BIND_PATH ("/.local/share/denv")
 #define DENV_SAVE_PATH ("/save.denv")
+#define DENV_SOCKET_PATH ("/denv.sock")
 #define ARRLEN(X) (sizeof(X) / sizeof((X)[0]))
 #define BUFF_SIZE (1024)
-#define STDIN_VAR_BUFFER_LENGTH (4096)
+#define STDIN_VAR_BUFFER_LENGTH (1 << 16)
 #define PATH_BUFFER_LENGHT (4096)
-#define POLLING_MILLISECONDS (1000000)
-#define POLLING_INTERVAL (100 * POLLING_MILLISECONDS)
+#define DAEMON_INTERVAL (1) // seconds between fragmentation checks and saves
+#define DAEMON_FOLD_RATIO (4) // a delta this part of the snapshot is folded
+#define DAEMON_WAL_LIMIT (1 << 22) // log size a new log is started at, 4MiB
+#define DAEMON_SAVE_RETRY (10) // seconds before a failed save is tried again
+#define BATCH_LOCK_OPS (512) // batch writes applied per write lock hold
+#define DAEMON_OUT_LIMIT (1 << 20) // stop answering a client that doesn't read
+#define GET_PIN_BYTES (1 << 16) // values written out of the table in place
 
 char *strncat_s(char *restrict dst, const char *src, size_t size) {
     size_t len = size - strlen(dst) - 1;
@@ -63,7 +74,10 @@ typedef enum {
     CLONE,
     EXPORT,
     DAEMON,
-    APPEND
+    APPEND,
+    BATCH,
+    TX,
+    WAL
 } command_states;
 
 typedef enum {
@@ -81,16 +95,19 @@ static const struct {
     {"-h", NULL, HELP},       {"-v", NULL, VERSION},
     {"--help", NULL, HELP},   {"--version", NULL, VERSION},
     {"help", NULL, HELP},     {"version", NULL, VERSION},
-    {"set", "eb:", SET},      {"get", "b:", GET},
+    {"set", "eb:", SET},      {"get", "rb:", GET},
     {"rm", "b:", REMOVE},  // *
     {"drop", "fb:", DROP}, // *
     {"ls", "xb:", LIST},   // *
     {"stats", "b:", STATS},   {"cleanup", "b:", CLEANUP},
     {"save", "b:", SAVE},     {"load", "fb:", LOAD},
-    {"await", "b:", AWAIT},   {"exec", "b:", EXEC},
+    {"await", "bS:", AWAIT},   {"exec", "b:", EXEC},
     {"clone", "b:", CLONE},   {"export", "b:", EXPORT},
     {"daemon", "b:", DAEMON},
-    {"ap", "s:", APPEND}
+    {"ap", "s:", APPEND},
+    {"batch", "0b:", BATCH},
+    {"tx", "0b:", TX},
+    {"wal", "b:", WAL}
 };
 
 void print_help(void) {
@@ -100,18 +117,25 @@ void print_help(void) {
         "\t-v / --version / version       Display current version.\n"
         "\tset [-b/-e] <key> <value>      Sets the key with the value "
         "provided.\n"
-        "\tget [-b] <key>                 Gets the value stored in the key.\n"
+        "\tget [-r/-b] <key>              Gets the value stored in the key.\n"
+        "\tget --prefix [-b] <pattern>    Prints key=value for every key starting "
+        "with or\n"
+        "\t                               matching the pattern, in order.\n"
         "\trm [-b] <key>                  Removes the key and value pair.\n"
-        "\tls [-x/-b]                     Lists all keys.\n"
+        "\tls [-x/-b] [pattern]           Lists the keys in order, only those "
+        "starting with\n"
+        "\t                               or matching the pattern as a glob.\n"
         "\tap [-s]                        Append data to a variable value.\n"
         "\tdrop [-f/-b]                   Deletes everything in the attached "
         "shmem.\n"
         "\tstats [-b] / --<format>        Print stats.\n"
         "\tcleanup [-b]                   Clear deleted variables from "
         "memory.\n"
-        "\tsave [-b] <filename>           Save denv table to a file.\n"
+        "\tsave [-b] [--codec <codec>] <filename>\n"
+        "\t                               Save denv variables to a file.\n"
         "\tload [-f/-b] <filename>        Load from a denv save file.\n"
-        "\tawait [-b] <key>               Wait for change in the value of a "
+        "\tawait [-b] [--since <gen>] <key>\n"
+        "\t                               Wait for change in the value of a "
         "key.\n"
         "\texec [-b] <program> <args>     Executes a program with denv "
         "environment variables.\n"
@@ -119,16 +143,38 @@ void print_help(void) {
         "\texport [-b]                    Export environment variables to a "
         "file.\n"
         "\tdaemon [-b]                    Run a daemon to automatically save "
-        "and load.\n"
+        "and load, other\n"
+        "\t                               commands go through its socket.\n"
+        "\tbatch [-0/-b] [file]           Run set, get, ap and rm commands read "
+        "from a file\n"
+        "\t                               or stdin, one per line.\n"
+        "\ttx [-0/-b] [file]              Run set and rm commands as one "
+        "transaction, all or\n"
+        "\t                               none of them are applied.\n"
+        "\twal [-b] [none/log/sync]       Log writes so the daemon recovers "
+        "them after a\n"
+        "\t                               crash, prints the level without "
+        "one.\n"
         "\n"
         "option -b:        Shared memory bind path.\n"
         "option -e:        Set variable as an envrionment variable.\n"
         "option -f:        Force yes to operations that prompts the user.\n"
         "option -x:        Suppress environment variable indicator on listing.\n"
+        "option -r:        Print the value as is, without a trailing newline.\n"
         "option -s:        String separator.\n"
+        "option -0:        Commands are separated by '\\0' instead of lines.\n"
+        "option --since:   Return once the key generation is newer than <gen> "
+        "and print it.\n"
+        "option --codec:   none, zlib (default), lz4 or zstd, load finds it "
+        "by itself.\n"
         "\n"
         "stats --<format>:\n"
-        "\t--csv (default)\n");
+        "\t--csv (default)\n"
+        "\n"
+        "environment DENV_SHM: sysv (default), posix or file, populate, "
+        "hugepages separated by commas.\n"
+        "environment DENV_CODEC: codec of save and of the daemon save on "
+        "exit.\n");
 }
 
 char *get_bind_path(char *path_buf, size_t buf_len) {
@@ -194,7 +240,7 @@ bool is_env_char(char e) {
 }
 
 bool is_env_var_name(char *name) {
-    for (size_t i = 0; i < strlen(name); i++) {
+    for (size_t i = 0; name[i] != '\0'; i++) {
         if (i == 0) {
             if (name[i] >= '0' && name[i] <= '9')
                 return false;
@@ -205,6 +251,344 @@ bool is_env_var_name(char *name) {
     return true;
 }
 
+/* Reads all of a file descriptor followed by a '\0', so records can be cut in
+   place. A regular file is mapped instead of copied when its last page has
+   room for the '\0', pipes are read into a buffer that doubles when it
+   fills. Release it with release_fd_data.
+*/
+char *read_fd(int fd, size_t *len, bool *is_mapped) {
+    struct stat st;
+
+    *len = 0;
+    *is_mapped = false;
+
+    // private mapping, callers may write to it, the page tail reads as zeros
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        st.st_size % sysconf(_SC_PAGESIZE) != 0) {
+        char *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            *len = st.st_size;
+            *is_mapped = true;
+            return data;
+        }
+    }
+
+    size_t capacity = STDIN_VAR_BUFFER_LENGTH;
+    char *buffer = malloc(capacity);
+    if (buffer == NULL)
+        return NULL;
+
+    for (;;) {
+        if (*len + 1 == capacity) {
+            char *new_buffer = realloc(buffer, capacity * 2);
+            if (new_buffer == NULL) {
+                free(buffer);
+                return NULL;
+            }
+            buffer = new_buffer;
+            capacity *= 2;
+        }
+
+        ssize_t n = read(fd, buffer + *len, capacity - *len - 1);
+        if (n == 0)
+            break;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            free(buffer);
+            return NULL;
+        }
+        *len += n;
+    }
+
+    buffer[*len] = '\0';
+    return buffer;
+}
+
+void release_fd_data(char *data, size_t len, bool is_mapped) {
+    if (is_mapped)
+        munmap(data, len);
+    else
+        free(data);
+}
+
+/* Gets a value to write out, big values are pinned in the table instead of
+   copied. Returns NULL if the name isn't set, the value goes back with
+   release_value.
+*/
+char *acquire_value(Table *table, char *name, size_t *len, DenvView *view) {
+    if (denv_view(table, name, view) != 0)
+        return NULL;
+
+    if (view->len >= GET_PIN_BYTES && denv_view_pin(table, name, view) == 0) {
+        *len = view->len;
+        return (char *)view->value;
+    }
+
+    view->pin = -1;
+    return denv_table_copy_value(table, name, len);
+}
+
+void release_value(Table *table, char *value, DenvView *view) {
+    if (view->pin >= 0)
+        denv_view_release(table, view);
+    else
+        free(value);
+}
+
+// Cuts the field at the start of *rest at the first space
+char *cut_field(char **rest) {
+    char *field = *rest;
+    char *space = strchr(field, ' ');
+
+    if (space == NULL) {
+        *rest = field + strlen(field);
+    } else {
+        *space = '\0';
+        *rest = space + 1;
+    }
+
+    return field;
+}
+
+// A set, ap or rm record, value is the rest of the record
+typedef struct {
+    char *op;
+    char *name;
+    char *value;
+    size_t value_len;
+    char *separator;
+    Word flags;
+} BatchRecord;
+
+// Cuts "set [-e] <key> <value>", "ap [-s <sep>] <key> <value>" or "rm <key>"
+int parse_batch_record(char *record, char *record_end, size_t line,
+                       BatchRecord *r) {
+    char *rest = record;
+
+    *r = (BatchRecord){.separator = "\n"};
+    r->op = cut_field(&rest);
+
+    bool is_rm = strcmp(r->op, "rm") == 0;
+    bool is_set = strcmp(r->op, "set") == 0;
+    if (!is_rm && !is_set && strcmp(r->op, "ap") != 0) {
+        print_err("Line %zu: unknown command \"%s\".\n", line, r->op);
+        return -1;
+    }
+
+    if (is_set && strncmp(rest, "-e ", 3) == 0) {
+        r->flags = ELEMENT_IS_ENV;
+        cut_field(&rest);
+    } else if (!is_set && !is_rm && strncmp(rest, "-s ", 3) == 0) {
+        cut_field(&rest);
+        r->separator = cut_field(&rest);
+    }
+
+    // a name to remove may have spaces
+    r->name = is_rm ? rest : cut_field(&rest);
+    r->value = rest;
+    r->value_len = record_end - rest;
+
+    if (r->name[0] == '\0' || (r->flags && !is_env_var_name(r->name))) {
+        print_err("Line %zu: invalid variable name.\n", line);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Applies a set, ap or rm batch record, the caller holds the write lock
+int run_batch_write(Table *table, char *record, char *record_end,
+                    size_t line) {
+    BatchRecord r;
+
+    if (parse_batch_record(record, record_end, line, &r) != 0)
+        return -1;
+
+    int ret = 0;
+    if (r.op[0] == 'r') {
+        _denv_table_delete_value(table, r.name);
+    } else if (r.op[0] == 's') {
+        ret = _denv_table_set_value(table, r.name, r.value, r.value_len,
+                                    r.flags);
+    } else {
+        ret = _denv_table_append_value(table, r.name, r.separator,
+                                       strlen(r.separator), r.value,
+                                       r.value_len);
+    }
+
+    if (ret != 0) {
+        print_err("Line %zu: not enough memory to store \"%s\".\n", line,
+                  r.name);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Cuts the next record of the input at delim or the input's end
+char *cut_record(char **input, char *end, char delim, char **record_end) {
+    char *record = *input;
+
+    *record_end = memchr(record, delim, end - record);
+    if (*record_end == NULL) {
+        *record_end = end;
+        *input = end;
+    } else {
+        *input = *record_end + 1;
+    }
+
+    // the input is followed by a '\0', the last record can be cut too
+    **record_end = '\0';
+    return record;
+}
+
+/* Runs "set [-e] <key> <value>", "ap [-s <sep>] <key> <value>", "rm <key>"
+   and "get <key>" records separated by delim, a value is the rest of its
+   record. Up to BATCH_LOCK_OPS writes in a row share one write lock. A get
+   prints the value followed by delim, only delim if the key isn't set.
+*/
+int run_batch(Table *table, char *input, size_t len, char delim) {
+    int error = 0;
+    int ops = 0; // writes under the held write lock
+    char *end = input + len;
+
+    for (size_t line = 1; input < end; line++) {
+        char *record_end;
+        char *record = cut_record(&input, end, delim, &record_end);
+
+        if (record[0] == '\0' || record[0] == '#') {
+            // blank line or comment
+        } else if (strncmp(record, "get ", 4) == 0) {
+            if (ops > 0) {
+                denv_table_write_end(table);
+                ops = 0;
+            }
+
+            size_t value_len;
+            DenvView view;
+            char *value = acquire_value(table, record + 4, &value_len, &view);
+            if (value) {
+                fwrite(value, 1, value_len, stdout);
+                release_value(table, value, &view);
+            }
+            putchar(delim);
+        } else {
+            if (ops == 0)
+                denv_table_write_begin(table);
+
+            if (run_batch_write(table, record, record_end, line) != 0)
+                error = -1;
+
+            if (++ops == BATCH_LOCK_OPS) {
+                denv_table_write_end(table);
+                ops = 0;
+            }
+        }
+    }
+
+    if (ops > 0)
+        denv_table_write_end(table);
+
+    return error;
+}
+
+/* Stages "set [-e] <key> <value>" and "rm <key>" records separated by delim
+   and commits them as one transaction, nothing is written if any record is
+   invalid.
+*/
+int run_tx(Table *table, char *input, size_t len, char delim) {
+    int error = 0;
+    DenvTx tx = {0};
+    char *end = input + len;
+
+    for (size_t line = 1; input < end; line++) {
+        char *record_end;
+        char *record = cut_record(&input, end, delim, &record_end);
+        BatchRecord r;
+
+        if (record[0] == '\0' || record[0] == '#')
+            continue;
+
+        if (parse_batch_record(record, record_end, line, &r) != 0) {
+            error = -1;
+        } else if (r.op[0] == 'a') {
+            print_err("Line %zu: ap can't be part of a transaction.\n", line);
+            error = -1;
+        } else if (r.op[0] == 'r') {
+            error |= denv_tx_delete(&tx, r.name);
+        } else {
+            error |= denv_tx_set(&tx, r.name, r.value, r.value_len, r.flags);
+        }
+    }
+
+    if (error == 0 && denv_tx_commit(table, &tx) != 0) {
+        print_err("Not enough memory to store the transaction.\n");
+        error = -1;
+    }
+
+    denv_tx_free(&tx);
+    return error;
+}
+
+bool parse_generation(char *str, uint64_t *generation) {
+    char *end = NULL;
+
+    if (!isdigit((unsigned char)str[0]))
+        return false;
+
+    errno = 0;
+    *generation = strtoull(str, &end, 10);
+
+    return (errno == 0 && *end == '\0');
+}
+
+/* Reads how new tables are created and how this process maps them from
+   DENV_SHM, a comma separated list of sysv, posix or file, populate and
+   hugepages
+*/
+DenvShmOptions shm_options(void) {
+    DenvShmOptions options = {DENV_SHM_SYSV, 0};
+    char *env = getenv("DENV_SHM");
+
+    if (env == NULL)
+        return options;
+
+    char list[BUFF_SIZE];
+    snprintf(list, sizeof(list), "%s", env);
+
+    char *save = NULL;
+    for (char *word = strtok_r(list, ",", &save); word != NULL;
+         word = strtok_r(NULL, ",", &save)) {
+        if (strcmp(word, "sysv") == 0)
+            options.backend = DENV_SHM_SYSV;
+        else if (strcmp(word, "posix") == 0)
+            options.backend = DENV_SHM_POSIX;
+        else if (strcmp(word, "file") == 0)
+            options.backend = DENV_SHM_FILE;
+        else if (strcmp(word, "populate") == 0)
+            options.flags |= DENV_SHM_POPULATE;
+        else if (strcmp(word, "hugepages") == 0)
+            options.flags |= DENV_SHM_HUGE_PAGES;
+        else
+            print_err("Unknown DENV_SHM option \"%s\".\n", word);
+    }
+
+    return options;
+}
+
+// Codec of new save files from DENV_CODEC, zlib by default
+DenvCodec codec_option(void) {
+    DenvCodec codec = DENV_CODEC_ZLIB;
+    char *env = getenv("DENV_CODEC");
+
+    if (env != NULL && denv_codec_from_name(env, &codec) == false)
+        print_err("Unknown DENV_CODEC \"%s\".\n", env);
+
+    return codec;
+}
+
 Table *init() {
 
     char *file_name = load_path();
@@ -212,22 +596,14 @@ Table *init() {
         return NULL;
 
     // attach memory block
-    Table *table = denv_shmem_attach(file_name, sizeof(Table));
+    DenvShmOptions options = shm_options();
+    Table *table = denv_attach_with(file_name, &options);
 
     if (table == NULL) {
         print_err("Failed to create a shared memory environment.\n");
         return NULL;
     }
 
-    if ((table->flags & TABLE_IS_INITIALIZED) == 0) {
-        int sem_ret = sem_init(&table->denv_sem, 1, 1);
-        if (sem_ret < 0) {
-            perror("sem_init");
-            return NULL;
-        }
-        denv_table_init(table);
-    }
-
     return table;
 }
 
@@ -249,27 +625,23 @@ Table *init_on_path(char *path) {
         return NULL;
     }
 
-    Table *table = denv_shmem_attach(path, sizeof(Table));
+    DenvShmOptions options = shm_options();
+    Table *table = denv_attach_with(path, &options);
 
     if (table == NULL) {
         print_err("Failed to create a shared memory environment.\n");
         return NULL;
     }
 
-    if ((table->flags & TABLE_IS_INITIALIZED) == 0) {
-        int sem_ret = sem_init(&table->denv_sem, 1, 1);
-        if (sem_ret < 0) {
-            perror("sem_init");
-            return NULL;
-        }
-        denv_table_init(table);
-    }
-
     return table;
 }
 
 Table *init_only_table(char *file_name) {
-    Table *table = denv_shmem_attach(file_name, sizeof(Table));
+    DenvShmOptions options = shm_options();
+    Table *table = denv_shmem_attach(
+        file_name,
+        denv_table_size(DENV_INITIAL_ELEMENTS, DENV_INITIAL_BLOCK_SIZE),
+        &options);
 
     if (table == NULL) {
         print_err("Failed to create a shared memory environment.\n");
@@ -283,9 +655,13 @@ typedef struct {
     char *name;
     char *value;
     char *save_path;
+    char *input_path;
     char *separator;
     char *exec_command;
     char **exec_command_args;
+    uint64_t since;
+    DenvCodec codec;
+    DenvDurability durability;
     int print_option;
     int error;
     command_states state;
@@ -294,6 +670,11 @@ typedef struct {
     bool suppress;
     bool is_stdin;
     bool is_stdout;
+    bool is_raw;
+    bool is_prefix;
+    bool is_nul_delimited;
+    bool has_since;
+    bool has_durability;
 } CmdLine;
 
 typedef enum {
@@ -308,6 +689,9 @@ typedef enum {
     PARSE_ERROR_NOT_ENOUGH_ARGUMENTS,
     PARSE_ERROR_TOO_MANY_ARGUMENTS,
     PARSE_ERROR_TOO_MANY_ARGUMENTS_OR_MISSING_NAME,
+    PARSE_ERROR_INVALID_NUMBER,
+    PARSE_ERROR_UNKNOWN_CODEC,
+    PARSE_ERROR_UNKNOWN_DURABILITY,
     PARSE_ERROR_UNIMPLEMENTED
 } CommandParseErrors;
 
@@ -387,29 +771,42 @@ CmdLine parse_commands(int argc, char **argv) {
                 cmd.error = PARSE_ERROR_TOO_MANY_ARGUMENTS;
             }
             break;
-        case GET:
-            if (argc == 3) {
-                // denv get var_name				3
-                cmd.name = argv[2];
-            } else if (argc < 3) {
-                cmd.error = PARSE_ERROR_MISSING_NAME;
-                break;
-            } else if (argc == 5) {
-                // denv get -b bind/path var_name	5
-                if (strcmp(argv[2], "-b") != 0) {
-                    cmd.error = PARSE_ERROR_UNKNOWN_OPTION;
+        case GET: {
+            // denv get var_name						3
+            // denv get -r var_name						4
+            // denv get -b bind/path var_name			5
+            // denv get -rb bind/path var_name			5
+            // denv get --prefix [-r/-b] pattern		4+
+            int i = 2;
+            for (; i + 1 < argc; i++) {
+                if (strcmp(argv[i], "--prefix") == 0) {
+                    cmd.is_prefix = true;
+                } else if (strcmp(argv[i], "-r") == 0) {
+                    cmd.is_raw = true;
+                } else if (strcmp(argv[i], "-b") == 0 ||
+                           strcmp(argv[i], "-rb") == 0 ||
+                           strcmp(argv[i], "-br") == 0) {
+                    if (argv[i][2] != '\0')
+                        cmd.is_raw = true;
+                    if (i + 2 >= argc) {
+                        cmd.error = PARSE_ERROR_TOO_MANY_ARGUMENTS_OR_MISSING_NAME;
+                        break;
+                    }
+                    cmd.bind_path = argv[++i];
+                } else {
                     break;
                 }
-                cmd.name = argv[4];
-                cmd.bind_path = argv[3];
-            } else if (argc == 4) {
-                cmd.error = PARSE_ERROR_TOO_MANY_ARGUMENTS_OR_MISSING_NAME;
-                break;
-            } else if (argc > 5) {
-                cmd.error = PARSE_ERROR_TOO_MANY_ARGUMENTS;
+            }
+            if (cmd.error != PARSE_ERROR_NONE)
                 break;
+            if (i >= argc) {
+                cmd.error = PARSE_ERROR_MISSING_NAME;
+            } else if (i + 1 < argc) {
+                cmd.error = PARSE_ERROR_TOO_MANY_ARGUMENTS_OR_MISSING_NAME;
+            } else {
+                cmd.name = argv[i];
             }
-            break;
+        } break;
         case REMOVE:
             if (argc < 3) {
                 cmd.error = PARSE_ERROR_MISSING_NAME;
@@ -455,32 +852,35 @@ CmdLine parse_commands(int argc, char **argv) {
                 break;
             }
             break;
-        case LIST:
-            if(argc == 3) {
-                // denv ls -x 				3
-                if (strcmp(argv[2], "-x") != 0) {
-                    cmd.error = PARSE_ERROR_UNKNOWN_OPTION;
-                    break;
-                }
-                cmd.suppress = true;
-            } else if (argc == 4) {
-                // denv ls -b bind/path 	4
-                // denv ls -xb bind/path 	4
-                // denv ls -bx bind/path 	4
-                if (strcmp(argv[2], "-b") != 0) {
-                    if ((strcmp(argv[2], "-xb") && strcmp(argv[2], "-bx")) == 0) {
+        case LIST: {
+            // denv ls [-x] [-b bind/path] [prefix/glob]
+            // denv ls -xb bind/path [prefix/glob]
+            int i = 2;
+            for (; i < argc; i++) {
+                if (strcmp(argv[i], "-x") == 0) {
+                    cmd.suppress = true;
+                } else if (strcmp(argv[i], "-b") == 0 ||
+                           strcmp(argv[i], "-xb") == 0 ||
+                           strcmp(argv[i], "-bx") == 0) {
+                    if (argv[i][2] != '\0')
                         cmd.suppress = true;
-                    } else {
-                        cmd.error = PARSE_ERROR_UNKNOWN_OPTION;
+                    if (i + 1 >= argc) {
+                        cmd.error = PARSE_ERROR_MISSING_PATH;
                         break;
                     }
+                    cmd.bind_path = argv[++i];
+                } else {
+                    break;
                 }
-                cmd.bind_path = argv[3];
-            } else if (argc > 4) {
-                cmd.error = PARSE_ERROR_TOO_MANY_ARGUMENTS;
+            }
+            if (cmd.error != PARSE_ERROR_NONE)
                 break;
+            if (i + 1 < argc) {
+                cmd.error = PARSE_ERROR_TOO_MANY_ARGUMENTS;
+            } else if (i < argc) {
+                cmd.name = argv[i];
             }
-            break;
+        } break;
         case STATS:
         
             cmd.print_option = CSV;
@@ -556,31 +956,39 @@ CmdLine parse_commands(int argc, char **argv) {
                     cmd.error = PARSE_ERROR_UNKNOWN_OPTION;
                     break;
                 }
+                cmd.bind_path = argv[3];
             } else if (argc > 4) {
                 cmd.error = PARSE_ERROR_TOO_MANY_ARGUMENTS;
                 break;
             }
             break;
-        case SAVE:
-            if(argc == 2) {
-                cmd.error = PARSE_ERROR_MISSING_PATH;
-            } else if (argc == 3) {
-                // denv save path/to/save_file					3
-                cmd.save_path = argv[2];
-            } else if (argc == 4) {
-                cmd.error = PARSE_ERROR_MISSING_PATH_OR_MANY_ARGS;
-            } else if (argc == 5) {
-                // denv save -b bind/path path/to/save_file		5
-                if(strcmp(argv[2], "-b") != 0) {
+        case SAVE: {
+            // denv save [-b bind/path] [--codec name] path/to/save_file
+            cmd.codec = codec_option();
+
+            int i = 2;
+            for (; i + 1 < argc && cmd.error == PARSE_ERROR_NONE; i += 2) {
+                if (i + 2 == argc) {
+                    cmd.error = PARSE_ERROR_MISSING_PATH_OR_MANY_ARGS;
+                } else if (strcmp(argv[i], "-b") == 0) {
+                    cmd.bind_path = argv[i + 1];
+                } else if (strcmp(argv[i], "--codec") == 0) {
+                    if (denv_codec_from_name(argv[i + 1], &cmd.codec) == false)
+                        cmd.error = PARSE_ERROR_UNKNOWN_CODEC;
+                } else {
                     cmd.error = PARSE_ERROR_UNKNOWN_OPTION;
-                    break;
                 }
-                cmd.bind_path = argv[3];
-                cmd.save_path = argv[4];
-            } else if (argc > 5) {
-                cmd.error = PARSE_ERROR_TOO_MANY_ARGUMENTS;
             }
+
+            if (cmd.error != PARSE_ERROR_NONE)
+                break;
+
+            if (i == argc)
+                cmd.error = PARSE_ERROR_MISSING_PATH;
+            else
+                cmd.save_path = argv[i];
             break;
+        }
         case LOAD:
             if(argc == 2) {
                 cmd.error = PARSE_ERROR_MISSING_PATH;
@@ -621,13 +1029,37 @@ CmdLine parse_commands(int argc, char **argv) {
                 cmd.error = PARSE_ERROR_MISSING_PATH_OR_MANY_ARGS;
             } else if (argc == 5) {
                 // denv await -b some/path variable
-                if (strcmp(argv[2], "-b") != 0) {
+                // denv await --since generation variable
+                if (strcmp(argv[2], "--since") == 0) {
+                    cmd.has_since = true;
+                    if (parse_generation(argv[3], &cmd.since) == false) {
+                        cmd.error = PARSE_ERROR_INVALID_NUMBER;
+                        break;
+                    }
+                } else if (strcmp(argv[2], "-b") == 0) {
+                    cmd.bind_path = argv[3];
+                } else {
                     cmd.error = PARSE_ERROR_UNKNOWN_OPTION;
                     break;
                 }
-                cmd.bind_path = argv[3];
                 cmd.name = argv[4];
-            } else if (argc > 5) {
+            } else if (argc == 6) {
+                cmd.error = PARSE_ERROR_MISSING_PATH_OR_MANY_ARGS;
+            } else if (argc == 7) {
+                // denv await -b some/path --since generation variable
+                if (strcmp(argv[2], "-b") != 0 ||
+                    strcmp(argv[4], "--since") != 0) {
+                    cmd.error = PARSE_ERROR_UNKNOWN_OPTION;
+                    break;
+                }
+                cmd.has_since = true;
+                if (parse_generation(argv[5], &cmd.since) == false) {
+                    cmd.error = PARSE_ERROR_INVALID_NUMBER;
+                    break;
+                }
+                cmd.bind_path = argv[3];
+                cmd.name = argv[6];
+            } else if (argc > 7) {
                 cmd.error = PARSE_ERROR_TOO_MANY_ARGUMENTS;
             }
             break;
@@ -760,6 +1192,71 @@ CmdLine parse_commands(int argc, char **argv) {
                 cmd.error = PARSE_ERROR_TOO_MANY_ARGUMENTS;
             }
             break;
+        case BATCH:
+        case TX:
+            // denv batch                           2
+            // denv batch path/to/file              3
+            // denv batch -0                        3
+            // denv batch -0 path/to/file           4
+            // denv batch -b bind/path              4
+            // denv batch -0b bind/path             4
+            // denv batch -b bind/path file         5
+            // denv batch -0b bind/path file        5
+            if (argc == 3) {
+                if (strcmp(argv[2], "-0") == 0) {
+                    cmd.is_nul_delimited = true;
+                } else {
+                    cmd.input_path = argv[2];
+                }
+            } else if (argc == 4 || argc == 5) {
+                if (strcmp(argv[2], "-0") == 0 && argc == 4) {
+                    cmd.is_nul_delimited = true;
+                    cmd.input_path = argv[3];
+                    break;
+                }
+
+                if (strcmp(argv[2], "-0b") == 0 ||
+                    strcmp(argv[2], "-b0") == 0) {
+                    cmd.is_nul_delimited = true;
+                } else if (strcmp(argv[2], "-b") != 0) {
+                    cmd.error = PARSE_ERROR_UNKNOWN_OPTION;
+                    break;
+                }
+                cmd.bind_path = argv[3];
+                if (argc == 5)
+                    cmd.input_path = argv[4];
+            } else if (argc > 5) {
+                cmd.error = PARSE_ERROR_TOO_MANY_ARGUMENTS;
+            }
+            break;
+        case WAL: {
+            // denv wal                             2
+            // denv wal level                       3
+            // denv wal -b bind/path                4
+            // denv wal -b bind/path level          5
+            int i = 2;
+
+            if (argc > 2 && strcmp(argv[2], "-b") == 0) {
+                if (argc == 3) {
+                    cmd.error = PARSE_ERROR_MISSING_PATH;
+                    break;
+                }
+                cmd.bind_path = argv[3];
+                i = 4;
+            } else if (argc > 2 && argv[2][0] == '-') {
+                cmd.error = PARSE_ERROR_UNKNOWN_OPTION;
+                break;
+            }
+
+            if (argc > i + 1) {
+                cmd.error = PARSE_ERROR_TOO_MANY_ARGUMENTS;
+            } else if (argc == i + 1) {
+                cmd.has_durability = true;
+                if (denv_durability_from_name(argv[i], &cmd.durability) ==
+                    false)
+                    cmd.error = PARSE_ERROR_UNKNOWN_DURABILITY;
+            }
+        } break;
         default:    /* UNDEFINED, HELP or VERSION */
             break;
     }
@@ -767,6 +1264,714 @@ CmdLine parse_commands(int argc, char **argv) {
     return cmd;
 }
 
+typedef struct {
+    int fd;
+    DenvBytes in;
+    DenvBytes out;
+    bool is_parked; // the await at the front of in is waiting
+    uint64_t since;
+} DaemonClient;
+
+volatile sig_atomic_t g_daemon_signal = 0;
+int g_daemon_wake_fd = -1;
+atomic_bool g_daemon_is_stopping = false;
+
+void daemon_wake_up(void) {
+    // the pipe is non-blocking, if it's full the loop is waking up already
+    ssize_t ret = write(g_daemon_wake_fd, "", 1);
+    (void)ret;
+}
+
+void daemon_on_signal(int sig) {
+    g_daemon_signal = sig;
+    daemon_wake_up();
+}
+
+/* Wakes up the daemon loop whenever the table is written, by anyone, so
+   awaits waiting on the socket are checked again.
+*/
+void *daemon_watch_table(void *arg) {
+    Table *table = arg;
+    struct timespec ts = {.tv_nsec = 1000000};
+    uint32_t wake = atomic_load(&table->wake);
+
+    while (!atomic_load(&g_daemon_is_stopping)) {
+        denv_table_wait(table, wake, NULL);
+
+        // a moved table isn't woken up anymore, wait for the loop to follow
+        while ((table->flags & TABLE_IS_MOVED) &&
+               !atomic_load(&g_daemon_is_stopping)) {
+            daemon_wake_up();
+            nanosleep(&ts, NULL);
+        }
+
+        wake = atomic_load(&table->wake);
+        daemon_wake_up();
+    }
+
+    return NULL;
+}
+
+/* Makes this process the daemon of the bind path and listens on its socket.
+   An exclusive flock on the lock file next to the socket is held until the
+   process exits, a second daemon gives up here before it loads anything.
+   The socket is created with umask 0177, it's never reachable by others.
+*/
+int daemon_listen(char *socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    char lock_path[PATH_BUFFER_LENGHT];
+    DenvClient probe;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path) ||
+        snprintf(lock_path, sizeof(lock_path), "%s.lock", socket_path) >=
+            (int)sizeof(lock_path)) {
+        print_err("Socket path \"%s\" is too long.\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    // never closed, the lock goes away with the process
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock_fd == -1) {
+        print_err("Couldn't open \"%s\": %s.\n", lock_path, strerror(errno));
+        return -1;
+    }
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) == -1) {
+        print_err("A daemon is already running on \"%s\".\n", socket_path);
+        close(lock_fd);
+        return -1;
+    }
+
+    // a daemon of an older denv doesn't take the lock
+    if (denv_client_connect(&probe, socket_path) == 0) {
+        denv_client_close(&probe);
+        print_err("A daemon is already listening on \"%s\".\n", socket_path);
+        close(lock_fd);
+        return -1;
+    }
+
+    // left behind by a daemon that didn't exit cleanly
+    unlink(socket_path);
+
+    mode_t mask = umask(0177);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    int ret = fd == -1 ? -1 : bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+
+    if (ret == -1 || listen(fd, SOMAXCONN) == -1 ||
+        fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+        print_err("Couldn't listen on \"%s\": %s.\n", socket_path,
+                  strerror(errno));
+        if (fd != -1)
+            close(fd);
+        close(lock_fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Answers one request, an await that has to wait parks the client instead
+int daemon_answer(Table *table, DaemonClient *c, DenvRequest *req, char *name,
+                  char *separator, char *value) {
+    DenvResponse resp = {0};
+    DenvView view = {.pin = -1};
+    char *data = NULL;
+
+    switch (req->op) {
+    case DENV_OP_GET: {
+        size_t len;
+        data = acquire_value(table, name, &len, &view);
+        resp.status = data ? 0 : -1;
+        resp.len = data ? len : 0;
+    } break;
+    case DENV_OP_SET:
+        resp.status = denv_table_set_value_n(
+            table, name, value, req->value_len,
+            (req->flags & DENV_REQUEST_ENV) ? ELEMENT_IS_ENV : 0);
+        break;
+    case DENV_OP_APPEND:
+        resp.status = denv_table_append_value(table, name, separator, value,
+                                              req->value_len);
+        break;
+    case DENV_OP_REMOVE:
+        denv_table_delete_value(table, name);
+        break;
+    case DENV_OP_LIST: {
+        size_t len;
+        int flags =
+            ((req->flags & DENV_REQUEST_LIST_ENV) ? DENV_LIST_ENV : 0) |
+            ((req->flags & DENV_REQUEST_LIST_VALUES) ? DENV_LIST_VALUES : 0);
+        data = denv_table_copy_list(table, name, flags, &len);
+        if (data == NULL)
+            return -1;
+        resp.len = len;
+    } break;
+    case DENV_OP_AWAIT: {
+        // without --since it waits for the first write after it arrived
+        if (!c->is_parked)
+            c->since = (req->flags & DENV_REQUEST_SINCE)
+                           ? req->since
+                           : denv_table_get_generation(table, name);
+
+        resp.generation = denv_table_get_generation(table, name);
+        c->is_parked = resp.generation <= c->since;
+        if (c->is_parked)
+            return 0;
+    } break;
+    default:
+        return -1;
+    }
+
+    int ret = denv_response_push(&c->out, resp, data);
+    release_value(table, data, &view);
+
+    return ret;
+}
+
+// Sends what it can without blocking
+int daemon_flush(DaemonClient *c) {
+    size_t sent = 0;
+
+    while (sent < c->out.len) {
+        ssize_t n = send(c->fd, c->out.data + sent, c->out.len - sent,
+                         MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        sent += n;
+    }
+
+    denv_bytes_consume(&c->out, sent);
+    return 0;
+}
+
+/* Answers every whole request the client sent in order, stopping at an await
+   that has to wait. The responses are sent by daemon_flush.
+*/
+int daemon_serve(Table *table, DaemonClient *c) {
+    size_t pos = 0;
+
+    while (c->out.len < DAEMON_OUT_LIMIT) {
+        DenvRequest req;
+        char *name, *separator, *value;
+
+        ssize_t n = denv_request_parse(c->in.data + pos, c->in.len - pos, &req,
+                                       &name, &separator, &value);
+        if (n == -1)
+            return -1;
+        if (n == 0)
+            break;
+
+        if (daemon_answer(table, c, &req, name, separator, value) != 0)
+            return -1;
+        if (c->is_parked)
+            break;
+
+        pos += n;
+    }
+
+    denv_bytes_consume(&c->in, pos);
+    return 0;
+}
+
+// Reads what's there, returns -1 when the client is gone
+int daemon_receive(DaemonClient *c) {
+    for (;;) {
+        if (denv_bytes_reserve(&c->in, 1 << 16) != 0)
+            return -1;
+
+        ssize_t n =
+            read(c->fd, c->in.data + c->in.len, c->in.capacity - c->in.len);
+        if (n == 0)
+            return -1;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->in.len += n;
+    }
+}
+
+void daemon_drop(DaemonClient *clients, size_t *count, size_t i) {
+    close(clients[i].fd);
+    denv_bytes_free(&clients[i].in);
+    denv_bytes_free(&clients[i].out);
+    clients[i] = clients[--*count];
+}
+
+double daemon_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Incremental saves of the daemon. Every DAEMON_INTERVAL the variables
+   written or removed since the last snapshot go to the delta file, which is
+   rewritten whole and stays small as it only has the latest state of each.
+   Once it reaches a DAEMON_FOLD_RATIO part of the snapshot a new snapshot
+   is written, deltas go on meanwhile. The loop only copies the table, a
+   thread serializes, compresses and writes the copy while the daemon goes
+   on. A write that failed is tried again DAEMON_SAVE_RETRY seconds later.
+*/
+typedef struct {
+    char *path;
+    DenvCodec codec;
+    bool is_running;
+    atomic_bool is_done;
+    pthread_t thread;
+    Table *snapshot; // copy of the table the thread writes
+    DenvSaveInfo info;
+    bool is_dropped; // removed names left the copy's index, see below
+    int ret;
+    int error;
+} DaemonSaveJob;
+
+typedef struct {
+    char *save_path;
+    char *delta_path;
+    DenvCodec codec;
+    uint64_t durable_generation;  // newest write on disk
+    uint64_t snapshot_generation; // of the snapshot deltas are written on
+    size_t snapshot_size;
+    size_t delta_size;
+    bool has_snapshot; // false until a snapshot of this table is written
+    double retry_at; // no write is started before, see daemon_now
+    DaemonSaveJob fold;
+    DaemonSaveJob delta;
+} DaemonSaves;
+
+void *daemon_save_run(void *arg) {
+    DaemonSaveJob *job = arg;
+#ifdef __linux__
+    // clients are answered first when the CPUs are busy, nice is per thread
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#endif
+
+    // a client removed a name that left the index after the loop checked
+    job->is_dropped = job->info.is_delta &&
+                      job->snapshot->dropped_generation > job->info.base;
+
+    char *save = job->is_dropped
+                     ? NULL
+                     : denv_table_write_save(job->snapshot, &job->info);
+
+    job->ret = save == NULL ? -1
+                            : denv_write_save_file(save, job->info.size,
+                                                   job->path, job->codec);
+    job->error = errno;
+    free(save);
+    denv_snapshot_release(job->snapshot);
+    job->snapshot = NULL;
+    atomic_store(&job->is_done, true);
+
+    return NULL;
+}
+
+// Copies the table and writes it in the background, as a delta or in full
+void daemon_save_start(Table *table, DaemonSaves *saves, DaemonSaveJob *job) {
+    bool is_delta = job == &saves->delta;
+
+    job->path = is_delta ? saves->delta_path : saves->save_path;
+    job->codec = saves->codec;
+    job->info = (DenvSaveInfo){.base = saves->snapshot_generation,
+                               .is_delta = is_delta};
+    job->snapshot = denv_table_snapshot(table);
+    if (job->snapshot == NULL)
+        return;
+
+    atomic_store(&job->is_done, false);
+    if (pthread_create(&job->thread, NULL, daemon_save_run, job) != 0) {
+        denv_snapshot_release(job->snapshot);
+        job->snapshot = NULL;
+        return;
+    }
+
+    job->is_running = true;
+}
+
+// Waits for the job, a finished snapshot is the base of the next deltas
+void daemon_save_finish(DaemonSaves *saves, DaemonSaveJob *job) {
+    pthread_join(job->thread, NULL);
+    job->is_running = false;
+
+    if (job->is_dropped) {
+        saves->has_snapshot = false;
+        return;
+    }
+
+    if (job->ret != 0) {
+        // what's on disk stays valid, the log keeps the writes meanwhile
+        syslog(LOG_ERR, "Couldn't write \"%s\": %s. Trying again in %d "
+               "seconds.", job->path, strerror(job->error),
+               DAEMON_SAVE_RETRY);
+        saves->retry_at = daemon_now() + DAEMON_SAVE_RETRY;
+        return;
+    }
+
+    if (job == &saves->delta) {
+        saves->durable_generation = job->info.generation;
+        saves->delta_size = job->info.size;
+        return;
+    }
+
+    saves->snapshot_generation = job->info.generation;
+    saves->snapshot_size = job->info.size;
+    saves->has_snapshot = true;
+
+    // a delta newer than the snapshot is still loaded on top of it
+    if (saves->durable_generation <= saves->snapshot_generation) {
+        saves->durable_generation = saves->snapshot_generation;
+        saves->delta_size = 0;
+        unlink(saves->delta_path);
+    }
+}
+
+void daemon_save_changes(Table *table, DaemonSaves *saves) {
+    DaemonSaveJob *fold = &saves->fold;
+    DaemonSaveJob *delta = &saves->delta;
+
+    if (delta->is_running && atomic_load(&delta->is_done))
+        daemon_save_finish(saves, delta);
+
+    // not while a delta is written, it could be renamed in after the unlink
+    if (fold->is_running && !delta->is_running &&
+        atomic_load(&fold->is_done))
+        daemon_save_finish(saves, fold);
+
+    if (delta->is_running ||
+        table->last_generation == saves->durable_generation ||
+        daemon_now() < saves->retry_at)
+        return;
+
+    // removed names left the index, only a snapshot has them now
+    if (table->dropped_generation > saves->snapshot_generation)
+        saves->has_snapshot = false;
+
+    if (saves->has_snapshot &&
+        (fold->is_running ||
+         saves->delta_size * DAEMON_FOLD_RATIO < saves->snapshot_size))
+        daemon_save_start(table, saves, delta);
+    else if (!fold->is_running)
+        daemon_save_start(table, saves, fold);
+}
+
+/* Puts writes logged with DENV_DURABILITY_LOG on disk and starts a new log
+   once it reaches DAEMON_WAL_LIMIT. The old log is removed when saves have
+   all of its writes, a table file only has to be synced for that.
+*/
+void daemon_wal_checkpoint(Table *table, DaemonSaves *saves) {
+    uint64_t rotated = table->wal.rotated_generation;
+
+    if (rotated != 0) {
+        if (saves == NULL ? denv_table_sync(table, true) == 0
+                          : saves->durable_generation != UINT64_MAX &&
+                                saves->durable_generation >= rotated)
+            denv_wal_drop_rotated(table);
+        return;
+    }
+
+    if (atomic_load(&table->wal.level) == DENV_DURABILITY_NONE)
+        return;
+
+    if (denv_wal_commit(table, atomic_load(&table->wal.appended)) != 0)
+        syslog(LOG_ERR, "Couldn't sync the log \"%s\".",
+               g_denv_mapping.wal_name);
+
+    struct stat st;
+    if (stat(g_denv_mapping.wal_name, &st) == 0 &&
+        st.st_size >= DAEMON_WAL_LIMIT && denv_wal_rotate(table) != 0)
+        syslog(LOG_ERR, "Couldn't start a new log.");
+}
+
+/* Replays the logs on top of what the daemon loaded, the old one first if
+   it stopped before saves had its writes. The old log stays until they do.
+*/
+void daemon_wal_recover(Table *table, uint64_t since) {
+    char old_path[DENV_WAL_ROTATED_LENGTH];
+    char *paths[] = {old_path, g_denv_mapping.wal_name};
+    long groups = 0;
+
+    denv_wal_rotated_name(old_path);
+
+    for (size_t i = 0; i < ARRLEN(paths); i++) {
+        if (!check_path(paths[i]))
+            continue;
+
+        long replayed = denv_wal_replay(table, paths[i], since);
+        if (replayed == -1)
+            print_err("Couldn't replay \"%s\", writes logged in it are "
+                      "lost.\n", paths[i]);
+        else
+            groups += replayed;
+
+        if (paths[i] == old_path)
+            table->wal.rotated_generation = table->last_generation;
+    }
+
+    int level = denv_wal_read_level(g_denv_mapping.wal_name);
+    if (level != -1)
+        atomic_store(&table->wal.level, level);
+
+    if (groups > 0)
+        printf("Replayed %ld logged writes.\n", groups);
+}
+
+/* Serves the socket listen_fd is bound to, see daemon_listen, until a
+   signal arrives, compacts the table while idle and writes its changes to
+   disk if saves is set. Returns the signal, or -1 if the loop failed.
+*/
+int daemon_run(Table *table, int listen_fd, char *socket_path,
+               DaemonSaves *saves) {
+    int wake_pipe[2];
+    if (pipe(wake_pipe) == -1) {
+        perror("pipe");
+        close(listen_fd);
+        return -1;
+    }
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+    g_daemon_wake_fd = wake_pipe[1];
+
+    struct sigaction sa = {.sa_handler = daemon_on_signal};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    // durable writes of clients are committed together before answering
+    g_denv_wal.is_deferred = true;
+
+    pthread_t watcher;
+    if (pthread_create(&watcher, NULL, daemon_watch_table, table) != 0) {
+        print_err("Couldn't start the table watcher.\n");
+        close(listen_fd);
+        return -1;
+    }
+
+    DaemonClient *clients = NULL;
+    struct pollfd *fds = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    double last_check = daemon_now();
+    Word synced_seq = atomic_load(&table->seq);
+    // a compaction pass runs one step a round, clients are served between
+    bool is_compacting = false;
+
+    while (g_daemon_signal == 0) {
+        if (count + 2 > capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 16;
+            DaemonClient *new_clients =
+                realloc(clients, new_capacity * sizeof(DaemonClient));
+            if (new_clients != NULL)
+                clients = new_clients;
+            struct pollfd *new_fds =
+                realloc(fds, new_capacity * sizeof(struct pollfd));
+            if (new_fds != NULL)
+                fds = new_fds;
+
+            if (new_clients == NULL || new_fds == NULL) {
+                print_err("Couldn't allocate more memory.\n");
+                break;
+            }
+            capacity = new_capacity;
+        }
+
+        fds[0] = (struct pollfd){.fd = wake_pipe[0], .events = POLLIN};
+        fds[1] = (struct pollfd){.fd = listen_fd, .events = POLLIN};
+        for (size_t i = 0; i < count; i++) {
+            short events = POLLIN | (clients[i].out.len ? POLLOUT : 0);
+            fds[i + 2] = (struct pollfd){.fd = clients[i].fd, .events = events};
+        }
+
+        int timeout = is_compacting ? 0 : DAEMON_INTERVAL * 1000;
+        if (poll(fds, count + 2, timeout) == -1 &&
+            errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        // the table changed, the awaits it unblocked are answered below
+        bool table_changed = fds[0].revents & POLLIN;
+        if (table_changed) {
+            char drain[64];
+            while (read(wake_pipe[0], drain, sizeof(drain)) > 0)
+                ;
+
+            if (table->flags & TABLE_IS_MOVED)
+                denv_table_remap(table);
+        }
+
+        // backwards, a dropped client is replaced by one already served
+        for (size_t i = count; i-- > 0;) {
+            DaemonClient *c = &clients[i];
+            short revents = fds[i + 2].revents;
+            int error = 0;
+
+            if (revents & (POLLIN | POLLHUP | POLLERR))
+                error = daemon_receive(c);
+
+            if (error == 0 && (revents || (table_changed && c->is_parked)))
+                error = daemon_serve(table, c);
+
+            if (error != 0)
+                daemon_drop(clients, &count, i);
+        }
+
+        // the durable writes answered above share one fsync
+        if (atomic_load(&table->wal.level) == DENV_DURABILITY_SYNC &&
+            denv_wal_commit(table, g_denv_wal.logged) != 0)
+            syslog(LOG_ERR, "Couldn't sync the log \"%s\".",
+                   g_denv_mapping.wal_name);
+
+        for (size_t i = count; i-- > 0;) {
+            if (clients[i].out.len > 0 && daemon_flush(&clients[i]) != 0)
+                daemon_drop(clients, &count, i);
+        }
+
+        if (fds[1].revents & POLLIN) {
+            int fd;
+            while (count + 2 <= capacity &&
+                   (fd = accept(listen_fd, NULL, NULL)) != -1) {
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                clients[count++] = (DaemonClient){.fd = fd};
+            }
+        }
+
+        if (is_compacting)
+            is_compacting = denv_table_compact_step(table);
+
+        if (daemon_now() - last_check >= DAEMON_INTERVAL) {
+            last_check = daemon_now();
+            if (!is_compacting && denv_table_should_compact(table))
+                is_compacting = denv_table_compact_step(table);
+
+            // a table file is its own save, writeback keeps it on disk
+            Word seq = atomic_load(&table->seq);
+            if (seq != synced_seq && denv_table_is_file(table)) {
+                denv_table_sync(table, false);
+                synced_seq = seq;
+            }
+
+            if (saves != NULL)
+                daemon_save_changes(table, saves);
+
+            daemon_wal_checkpoint(table, saves);
+        }
+    }
+
+    while (count > 0)
+        daemon_drop(clients, &count, 0);
+    free(clients);
+    free(fds);
+
+    // the table gets detached on exit, the watcher can't be left on it
+    atomic_store(&g_daemon_is_stopping, true);
+    denv_table_wake(table);
+    pthread_join(watcher, NULL);
+
+    close(listen_fd);
+    unlink(socket_path);
+
+    return g_daemon_signal ? g_daemon_signal : -1;
+}
+
+/* Runs get, set, ap, rm, ls and await through the daemon socket, it saves
+   attaching the table. Returns 1 without doing anything if no daemon is
+   listening.
+*/
+int run_client(CmdLine *cmd, char *socket_path) {
+    DenvClient client;
+    DenvRequest req = {0};
+    char *separator = NULL;
+    char *value = cmd->value;
+    char *name = cmd->name ? cmd->name : "";
+    char *buffer = NULL;
+    size_t len = 0;
+    bool is_mapped = false;
+
+    switch (cmd->state) {
+    case GET:
+        // a prefix get is a list that prints values instead
+        req.op = cmd->is_prefix ? DENV_OP_LIST : DENV_OP_GET;
+        req.flags = cmd->is_prefix ? DENV_REQUEST_LIST_VALUES : 0;
+        break;
+    case SET:
+        req.op = DENV_OP_SET;
+        req.flags = cmd->is_env ? DENV_REQUEST_ENV : 0;
+        break;
+    case APPEND:
+        req.op = DENV_OP_APPEND;
+        separator = cmd->separator ? cmd->separator : "\n";
+        break;
+    case REMOVE:
+        req.op = DENV_OP_REMOVE;
+        break;
+    case LIST:
+        req.op = DENV_OP_LIST;
+        req.flags = cmd->suppress ? 0 : DENV_REQUEST_LIST_ENV;
+        break;
+    case AWAIT:
+        req.op = DENV_OP_AWAIT;
+        req.flags = cmd->has_since ? DENV_REQUEST_SINCE : 0;
+        req.since = cmd->since;
+        break;
+    default:
+        return 1;
+    }
+
+    if (denv_client_connect(&client, socket_path) != 0)
+        return 1;
+
+    if ((req.op == DENV_OP_SET || req.op == DENV_OP_APPEND) && cmd->is_stdin) {
+        buffer = read_fd(STDIN_FILENO, &len, &is_mapped);
+        if (!buffer) {
+            print_err("Couldn't read from stdin.\n");
+            denv_client_close(&client);
+            return -1;
+        }
+        value = buffer;
+    } else if (value) {
+        len = strlen(value);
+    }
+    req.value_len = len;
+
+    DenvResponse resp;
+    char *data;
+    int error = 0;
+
+    if (denv_client_request(&client, req, name, separator, value) != 0 ||
+        denv_client_response(&client, &resp, &data) != 0) {
+        print_err("Lost the connection to the daemon.\n");
+        error = -1;
+    } else if (req.op == DENV_OP_GET) {
+        if (resp.status == 0) {
+            fwrite(data, 1, resp.len, stdout);
+            if (!cmd->is_raw)
+                putchar('\n');
+        }
+    } else if (req.op == DENV_OP_LIST) {
+        fwrite(data, 1, resp.len, stdout);
+    } else if (req.op == DENV_OP_AWAIT) {
+        if (cmd->has_since)
+            printf("%" PRIu64 "\n", resp.generation);
+    } else if (resp.status != 0) {
+        print_err("Not enough memory to store \"%s\".\n", name);
+        error = -1;
+    }
+
+    if (buffer)
+        release_fd_data(buffer, len, is_mapped);
+    denv_client_close(&client);
+
+    return error;
+}
+
 int main(int argc, char **argv, char **envp) {
 
     if (argc < 2) {
@@ -812,6 +2017,15 @@ int main(int argc, char **argv, char **envp) {
             case PARSE_ERROR_TOO_MANY_ARGUMENTS_OR_MISSING_NAME:
                     print_err("Too many arguments or missing name.\n");
                 break;
+            case PARSE_ERROR_INVALID_NUMBER:
+                    print_err("Invalid number.\n");
+                break;
+            case PARSE_ERROR_UNKNOWN_CODEC:
+                    print_err("Unknown codec, use none, zlib, lz4 or zstd.\n");
+                break;
+            case PARSE_ERROR_UNKNOWN_DURABILITY:
+                    print_err("Unknown level, use none, log or sync.\n");
+                break;
             case PARSE_ERROR_UNIMPLEMENTED:
                     print_err("Feature not implemented yet.\n");
                 break;
@@ -840,7 +2054,9 @@ int main(int argc, char **argv, char **envp) {
             "   .force=%s;\n"
             "   .suppress=%s,\n"
             "   .is_stdin=%s,\n"
-            "   .is_stdout=%s\n"
+            "   .is_stdout=%s,\n"
+            "   .is_raw=%s,\n"
+            "   .is_prefix=%s\n"
             "};\x1b[0m\n",
             cmd.bind_path ? cmd.bind_path : "(nil)",
             cmd.name ? cmd.name : "(nil)",
@@ -855,7 +2071,9 @@ int main(int argc, char **argv, char **envp) {
             t[cmd.force],
             t[cmd.suppress],
             t[cmd.is_stdin],
-            t[cmd.is_stdout]
+            t[cmd.is_stdout],
+            t[cmd.is_raw],
+            t[cmd.is_prefix]
         );
 
     #endif
@@ -883,11 +2101,40 @@ int main(int argc, char **argv, char **envp) {
         path = load_path();
     }
 
-    table = init_on_path(path);
-    if(!table) return -1;    
+    char socket_path[PATH_BUFFER_LENGHT] = {0};
+    snprintf(socket_path, PATH_BUFFER_LENGHT, "%s%s", path, DENV_SOCKET_PATH);
+
+    // a running daemon answers without attaching the table
+    if (cmd.state != DAEMON) {
+        int ret = run_client(&cmd, socket_path);
+        if (ret != 1)
+            return ret;
+    }
 
     int error = 0;
     char input_buffer[BUFF_SIZE] = {0};
+
+    // without attaching, the table may be one of another version
+    if (cmd.state == DROP) {
+        // Ask if you are sure
+        if (cmd.force == false) {
+            printf("Are you sure you want to destroy the shared memory "
+                   "environment? [N/y]\n");
+            fgets(input_buffer, BUFF_SIZE, stdin);
+            if (input_buffer[0] != 'y' && input_buffer[0] != 'Y') return 0;
+        }
+
+        if (denv_shmem_destroy(path) == false) {
+            print_err("Failed to destroy the shared memory environment.\n");
+            return -1;
+        }
+
+        return 0;
+    }
+
+    table = init_on_path(path);
+    if(!table) return -1;    
+
     char *name = cmd.name;
     char *value = cmd.value;
 
@@ -901,73 +2148,58 @@ int main(int argc, char **argv, char **envp) {
             }
             
             if (cmd.is_stdin) {
-                char *buffer = calloc(BUFF_SIZE, sizeof(char));
+                size_t len;
+                bool is_mapped;
+
+                char *buffer = read_fd(STDIN_FILENO, &len, &is_mapped);
                 if (!buffer) {
-                    print_err("Couldn't allocate more memory.\n");
+                    print_err("Couldn't read from stdin.\n");
                     error = -1;
                     break;
                 }
-                size_t len = 0, acc = 0;
-                do {
-                    if(acc) {
-                        buffer = realloc(buffer, acc + BUFF_SIZE);
-                        if (!buffer) {
-                            print_err("Couldn't reallocate more memory.\n");
-                            error = -1;
-                            break;
-                        }               
-                    }
-                    len = fread(buffer + acc, sizeof(char), BUFF_SIZE, stdin);
-                    if(ferror(stdin) != 0) {
-                        print_err("Couldn't read from stdin.\n");
-                        free(buffer);
-                        error = -1;
-                        break;
-                    }
-                    acc += len;
-                } while(len == BUFF_SIZE);
 
-                denv_table_set_value(table, name, buffer, flags);
+                if (denv_table_set_value_n(table, name, buffer, len, flags) !=
+                    0) {
+                    print_err("Not enough memory to store \"%s\".\n", name);
+                    error = -1;
+                }
 
-                free(buffer);
+                release_fd_data(buffer, len, is_mapped);
             } else {
-                denv_table_set_value(table, name, value, flags);
+                if (denv_table_set_value(table, name, value, flags) != 0) {
+                    print_err("Not enough memory to store \"%s\".\n", name);
+                    error = -1;
+                }
             }            
         } break;
         
-        case GET:
-            value = denv_table_get_value(table, name);
+        case GET: {
+            size_t value_len;
+            DenvView view;
+
+            if (cmd.is_prefix) {
+                denv_table_list_values(table, name, DENV_LIST_VALUES);
+                break;
+            }
+
+            value = acquire_value(table, name, &value_len, &view);
 
             if (value) {
-                printf("%s\n", value);
+                fwrite(value, 1, value_len, stdout);
+                if (!cmd.is_raw)
+                    putchar('\n');
+                release_value(table, value, &view);
             }
-            break;
+        } break;
         case REMOVE:
 
             denv_table_delete_value(table, name);
         
             break;
             
-        case DROP:
-
-            // Ask if you are sure
-            if (cmd.force == false) {
-                printf("Are you sure you want to destroy the shared memory "
-                       "environment? [N/y]\n");
-                fgets(input_buffer, BUFF_SIZE, stdin);
-                if (input_buffer[0] != 'y' && input_buffer[0] != 'Y') break;
-            }    
-
-            if (denv_shmem_destroy(path) == false) {
-                print_err("Failed to destroy the shared memory environment.\n");
-                error = -1;
-                break;
-            }
-        
-            break;
-
         case LIST:
-                denv_table_list_values(table, !cmd.suppress);
+                denv_table_list_values(table, name ? name : "",
+                                       cmd.suppress ? 0 : DENV_LIST_ENV);
             break;
             
         case STATS: {
@@ -988,11 +2220,12 @@ int main(int argc, char **argv, char **envp) {
             } break;
             
         case CLEANUP:
-            denv_clear_freed(table);
+            denv_table_compact(table);
             break;
             
         case SAVE:
-            denv_save_to_file(table, cmd.save_path);
+            if (denv_save_to_file(table, cmd.save_path, cmd.codec, NULL) != 0)
+                error = -1;
             break;
 
         case LOAD:
@@ -1007,16 +2240,25 @@ int main(int argc, char **argv, char **envp) {
                 if (input_buffer[0] != 'y' && input_buffer[0] != 'Y') break;
             }
 
-            table = denv_load_from_file(table, cmd.save_path);
+            table = denv_load_from_file(table, cmd.save_path, NULL);
             if (table == NULL) {
                print_err("Failed to load from file.\n");
                error = -1; 
             }
             break;
             
-        case AWAIT:
-            denv_await_element(table, name, POLLING_INTERVAL);
-            break;
+        case AWAIT: {
+                uint64_t since = cmd.has_since
+                                     ? cmd.since
+                                     : denv_table_get_generation(table, name);
+
+                uint64_t generation = denv_await_element(table, name, since);
+
+                // print it so the next call can resume with --since
+                if (cmd.has_since) {
+                    printf("%" PRIu64 "\n", generation);
+                }
+            } break;
 
         case EXEC: {
         
@@ -1057,23 +2299,61 @@ int main(int argc, char **argv, char **envp) {
                 error = -1;
                 break;
             }
-            if (check_path(save_file_path)) {
-                table = denv_load_from_file(table, save_file_path);
+            char delta_file_path[PATH_BUFFER_LENGHT] = {0};
+            strncpy(delta_file_path, save_file_path, PATH_BUFFER_LENGHT - 1);
+            strncat_s(delta_file_path, ".delta", PATH_BUFFER_LENGHT);
+
+            // before anything is loaded, a second daemon would overwrite
+            // the first one's newer writes with what's on disk
+            int listen_fd = daemon_listen(socket_path);
+            if (listen_fd == -1) {
+                error = -1;
+                break;
+            }
+
+            DaemonSaves saves = {.save_path = save_file_path,
+                                 .delta_path = delta_file_path,
+                                 .codec = codec_option(),
+                                 .durable_generation = UINT64_MAX};
+
+            // a table file already has what was saved, unless it's new
+            bool is_loaded =
+                denv_table_is_file(table) && table->element.used > 0;
+
+            // the log has newer writes than the table unless it's empty
+            uint64_t since = table->last_generation;
+
+            // loading what's on disk isn't logged again
+            g_denv_wal.paused++;
+
+            if (!is_loaded && check_path(save_file_path)) {
+                DenvSaveInfo info;
+
+                table = denv_load_from_file(table, save_file_path, &info);
                 if(table == NULL) {
+                    close(listen_fd);
+                    unlink(socket_path);
                     error = -1;
                     break;
                 }
+
+                // writes after the snapshot, if the daemon didn't stop cleanly
+                if (check_path(delta_file_path) &&
+                    denv_load_from_file(table, delta_file_path, &info) ==
+                        NULL) {
+                    print_err("Couldn't load \"%s\", writes after the last "
+                              "snapshot are lost.\n", delta_file_path);
+                }
+
+                // the table is what's on disk, the next write takes a snapshot
+                saves.durable_generation = table->last_generation;
+                since = info.generation;
             }
-            // hang-up until SIGTERM
-            sigset_t set;
-            int sig;
 
-            sigemptyset(&set);
-            sigaddset(&set, SIGTERM);
-            sigaddset(&set, SIGHUP);
-            sigaddset(&set, SIGINT);
+            g_denv_wal.paused--;
 
-            sigprocmask(SIG_BLOCK, &set, NULL);
+            // writes after the saves, the next save has them
+            daemon_wal_recover(table, since);
 
             int pid = getpid();
 
@@ -1081,7 +2361,23 @@ int main(int argc, char **argv, char **envp) {
 
             openlog("DENV", LOG_PID | LOG_CONS, LOG_USER);
 
-            if (sigwait(&set, &sig) == 0) {
+            // serve the socket and compact the table until a signal arrives
+            int sig = daemon_run(table, listen_fd, socket_path,
+                                 denv_table_is_file(table) ? NULL : &saves);
+
+            if (saves.delta.is_running)
+                daemon_save_finish(&saves, &saves.delta);
+            if (saves.fold.is_running)
+                daemon_save_finish(&saves, &saves.fold);
+
+            if (denv_table_is_file(table)) {
+                if (denv_table_sync(table, true) != 0 || sig <= 0) {
+                    syslog(LOG_ERR, "Couldn't write the table file.");
+                    error = -1;
+                } else if (table->wal.rotated_generation != 0) {
+                    denv_wal_drop_rotated(table);
+                }
+            } else if (sig > 0) {
                 // Check if file exists, move to .old and then save new file
                 if (check_path(save_file_path)) {
                     char new_path[PATH_BUFFER_LENGHT] = {0};
@@ -1097,10 +2393,16 @@ int main(int argc, char **argv, char **envp) {
                     }
                 }
 
-                if (denv_save_to_file(table, save_file_path) != 0) {
+                if (denv_save_to_file(table, save_file_path, saves.codec,
+                                      NULL) != 0) {
                     error = -1;
                     break;   
                 }
+                unlink(delta_file_path);
+
+                // the save has every write of the old log
+                if (table->wal.rotated_generation != 0)
+                    denv_wal_drop_rotated(table);
             } else {
                 syslog(LOG_ERR, "Daemon was interrupted abruptly, couldn't "
                                 "save it's state.");
@@ -1115,105 +2417,82 @@ int main(int argc, char **argv, char **envp) {
 
         case APPEND: {
 
-            char *old_value = denv_table_get_value(table, name);
+            char *separator = cmd.separator ? cmd.separator : "\n";
 
             if (cmd.is_stdin) {
-                char *buffer = calloc(BUFF_SIZE, sizeof(char));
+                size_t len;
+                bool is_mapped;
+
+                char *buffer = read_fd(STDIN_FILENO, &len, &is_mapped);
                 if (!buffer) {
-                    print_err("Couldn't allocate more memory.\n");
+                    print_err("Couldn't read from stdin.\n");
                     error = -1;
                     break;
                 }
-                size_t len = 0, acc = 0;
-                do {
-                    if(acc) {
-                        buffer = realloc(buffer, acc + BUFF_SIZE);
-                        if (!buffer) {
-                            print_err("Couldn't reallocate more memory.\n");
-                            error = -1;
-                            break;
-                        }               
-                    }
-                    len = fread(buffer + acc, sizeof(char), BUFF_SIZE, stdin);
-                    if(ferror(stdin) != 0) {
-                        print_err("Couldn't read from stdin.\n");
-                        free(buffer);
-                        error = -1;
-                        break;
-                    }
-                    acc += len;
-                } while(len == BUFF_SIZE);
 
-                size_t new_buffer_lenght = 0;
-                if(old_value) {
-
-                    if(old_value) {
-                        new_buffer_lenght += strlen(old_value);
-                    }
-
-                    new_buffer_lenght += strlen(buffer) + 4;
-                    
-                    if(cmd.separator) {
-                        new_buffer_lenght += strlen(cmd.separator);
-                    }
-
-                    char *new_buffer = malloc(new_buffer_lenght);
-                    if(new_buffer == NULL) {
-                        print_err("Couldn't allocate more memory.\n");
-                        error = -1;
-                        break;
-                    }
-
-                    if(cmd.separator) {
-                        snprintf(new_buffer, new_buffer_lenght, "%s%s%s", old_value, cmd.separator, buffer);
-                    } else {
-                        snprintf(new_buffer, new_buffer_lenght, "%s\n%s", old_value, buffer);
-                    }
-
-                    denv_table_set_value(table, name, new_buffer, 0);
-
-                    free(new_buffer);
-                  
-                } else {
-                    denv_table_set_value(table, name, buffer, 0);
+                if (denv_table_append_value(table, name, separator, buffer,
+                                            len) != 0) {
+                    print_err("Not enough memory to store \"%s\".\n", name);
+                    error = -1;
                 }
 
-                free(buffer);
+                release_fd_data(buffer, len, is_mapped);
             } else {
+                if (denv_table_append_value(table, name, separator, value,
+                                            strlen(value)) != 0) {
+                    print_err("Not enough memory to store \"%s\".\n", name);
+                    error = -1;
+                }
+            }
+        } break;
 
-                size_t new_buffer_lenght = 0;
+        case BATCH:
+        case TX: {
+            int fd = STDIN_FILENO;
 
-                if(old_value) {
-                    new_buffer_lenght += strlen(old_value);
+            if (cmd.input_path) {
+                fd = open(cmd.input_path, O_RDONLY);
+                if (fd == -1) {
+                    print_err("Couldn't open \"%s\": %s.\n", cmd.input_path,
+                              strerror(errno));
+                    error = -1;
+                    break;
                 }
+            }
 
-                new_buffer_lenght += strlen(value) + 4;
+            size_t len;
+            bool is_mapped;
 
-                if(cmd.separator) {
-                    new_buffer_lenght += strlen(cmd.separator);
-                }
+            char *input = read_fd(fd, &len, &is_mapped);
+            if (fd != STDIN_FILENO)
+                close(fd);
 
-                char *new_buffer = malloc(new_buffer_lenght);
-                if(new_buffer == NULL) {
-                        print_err("Couldn't allocate more memory.\n");
-                        error = -1;
-                        break;
-                }
+            if (!input) {
+                print_err("Couldn't read the commands.\n");
+                error = -1;
+                break;
+            }
 
-                if(cmd.separator) {
-                    snprintf(new_buffer, new_buffer_lenght, "%s%s%s", old_value, cmd.separator, value);
-                } else if (old_value != NULL){
-                    snprintf(new_buffer, new_buffer_lenght, "%s\n%s", old_value, value);
-                } else {
-                    snprintf(new_buffer, new_buffer_lenght, "%s", value);
-                }
+            char delim = cmd.is_nul_delimited ? '\0' : '\n';
+            if (cmd.state == BATCH)
+                error = run_batch(table, input, len, delim);
+            else
+                error = run_tx(table, input, len, delim);
 
-                denv_table_set_value(table, name, new_buffer, 0);
+            release_fd_data(input, len, is_mapped);
+        } break;
 
-                free(new_buffer);
-            
+        case WAL:
+            if (cmd.has_durability) {
+                if (denv_table_set_durability(table, cmd.durability) != 0) {
+                    print_err("Couldn't write the log level.\n");
+                    error = -1;
+                }
+            } else {
+                printf("%s\n",
+                       denv_durability_names[atomic_load(&table->wal.level)]);
             }
-        } break;
+            break;
         
         default:
 
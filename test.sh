@@ -0,0 +1,493 @@
+#!/usr/bin/env bash
+
+# Runs denv through its save formats, crash recovery and queries, each check
+# on bind paths of its own. Prints one line per check and exits with the
+# number of failed ones.
+#
+#   ./test.sh [check...]
+
+denv=${DENV:-./denv}
+resources=$(dirname "$0")/resources
+failed=0
+dirs=()
+daemons=()
+
+cleanup() {
+    for pid in "${daemons[@]}"; do
+        kill -9 "$pid" 2>/dev/null
+    done
+    for dir in "${dirs[@]}"; do
+        $denv drop -fb "$dir" >/dev/null 2>&1
+        mountpoint -q "$dir" && umount "$dir"
+        rm -rf "$dir"
+    done
+}
+
+trap cleanup EXIT
+
+# new bind path in $bind
+fresh() {
+    bind=$(mktemp -d)
+    dirs+=("$bind")
+}
+
+# expect <what> <expected> <actual>
+expect() {
+    if [ "$2" == "$3" ]; then
+        printf "ok    %s\n" "$1"
+    else
+        printf "FAIL  %s\n      expected: %q\n      got:      %q\n" "$1" "$2" "$3"
+        failed=$((failed + 1))
+    fi
+}
+
+# daemon_start <bind>, its pid in $daemon once it answers on its socket, not
+# the one a killed daemon left
+daemon_start() {
+    local stale=$(stat -c %i "$1/denv.sock" 2>/dev/null)
+    $denv daemon -b "$1" - >/dev/null 2>&1 &
+    daemon=$!
+    daemons+=("$daemon")
+    for i in $(seq 50); do
+        if [ -S "$1/denv.sock" ] &&
+            [ "$(stat -c %i "$1/denv.sock")" != "$stale" ]; then
+            # answered once the save is loaded
+            $denv get -b "$1" started >/dev/null 2>&1
+            return
+        fi
+        sleep 0.1
+    done
+}
+
+# wait_for <path>, up to 5 seconds
+wait_for() {
+    for i in $(seq 50); do
+        [ -e "$1" ] && return
+        sleep 0.1
+    done
+}
+
+# build <source> <binary>, a program of its own on denv.h
+build() {
+    local version=($(tr '.' ' ' < "$(dirname "$0")/version"))
+    cc -I"$(dirname "$0")" "$1" -o "$2" -lz -pthread \
+        -DDENV_VERSION_A=${version[0]} -DDENV_VERSION_B=${version[1]} \
+        -DDENV_VERSION_C=${version[2]}
+}
+
+# pin <bind> <name...>, a reader keeps the values pinned until unpin
+pin() {
+    local bind=$1
+    shift
+    cat > "$bind/pinner.c" <<'EOF'
+#define DENV_IMPLEMENTATION
+#include "denv.h"
+
+int main(int argc, char **argv) {
+    DenvTable *table = denv_attach(argv[1]);
+    DenvView views[argc];
+    char *copies[argc];
+    if (table == NULL)
+        return 1;
+
+    for (int i = 2; i < argc; i++) {
+        if (denv_view_pin(table, argv[i], &views[i]) != 0)
+            return 1;
+        copies[i] = strndup(views[i].value, views[i].len);
+    }
+
+    puts("pinned");
+    fflush(stdout);
+    getchar();
+
+    for (int i = 2; i < argc; i++) {
+        bool is_kept = memcmp(copies[i], views[i].value, views[i].len) == 0 &&
+                       views[i].value[views[i].len] == '\0';
+        puts(is_kept ? "kept" : "overwritten");
+        denv_view_release(table, &views[i]);
+    }
+}
+EOF
+    build "$bind/pinner.c" "$bind/pinner"
+    mkfifo "$bind/unpin"
+    "$bind/pinner" "$bind" "$@" < "$bind/unpin" > "$bind/pinned" &
+    pinner=$!
+    exec 3> "$bind/unpin"
+    for i in $(seq 50); do
+        [ -s "$bind/pinned" ] && return
+        sleep 0.1
+    done
+}
+
+# unpin <bind>, prints whether the pinned bytes were kept
+unpin() {
+    echo >&3
+    exec 3>&-
+    wait $pinner
+    echo $(cat "$1/pinned")
+}
+
+# fill <bind>, the same variables every time
+fill() {
+    $denv set -b "$1" plain value
+    $denv set -eb "$1" EXPORTED "exported value"
+    printf 'zero\0bytes\n' | $denv set -b "$1" binary -
+    $denv set -b "$1" removed x
+    $denv rm -b "$1" removed
+    $denv set -b "$1" empty ""
+}
+
+# dump <bind>, every name and value
+dump() {
+    $denv ls -b "$1"
+    for name in $($denv ls -xb "$1"); do
+        echo "$name=$($denv get -rb "$1" "$name" | od -An -c | tr -s '\n ' ' ')"
+    done
+}
+
+test_roundtrip() {
+    fresh
+    local src=$bind
+    fill "$src"
+    local expected=$(dump "$src")
+
+    for codec in none zlib lz4 zstd; do
+        if ! $denv save -b "$src" --codec $codec "$src/$codec.save" \
+            2>/dev/null; then
+            printf "skip  round trip with %s, not built\n" $codec
+            continue
+        fi
+        fresh
+        $denv load -fb "$bind" "$src/$codec.save"
+        expect "round trip with $codec" "$expected" "$(dump "$bind")"
+    done
+}
+
+test_damaged() {
+    fresh
+    fill "$bind"
+    $denv save -b "$bind" --codec none "$bind/save"
+    local before=$(dump "$bind")
+    local size=$(stat -c %s "$bind/save")
+
+    cp "$bind/save" "$bind/flipped"
+    printf 'X' | dd of="$bind/flipped" bs=1 seek=$((size / 2)) conv=notrunc \
+        2>/dev/null
+    ! $denv load -fb "$bind" "$bind/flipped" 2>/dev/null
+    expect "flipped byte is refused" "0 $before" "$? $(dump "$bind")"
+
+    head -c $((size - 5)) "$bind/save" > "$bind/truncated"
+    ! $denv load -fb "$bind" "$bind/truncated" 2>/dev/null
+    expect "truncated save is refused" "0 $before" "$? $(dump "$bind")"
+}
+
+# written by denv 1.1.0: foo, COLLIDE_2269 in the collision array, EXPORTED,
+# over set twice, K_1 to K_40 and gone, removed
+legacy_expected() {
+    printf "%s\n" foo=bar "COLLIDE_2269=in the collision array" \
+        "EXPORTED=exported value" "over=second, longer value" "K_7=value 7" \
+        "gone=" "names=44"
+}
+
+legacy_dump() {
+    for name in foo COLLIDE_2269 EXPORTED over K_7 gone; do
+        echo "$name=$($denv get -b "$1" $name)"
+    done
+    echo "names=$($denv ls -b "$1" | wc -l)"
+}
+
+test_legacy() {
+    fresh
+    $denv load -fb "$bind" "$resources/save-1.1.0.denv"
+    expect "load of a 1.1.0 save" "$(legacy_expected)" "$(legacy_dump "$bind")"
+    expect "1.1.0 exported variable" "EXPORTED             (ENV)" \
+        "$($denv ls -b "$bind" | grep EXPORTED)"
+    # 1.1.0 wrote them in slot order
+    local names=$($denv ls -b "$bind" | cut -d' ' -f1)
+    expect "1.1.0 names listed in order" "$(LC_ALL=C sort <<< "$names")" \
+        "$names"
+
+    fresh
+    cp "$resources/save-1.1.0.denv" "$bind/save.denv"
+    daemon_start "$bind"
+    expect "daemon starts from a 1.1.0 save" "$(legacy_expected)" \
+        "$(legacy_dump "$bind")"
+    $denv set -b "$bind" after upgrade
+    kill $daemon
+    wait $daemon 2>/dev/null
+
+    fresh
+    $denv load -fb "$bind" "${dirs[-2]}/save.denv"
+    expect "daemon saves it in the new format" "upgrade" \
+        "$($denv get -b "$bind" after)"
+}
+
+# glob <pattern>, the names get --prefix prints
+glob() {
+    $denv get -b "$bind" --prefix "$1" | cut -d= -f1 | tr '\n' ' '
+}
+
+test_glob() {
+    fresh
+    for name in b2 ab B abc b10 a b1 c_1; do
+        $denv set -b "$bind" $name value
+    done
+    expect "prefix in name order" "ab abc " "$(glob ab)"
+    expect "star" "a ab abc " "$(glob 'a*')"
+    expect "question mark" "b1 b2 " "$(glob 'b?')"
+    expect "bracket" "b1 b10 " "$(glob 'b[01]*')"
+    expect "bracket of a star" "" "$(glob 'a[*]')"
+    expect "backslash doesn't escape" "" "$(glob 'a\b*')"
+    expect "ls in name order" "B a ab abc b1 b10 b2 c_1 " \
+        "$($denv ls -b "$bind" | tr '\n' ' ')"
+}
+
+# the delta since the snapshot is what a killed daemon comes back from
+test_delta() {
+    fresh
+    daemon_start "$bind"
+    fill "$bind"
+    for i in $(seq 100); do
+        echo "set name_$i value $i"
+    done | $denv batch -b "$bind" >/dev/null
+    wait_for "$bind/save.denv"
+    $denv set -b "$bind" late "after the snapshot"
+    $denv rm -b "$bind" name_7
+    wait_for "$bind/save.denv.delta"
+    expect "delta written next to the snapshot" yes \
+        "$([ -e "$bind/save.denv.delta" ] && echo yes)"
+    local expected=$(dump "$bind")
+    kill -9 $daemon
+    wait $daemon 2>/dev/null
+    rm -f "$bind"/*.wal*
+
+    $denv drop -fb "$bind"
+    daemon_start "$bind"
+    expect "daemon comes back from snapshot and delta" "$expected" \
+        "$(dump "$bind")"
+    kill $daemon
+    wait $daemon 2>/dev/null
+}
+
+# a logged load past the size kept in memory, and one killed before it's
+# published
+test_load() {
+    fresh
+    local src=$bind
+    awk 'BEGIN { for (i = 0; i < 60000; i++) printf "set L_%d %0120d\n", i, i }' \
+        | $denv batch -b "$src" >/dev/null
+    $denv save -b "$src" --codec none "$src/big.save"
+
+    fresh
+    $denv wal -b "$bind" log
+    $denv load -fb "$bind" "$src/big.save"
+    local expected=$($denv get -b "$bind" --prefix L_ | md5sum)
+    $denv drop -fb "$bind"
+    daemon_start "$bind"
+    expect "daemon replays a logged load" "$expected" \
+        "$($denv get -b "$bind" --prefix L_ | md5sum)"
+    kill $daemon
+    wait $daemon 2>/dev/null
+
+    fresh
+    $denv set -b "$bind" kept value
+    local before=$(ipcs -m | grep -c '^0x')
+    $denv load -fb "$bind" "$src/big.save" &
+    local loader=$!
+    # killed once its staged segment is there
+    while kill -0 $loader 2>/dev/null &&
+        [ "$(ipcs -m | grep -c '^0x')" -le "$before" ]; do
+        :
+    done
+    kill -9 $loader 2>/dev/null
+    wait $loader 2>/dev/null
+    $denv drop -fb "$bind"
+    expect "segment of a killed load is removed" "$((before - 1))" \
+        "$(ipcs -m | grep -c '^0x')"
+}
+
+# a writer killed mid-write leaves the lock taken and seq odd, the next
+# reader and writer take the table back
+test_killed() {
+    fresh
+    $denv set -b "$bind" x before
+    cat > "$bind/writer.c" <<'EOF'
+#define DENV_IMPLEMENTATION
+#include "denv.h"
+
+int main(int argc, char **argv) {
+    DenvTable *table = denv_attach(argv[1]);
+    if (table == NULL)
+        return 1;
+
+    denv_table_write_begin(table);
+    raise(SIGKILL);
+}
+EOF
+    build "$bind/writer.c" "$bind/writer"
+    "$bind/writer" "$bind" &
+    wait $! 2>/dev/null
+
+    expect "read after a writer died mid-write" before \
+        "$(timeout 10 $denv get -b "$bind" x 2>/dev/null)"
+    timeout 10 $denv set -b "$bind" x after 2>/dev/null
+    expect "write after a writer died mid-write" after \
+        "$(timeout 10 $denv get -b "$bind" x 2>/dev/null)"
+}
+
+# an append to a pinned value puts it somewhere else, also when it fits its
+# slice or the slice is the last one of the block
+test_append() {
+    fresh
+    $denv set -b "$bind" last "$(printf %0100d 0)"
+    echo "ap -s : last x" | $denv batch -b "$bind"
+    pin "$bind" last
+    echo "ap -s : last y" | $denv batch -b "$bind"
+    echo "ap -s : last $(printf %0300d 0)" | $denv batch -b "$bind"
+    expect "appended to a pinned value" "$(printf %0100d:x:y:%0300d 0 0)" \
+        "$($denv get -b "$bind" last)"
+    expect "pinned value kept through appends" "pinned kept" \
+        "$(unpin "$bind")"
+}
+
+# compaction packs the block around values a reader keeps pinned, one
+# replaced while pinned and one still current, and leaves their bytes be
+test_compact() {
+    fresh
+    for i in $(seq 400); do
+        printf 'set name_%d %0200d\n' $i $i
+    done | $denv batch -b "$bind" >/dev/null
+
+    pin "$bind" name_200 name_300
+    $denv set -b "$bind" name_200 replaced
+    for i in $(seq 1 2 400); do
+        echo "rm name_$i"
+    done | $denv batch -b "$bind" >/dev/null
+    local expected=$(dump "$bind")
+    $denv cleanup -b "$bind"
+    local packed=$($denv stats -b "$bind" | tail -1 | cut -d, -f2,8)
+
+    expect "block packed around pinned values" 1 \
+        "$((${packed#*,} <= 2))"
+    expect "values kept through compaction" "$expected" "$(dump "$bind")"
+    for i in $(seq 401 500); do
+        printf 'set name_%d %0200d\n' $i $i
+    done | $denv batch -b "$bind" >/dev/null
+    expect "free space before the pins reused" "${packed%,*}" \
+        "$($denv stats -b "$bind" | tail -1 | cut -d, -f2)"
+    expect "pinned values kept in place" "pinned kept kept" \
+        "$(unpin "$bind")"
+    expect "value set after compaction" "$(printf %0200d 450)" \
+        "$($denv get -b "$bind" name_450)"
+}
+
+# a table of another layout is refused until it's dropped, the magic of a
+# table file is cleared for one
+test_layout() {
+    fresh
+    DENV_SHM=file $denv set -b "$bind" x value
+    dd if=/dev/zero of="$bind/table.denv" bs=8 count=1 conv=notrunc \
+        2>/dev/null
+    local out
+    out=$($denv get -b "$bind" x 2>&1)
+    expect "table of another layout is refused" "255 1" \
+        "$? $(grep -c 'denv drop -b' <<< "$out")"
+    $denv drop -fb "$bind"
+    $denv set -b "$bind" x new
+    expect "dropped and made again" new "$($denv get -b "$bind" x)"
+}
+
+# with the saves gone, the log alone brings back a killed daemon's writes,
+# the torn tail of one cut halfway is left out
+test_wal() {
+    fresh
+    daemon_start "$bind"
+    $denv wal -b "$bind" sync
+    fill "$bind"
+    for i in $(seq 100); do
+        echo "set name_$i value $i"
+    done | $denv batch -b "$bind" >/dev/null
+    $denv rm -b "$bind" name_7
+    local expected=$(dump "$bind")
+    kill -9 $daemon
+    wait $daemon 2>/dev/null
+    rm -f "$bind"/save.denv*
+    printf 'torn record' >> "$bind/wal.denv"
+
+    $denv drop -fb "$bind"
+    daemon_start "$bind"
+    expect "daemon comes back from the log" "$expected" "$(dump "$bind")"
+    expect "log level kept" sync "$($denv wal -b "$bind")"
+    $denv set -b "$bind" after torn
+    kill -9 $daemon
+    wait $daemon 2>/dev/null
+    rm -f "$bind"/save.denv*
+
+    $denv drop -fb "$bind"
+    daemon_start "$bind"
+    expect "writes after the torn tail" torn "$($denv get -b "$bind" after)"
+    kill $daemon
+    wait $daemon 2>/dev/null
+}
+
+# a second daemon on the same bind path leaves before loading the save
+test_single() {
+    fresh
+    daemon_start "$bind"
+    $denv set -b "$bind" x saved
+    wait_for "$bind/save.denv"
+    sleep 1.5
+    $denv set -b "$bind" x newer
+    ! $denv daemon -b "$bind" - >/dev/null 2>&1
+    expect "second daemon leaves the table alone" "0 newer" \
+        "$? $($denv get -b "$bind" x)"
+    expect "socket only for its owner" "srw-------" \
+        "$(stat -c %A "$bind/denv.sock")"
+    kill $daemon
+    wait $daemon 2>/dev/null
+}
+
+# a full disk fails the save, which is tried again once there's room
+test_full() {
+    if [ "$(id -u)" != 0 ]; then
+        printf "skip  full disk, needs root for a tmpfs\n"
+        return
+    fi
+    fresh
+    mount -t tmpfs -o size=256k tmpfs "$bind" || return
+    daemon_start "$bind"
+    $denv set -b "$bind" kept value
+    $denv set -b "$bind" removed x
+    wait_for "$bind/save.denv"
+    sleep 1.5
+
+    local free=$(df --output=avail -k "$bind" | tail -1)
+    dd if=/dev/zero of="$bind/filler" bs=1k count=$((free - 40)) 2>/dev/null
+    $denv rm -b "$bind" removed
+    head -c 100000 /dev/urandom | base64 -w0 | $denv set -b "$bind" big -
+    local expected=$(dump "$bind")
+    sleep 2
+    rm "$bind/filler"
+    sleep 11
+    kill -9 $daemon
+    wait $daemon 2>/dev/null
+    rm -f "$bind"/*.wal*
+
+    $denv drop -fb "$bind"
+    daemon_start "$bind"
+    expect "save written once the disk has room" "$expected" \
+        "$(dump "$bind")"
+    kill $daemon
+    wait $daemon 2>/dev/null
+    # its key comes from the mount, the segment can't be found once unmounted
+    $denv drop -fb "$bind" >/dev/null
+    umount "$bind"
+}
+
+checks=${*:-roundtrip damaged legacy glob load killed append compact layout delta wal single full}
+
+for check in $checks; do
+    test_$check
+done
+
+exit $failed